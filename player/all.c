@@ -3,6 +3,7 @@
 // Copyright (c) 2015 MIT License by 6.172 Staff
 
 #include <ctype.h>
+#include <math.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -19,6 +20,7 @@
 #include <cilk/reducer.h>
 #endif
 
+#include "./bench.h"
 #include "./eval.h"
 #include "./fen.h"
 #include "./move_gen.h"
@@ -57,6 +59,8 @@ extern int USE_NMM;
 extern int FUT_DEPTH;
 extern int TRACE_MOVES;
 extern int DETECT_DRAWS;
+extern int PARALLEL_ROOT;
+extern int PARALLEL_PV;
 
 // defined in eval.c
 extern int RANDOMIZE;
@@ -67,6 +71,7 @@ extern int KFACE;
 extern int KAGGRESSIVE;
 extern int MOBILITY;
 extern int PAWNPIN;
+extern int EVAL_CACHE;
 
 // defined in move_gen.c
 extern int USE_KO;
@@ -74,6 +79,17 @@ extern int USE_KO;
 // defined in tt.c
 extern int USE_TT;
 extern int HASH;
+extern int LAZY_CLEAR;
+extern int TT_DEPTH_SLOTS;
+extern int TT_SHARED;
+
+// parallel search mode, see the lazy SMP section below
+#define SMP_CILK 0  // parallelism from the Cilk keywords inside the search
+#define SMP_LAZY 1
+#define MAX_THREADS 64
+
+static int THREADS;   // number of search threads in lazy SMP mode
+static int SMP_MODE;  // SMP_CILK or SMP_LAZY
 
 // struct for manipulating options below
 typedef struct {
@@ -101,6 +117,7 @@ static int_options iopts[] = {
   { "pbetween",           &PBETWEEN,   0.2 * PAWN_EV_VALUE,   -PAWN_EV_VALUE, PAWN_EV_VALUE },
   { "pcentral",           &PCENTRAL,   0.05 * PAWN_EV_VALUE,  -PAWN_EV_VALUE, PAWN_EV_VALUE },
   { "hash",                   &HASH,   1024,                    1,              MAX_HASH   },
+  { "eval_cache",       &EVAL_CACHE,   0,                     0,              MAX_HASH   },
   { "draw",                   &DRAW,   -0.07 * PAWN_VALUE,    -PAWN_VALUE,    PAWN_VALUE    },
   { "randomize",         &RANDOMIZE,   0,                     0,              PAWN_EV_VALUE },
   { "lmr_r1",               &LMR_R1,   5,                     1,              MAX_NUM_MOVES },
@@ -110,12 +127,33 @@ static int_options iopts[] = {
   // debug options
   { "use_nmm",             &USE_NMM,   1,                     0,              1             },
   { "detect_draws",   &DETECT_DRAWS,   1,                     0,              1             },
+  { "parallel_root", &PARALLEL_ROOT,   0,                     0,              1             },
+  { "parallel_pv",     &PARALLEL_PV,   1,                     0,              1             },
+  { "threads",             &THREADS,   1,                     1,              MAX_THREADS   },
+  { "smp_mode",           &SMP_MODE,   SMP_CILK,              SMP_CILK,       SMP_LAZY      },
   { "use_tt",               &USE_TT,   1,                     0,              1             },
+  { "lazy_clear",       &LAZY_CLEAR,   1,                     0,              1             },
+  { "tt_depth_slots", &TT_DEPTH_SLOTS, 1,                     0,              7             },
+  { "tt_shared",         &TT_SHARED,   0,                     0,              999           },
   { "use_ko",               &USE_KO,   1,                     0,              1             },
   { "trace_moves",     &TRACE_MOVES,   0,                     0,              1             },
   { "",                        NULL,   0,                     0,              0             }
 };
 
+// Whether the option changes what eval() returns for a position.
+static bool is_eval_option(const char *name) {
+  static const char *eval_options[] = {
+    "hattack", "mobility", "kaggressive", "kface", "pawnpin", "pbetween",
+    "pcentral", NULL
+  };
+  for (int i = 0; eval_options[i] != NULL; i++) {
+    if (strcmp(name, eval_options[i]) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
 // -----------------------------------------------------------------------------
 // Printing helpers
 // -----------------------------------------------------------------------------
@@ -182,6 +220,97 @@ typedef struct {
   double tme;
 } entry_point_args;
 
+// -----------------------------------------------------------------------------
+// Lazy SMP
+// -----------------------------------------------------------------------------
+
+// With smp_mode set to SMP_LAZY, threads - 1 helper threads run their own
+// iterative deepening on the position next to the main search.  They share
+// nothing with it but the transposition table (and the move ordering
+// tables), which they fill with results the main search then finds.  Half of
+// them search one ply deeper than the main search, and each starts the root
+// moves at a different one (set_root_rotation()), so that they are ahead of
+// it rather than repeating its work.
+//
+// Each helper searches on a clock of its own with no time limit, so that
+// only the main search decides when the search stops: smp_stop() aborts the
+// helpers once the main search is done.
+//
+// This needs no runtime support beyond pthreads, so it also runs in builds
+// without Cilk (make NOCILK=1).
+//
+// https://chessprogramming.wikispaces.com/Lazy+SMP
+typedef struct {
+  pthread_t thread;
+  int id;
+  position_t position;
+  int depth;
+  uint64_t node_count;
+  searchClock clock;
+} smp_helper_args;
+
+static smp_helper_args smp_helpers[MAX_THREADS];
+static int num_smp_helpers = 0;
+static FILE *smp_out;  // where the helpers' info lines go
+
+static void *smp_helper(void *arg) {
+  smp_helper_args *helper = (smp_helper_args *) arg;
+  move_t pv;
+
+  use_search_clock(&helper->clock);
+  set_root_rotation(helper->id);
+  init_abort_timer(HUGE_VAL);
+  init_tics();
+
+  for (int d = 1; d <= helper->depth && !should_abort(); d++) {
+    // depth 1 sets up the root move list
+    int helper_depth = d + (d > 1 && (helper->id & 1));
+    if (helper_depth > helper->depth) {
+      helper_depth = helper->depth;
+    }
+    searchRoot(&helper->position, -INF, INF, helper_depth, 0, &pv,
+               &helper->node_count, smp_out);
+  }
+  release_thread_tables();
+  release_thread_counters();
+  return NULL;
+}
+
+// Starts the helper threads on a search of p to the given depth.
+static void smp_start(position_t *p, int depth) {
+  num_smp_helpers = (SMP_MODE == SMP_LAZY) ? THREADS - 1 : 0;
+  if (num_smp_helpers > 0 && smp_out == NULL) {
+    smp_out = fopen("/dev/null", "w");
+  }
+  for (int i = 0; i < num_smp_helpers; i++) {
+    smp_helper_args *helper = &smp_helpers[i];
+    helper->id = i + 1;
+    helper->position = *p;
+    helper->depth = depth;
+    helper->node_count = 0;
+    helper->clock.abortf = false;
+    if (pthread_create(&helper->thread, NULL, smp_helper, helper) != 0) {
+      num_smp_helpers = i;
+      break;
+    }
+  }
+}
+
+// Stops the helper threads and returns the number of nodes they searched.
+static uint64_t smp_stop() {
+  for (int i = 0; i < num_smp_helpers; i++) {
+    abort_search(&smp_helpers[i].clock);
+  }
+
+  uint64_t node_count = 0;
+  for (int i = 0; i < num_smp_helpers; i++) {
+    pthread_join(smp_helpers[i].thread, NULL);
+    node_count += smp_helpers[i].node_count;
+  }
+  num_smp_helpers = 0;
+  return node_count;
+}
+
 void *entry_point(void *arg) {
   move_t subpv;
 
@@ -197,14 +326,18 @@ void *entry_point(void *arg) {
 
   init_best_move_history();
   tt_age_hashtable();
+  reset_counters();
+  laser_reset_stats();
 
   init_tics();
+  smp_start(p, depth);
 
   for (int d = 1; d <= depth; d++) {  // Iterative deepening
     reset_abort();
 
     searchRoot(p, -INF, INF, d, 0, &subpv, &node_count_serial,
                 OUT);
+    merge_best_move_history();
 
     et = elapsed_time();
     bestMoveSoFar = subpv;
@@ -219,6 +352,11 @@ void *entry_point(void *arg) {
     if (et > tme * RATIO_FOR_TIMEOUT) break;
   }
 
+  uint64_t helper_node_count = smp_stop();
+  if (helper_node_count > 0) {
+    fprintf(OUT, "info string lazy smp helpers searched %" PRIu64 " nodes\n",
+            helper_node_count);
+  }
 
   // This unlock will allow the main thread lock/unlock in UCIBeginSearch to
   // proceed
@@ -245,6 +383,9 @@ void UciBeginSearch(position_t *p, int depth, double tme) {
   entry_point(&args);
   move_to_str(bestMoveSoFar, bms, MAX_CHARS_IN_MOVE);
   snprintf(theMove, MAX_CHARS_IN_MOVE, "%s", bms);
+  tt_print_stats(OUT);
+  eval_print_stats(OUT);
+  laser_print_stats(OUT);
   fprintf(OUT, "bestmove %s\n", bms);
   return;
 }
@@ -255,6 +396,11 @@ void UciBeginSearch(position_t *p, int depth, double tme) {
 
 // print help messages in uci
 void help()  {
+  printf("bench     - Time move generation, evaluation and a fixed-depth search\n");
+  printf("            over a built-in set of positions.  Possible arguments are:\n");
+  printf("            <depth>:     search depth (default 5, 0 skips the search)\n");
+  printf("            Sample usage: \n");
+  printf("                bench 6\n");
   printf("eval      - Evaluate current position.\n");
   printf("display   - Display current board state.\n");
   printf("generate  - Generate all possible moves.\n");
@@ -269,13 +415,21 @@ void help()  {
   printf("help      - Display help (this info).\n");
   printf("isready   - Ask if the UCI engine is ready, if so it echoes \"readyok\".\n");
   printf("            This is mainly used to synchronize the engine with the GUI.\n");
+  printf("loadhash  - Replace the hash table with one saved by savehash.\n");
+  printf("            Sample usage: \n");
+  printf("                loadhash opening.tt\n");
   printf("move      - Make a move for current player.\n");
   printf("            Sample usage: \n");
   printf("                move j0j1: move a piece from j0 to j1\n");
-  printf("perft     - Output the number of possible moves upto a given depth.\n");
-  printf("            Used to verify move the generator.\n");
+  printf("perft     - Output the number of possible moves upto a given depth,\n");
+  printf("            starting from the current position.\n");
+  printf("            Used to verify move the generator.  Possible arguments are:\n");
+  printf("            <depth>:     count move paths of length 1--<depth>\n");
+  printf("            divide:      also print the count of every first move\n");
+  printf("            hash <size>: cache subtree counts in a <size> MB table\n");
   printf("            Sample usage: \n");
-  printf("                depth 3: generate all possible moves for depth 1--3\n");
+  printf("                perft 3: generate all possible moves for depth 1--3\n");
+  printf("                perft 6 divide hash 256\n");
   printf("position  - Set up the board using the fenstring given.  Possible arguments are:\n");
   printf("            startpos:     set up the board with default starting position.\n");
   printf("            endgame:      set up the board with endgame configuration.\n");
@@ -284,12 +438,22 @@ void help()  {
   printf("            Sample usage: \n");
   printf("                position endgame: set up the board so that only kings remain\n");
   printf("quit      - Quit this program\n");
+  printf("savehash  - Save the hash table to a file.  Possible arguments are:\n");
+  printf("            <file>:      where to save it\n");
+  printf("            <depth>:     leave out records searched less deep than <depth>\n");
+  printf("            Sample usage: \n");
+  printf("                savehash opening.tt 6\n");
   printf("setoption - Set configuration options used in the engine, the format is: \n");
   printf("            setoption name <name> value <val>.\n");
   printf("            Use the comment \"uci\" to see possible options and their current values\n");
   printf("            Sample usage: \n");
   printf("                setoption name fut_depth value 4: set fut_depth to 4\n");
+  printf("ttstress  - Store and probe the transposition table from all workers at once\n");
+  printf("            and count torn records.  Possible arguments are:\n");
+  printf("            <rounds>:    accesses per task (default 1000000)\n");
   printf("uci       - Display UCI version and options\n");
+  printf("ucinewgame - Forget the previous game: clear the hash table.  With option\n");
+  printf("            lazy_clear set this starts a new age instead of zeroing memory.\n");
   printf("\n");
 }
 
@@ -431,6 +595,7 @@ int main(int argc, char *argv[]) {
 
 
   tt_make_hashtable(HASH);   // initial hash table
+  eval_cache_resize(EVAL_CACHE);
   fen_to_pos(&gme[ix], "");  // initialize with an actual position
 
   //  Check to make sure we don't loop infinitely if we don't get input.
@@ -543,6 +708,11 @@ int main(int argc, char *argv[]) {
         continue;
       }
 
+      if (strcmp(tok[0], "ucinewgame") == 0) {
+        tt_clear_hashtable();
+        continue;
+      }
+
       if (strcmp(tok[0], "setoption") == 0) {
         int sostate = 0;
         char  name[MAX_CHARS_IN_TOKEN];
@@ -603,13 +773,35 @@ int main(int argc, char *argv[]) {
               printf("info setting %s to %d\n", iopts[j].name, v);
               *(iopts[j].var) = v;
 
-              if (strcmp(name+1, "hash") == 0) {
+              if (strcmp(name+1, "hash") == 0 ||
+                  strcmp(name+1, "tt_shared") == 0) {
                 tt_resize_hashtable(HASH);
+                if (TT_SHARED && !tt_is_shared()) {
+                  printf("info string cannot attach shared hash table %d\n",
+                         TT_SHARED);
+                  TT_SHARED = 0;
+                }
+                // a shared table may come with its own Zobrist keys
+                for (int i = 0; i <= ix; i++) {
+                  gme[i].key = compute_zob_key(&gme[i]);
+                }
                 printf("info string Hash table set to %d records of "
                        "%zu bytes each\n",
                        tt_get_num_of_records(), tt_get_bytes_per_record());
                 printf("info string Total hash table size: %zu bytes\n",
                        tt_get_num_of_records() * tt_get_bytes_per_record());
+                printf("info string Hash table pages: %s\n", tt_get_page_type());
+                // scores cached under the old keys are lost
+                eval_cache_clear();
+              }
+              if (strcmp(name+1, "eval_cache") == 0) {
+                eval_cache_resize(EVAL_CACHE);
+                printf("info string Eval cache set to %" PRIu64 " entries\n",
+                       eval_cache_get_num_of_entries());
+              }
+              if (is_eval_option(name+1)) {
+                // scores cached under the old parameters are off now
+                eval_cache_clear();
               }
               break;
             }
@@ -697,8 +889,54 @@ int main(int argc, char *argv[]) {
         continue;
       }
 
+      if (strcmp(tok[0], "bench") == 0) {
+        int depth = 5;
+        if (token_count >= 2) {
+          depth = strtol(tok[1], (char **)NULL, 10);
+        }
+        bench(depth, OUT);
+        continue;
+      }
+
+      if (strcmp(tok[0], "savehash") == 0) {
+        if (token_count < 2) {
+          fprintf(OUT, "Second argument (file name) required.\n");
+          continue;
+        }
+        int min_depth = 0;
+        if (token_count >= 3) {
+          min_depth = strtol(tok[2], (char **)NULL, 10);
+        }
+        tt_save_hashtable(tok[1], min_depth, OUT);
+        continue;
+      }
+
+      if (strcmp(tok[0], "loadhash") == 0) {
+        if (token_count < 2) {
+          fprintf(OUT, "Second argument (file name) required.\n");
+          continue;
+        }
+        if (tt_load_hashtable(tok[1], OUT)) {
+          // the saved table comes with its own Zobrist keys
+          for (int i = 0; i <= ix; i++) {
+            gme[i].key = compute_zob_key(&gme[i]);
+          }
+          eval_cache_clear();
+        }
+        continue;
+      }
+
+      if (strcmp(tok[0], "ttstress") == 0) {  // Test the transposition table
+        int rounds = 1000000;
+        if (token_count >= 2) {
+          rounds = strtol(tok[1], (char **)NULL, 10);
+        }
+        tt_stress_test(rounds, OUT);
+        continue;
+      }
+
       if (strcmp(tok[0], "perft") == 0) {  // Test move generator
-        // Correct output to depth 4
+        // Correct output to depth 4 from the starting position
         // perft  1 78
         // perft  2 6084
         // perft  3 473126
@@ -706,10 +944,21 @@ int main(int argc, char *argv[]) {
 
 
         int depth = 4;
+        bool divide = false;
+        int hash_mb = 0;
+        int n = 1;
         if (token_count >= 2) {  // Takes a depth argument to test deeper
           depth = strtol(tok[1], (char **)NULL, 10);
+          n++;
+        }
+        for (; n < token_count; n++) {
+          if (strcmp(tok[n], "divide") == 0) {
+            divide = true;
+          } else if (strcmp(tok[n], "hash") == 0 && n + 1 < token_count) {
+            hash_mb = strtol(tok[++n], (char **)NULL, 10);
+          }
         }
-        do_perft(gme, depth, 0);
+        do_perft(&gme[ix], depth, divide, hash_mb);
         continue;
       }
 
@@ -740,6 +989,9 @@ calls searchPV() to perform the full search.  A sample parallel
 implementation has been provided for you.
 */
 
+#include "./search.h"
+
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -787,6 +1039,9 @@ int DETECT_DRAWS;  // Detect draws by repetition
 // do not set more than 5 ply
 int FUT_DEPTH;     // set to zero for no futilty
 
+int PARALLEL_ROOT;  // Search the root moves after the first in parallel
+int PARALLEL_PV;    // Search the moves of a PV node after the first in parallel
+
 
 // Declare the two main search functions.
 static score_t searchPV(searchNode *node, int depth,
@@ -817,6 +1072,127 @@ static inline void initialize_pv_node(searchNode* node, int depth) {
   node->best_move_index = 0;
   node->best_score = -INF;
   node->abort = false;
+  node->abort_epoch = node->parent->abort_epoch;
+  node->clock = node->parent->clock;
+}
+
+// Young brothers wait: once the first move of a PV node has been searched,
+// its younger brothers, moves[first .. num_of_moves), are searched in
+// parallel.  Like the root moves (see search_root_move()), each one is
+// searched below a snapshot of the node that has the best score its finished
+// brothers found so far as alpha, and a move that fails high is scouted again
+// if alpha has risen since, then re-searched with the full window by the
+// same task.  A move that reaches beta aborts the brothers still searching.
+//
+// Once all tasks are done, the scores are taken in move order, as the serial
+// loop would have taken them.  With one worker every move is searched
+// against the alpha the serial loop would have used, so the result is the
+// same.
+//
+// Returns true on a cutoff.  *num_moves_tried is set as the serial loop would
+// have left it.
+//
+// https://chessprogramming.wikispaces.com/Young+Brothers+Wait+Concept
+static bool search_pv_siblings(searchNode *node, sortable_move_t *move_list,
+                               int first, int num_of_moves, move_t killer_a,
+                               move_t killer_b, int *num_moves_tried,
+                               uint64_t *node_count_serial) {
+  simple_mutex_t mutex;
+  init_simple_mutex(&mutex);
+  score_t shared_alpha = node->alpha;  // raised under the lock
+
+  score_t scores[MAX_NUM_MOVES];
+  score_t alphas[MAX_NUM_MOVES];  // the alpha each move was searched against
+  moveEvaluationResult_t types[MAX_NUM_MOVES];
+  bool searched[MAX_NUM_MOVES];  // false if aborted by a brother's cutoff
+
+  cilk_for (int mv_index = first; mv_index < num_of_moves; mv_index++) {
+    searched[mv_index] = false;
+
+    // The node stays the snapshot's parent, so that parallel_abort(node)
+    // reaches the search below the snapshot.
+    searchNode snapshot;
+    simple_acquire(&mutex);
+    bool aborted = node->abort;
+    snapshot = *node;
+    snapshot.alpha = shared_alpha;
+    simple_release(&mutex);
+    if (aborted) {
+      continue;
+    }
+    snapshot.parent = node;
+
+    __sync_fetch_and_add(node_count_serial, 1);
+    moveEvaluationResult result = evaluateMove(&snapshot,
+                                               get_move(move_list[mv_index]),
+                                               killer_a, killer_b, SEARCH_PV,
+                                               node_count_serial);
+    while (result.needs_research) {
+      simple_acquire(&mutex);
+      score_t alpha = shared_alpha;
+      simple_release(&mutex);
+      if (alpha <= snapshot.alpha) {
+        break;
+      }
+      snapshot.alpha = alpha;
+      result.score = -scout_search(&(result.next_node), result.search_depth,
+                                   node_count_serial);
+      result.needs_research = (result.score > snapshot.alpha);
+    }
+    if (result.needs_research) {
+      result.score = -searchPV(&(result.next_node), result.search_depth,
+                               node_count_serial);
+    }
+
+    simple_acquire(&mutex);
+    if (!node->abort && !search_aborted(node)) {
+      searched[mv_index] = true;
+      scores[mv_index] = result.score;
+      alphas[mv_index] = snapshot.alpha;
+      types[mv_index] = result.type;
+      if (result.type == MOVE_EVALUATED || result.type == MOVE_GAMEOVER) {
+        if (result.score > shared_alpha) {
+          shared_alpha = result.score;
+        }
+        if (result.score >= node->beta) {
+          // the other brothers are still searching
+          parallel_abort(node);
+        }
+      }
+    }
+    simple_release(&mutex);
+  }
+
+  if (search_aborted(node)) {
+    return false;
+  }
+
+  for (int mv_index = first; mv_index < num_of_moves; mv_index++) {
+    (*num_moves_tried)++;
+
+    if (!searched[mv_index] || types[mv_index] == MOVE_ILLEGAL ||
+        types[mv_index] == MOVE_IGNORE) {
+      continue;
+    }
+    if (types[mv_index] == MOVE_EVALUATED) {
+      node->legal_move_count++;
+    }
+
+    // A score that did not beat the alpha its move was searched against only
+    // bounds the move from above.  If that alpha is above the node's, the
+    // move that raised it comes later in the list and beats this one.
+    if (scores[mv_index] <= alphas[mv_index] && alphas[mv_index] > node->alpha) {
+      continue;
+    }
+
+    moveEvaluationResult result;
+    result.score = scores[mv_index];
+    if (search_process_score(node, get_move(move_list[mv_index]), mv_index,
+                             &result, SEARCH_PV)) {
+      return true;
+    }
+  }
+  return false;
 }
 
 // Perform a Principle Variation Search
@@ -844,6 +1220,7 @@ static score_t searchPV(searchNode *node, int depth, uint64_t *node_count_serial
   }
 
   // Get the killer moves at this node.
+  move_t *killer = killer_table();
   move_t killer_a = killer[KMT(node->ply, 0)];
   move_t killer_b = killer[KMT(node->ply, 1)];
 
@@ -873,12 +1250,22 @@ static score_t searchPV(searchNode *node, int depth, uint64_t *node_count_serial
   // Start searching moves.
 
   for (int mv_index = 0; mv_index < num_of_moves; mv_index++) {
-    // Incrementally sort the move list.
+    // The younger brothers are searched in parallel, once the eldest has
+    // set alpha.
+    if (PARALLEL_PV && node->legal_move_count > 0 && node->depth > 1) {
+      search_pv_siblings(node, move_list, mv_index, num_of_moves, killer_a,
+                         killer_b, &num_moves_tried, node_count_serial);
+      // Check if we should abort due to time control.
+      if (search_aborted(node)) {
+        return 0;
+      }
+      break;
+    }
 
     move_t mv = get_move(move_list[mv_index]);
 
     num_moves_tried++;
-    (*node_count_serial)++;
+    __sync_fetch_and_add(node_count_serial, 1);
 
     
     moveEvaluationResult result = evaluateMove(node, mv, killer_a, killer_b,
@@ -895,8 +1282,13 @@ static score_t searchPV(searchNode *node, int depth, uint64_t *node_count_serial
       node->legal_move_count++;
     }
 
+    if (result.needs_research) {
+      result.score = -searchPV(&(result.next_node), result.search_depth,
+                               node_count_serial);
+    }
+
     // Check if we should abort due to time control.
-    if (abortf) {
+    if (search_aborted(node)) {
       return 0;
     }
 
@@ -943,14 +1335,220 @@ static inline void initialize_root_node(searchNode *node, score_t alpha, score_t
   node->best_score = -INF;
   node->pov = 1 - node->fake_color_to_move * 2;  // pov = 1 for White, -1 for Black
   node->abort = false;
+  node->abort_epoch = current_abort_epoch();
+  node->clock = thread_clock;
+}
+
+// Searches one root move and returns its score from the root's point of view.
+// Sets *illegal instead for a move that breaks the Ko rule.
+static score_t search_root_move(searchNode *rootNode, searchNode *next_node,
+                                move_t mv, int mv_index, bool *illegal,
+                                uint64_t *node_count_serial,
+                                simple_mutex_t *mutex) {
+  *illegal = false;
+  next_node->subpv = 0;
+  next_node->parent = rootNode;
+
+  // In the parallel loop (mutex set) other tasks raise the root's alpha
+  // under the lock.  The move is searched below a snapshot of the root
+  // instead, so that its window and its fail-high test use the same alpha.
+  searchNode root_snapshot;
+  if (mutex != NULL) {
+    simple_acquire(mutex);
+    root_snapshot = *rootNode;
+    simple_release(mutex);
+    next_node->parent = &root_snapshot;
+  }
+
+  if (TRACE_MOVES) {
+    print_move_info(mv, rootNode->ply);
+  }
+
+  __sync_fetch_and_add(node_count_serial, 1);
+
+  // make the move.
+  victims_t x = make_move(&(rootNode->position), &(next_node->position), mv);
+
+  if (is_KO(x)) {
+    *illegal = true;  // not a legal move
+    return 0;
+  }
+
+  if (is_game_over(x, rootNode->pov, rootNode->ply)) {
+    return get_game_over_score(x, rootNode->pov, rootNode->ply);
+  }
+
+  if (is_repeated(&(next_node->position), rootNode->ply)) {
+    return get_draw_score(&(next_node->position), rootNode->ply);
+  }
+
+  if (mv_index == 0 || rootNode->depth == 1) {
+    // We guess that the first move is the principle variation
+    return -searchPV(next_node, rootNode->depth-1, node_count_serial);
+  }
+
+  searchNode *parent = next_node->parent;
+  score_t score;
+  while (true) {
+    score = -scout_search(next_node, rootNode->depth-1, node_count_serial);
+    if (search_aborted(rootNode)) {
+      return 0;
+    }
+    if (score <= parent->alpha || mutex == NULL) {
+      break;
+    }
+    // The move failed high against the snapshot.  If alpha has risen past
+    // the snapshot since, scout the move again against the new alpha before
+    // deciding on the PV search.
+    simple_acquire(mutex);
+    score_t alpha = rootNode->alpha;
+    simple_release(mutex);
+    if (alpha <= parent->alpha) {
+      break;
+    }
+    parent->alpha = alpha;
+  }
+
+  // If its score exceeds the current best score,
+  if (score > parent->alpha) {
+    score = -searchPV(next_node, rootNode->depth-1, node_count_serial);
+  }
+  return score;
+}
+
+// Takes the score of a root move into account.  Returns true if the move is
+// the new best move, in which case it has also been reported.
+static bool root_process_score(searchNode *rootNode, move_t mv, int mv_index,
+                               score_t score, move_t *pv,
+                               uint64_t *node_count_serial, FILE *OUT) {
+  bool improved = false;
+
+  // only valid for the root node:
+  tbassert((score > rootNode->best_score) == (score > rootNode->alpha),
+           "score = %d, best = %d, alpha = %d\n", score, rootNode->best_score,
+           rootNode->alpha);
+
+  if (score > rootNode->best_score) {
+    tbassert(score > rootNode->alpha, "score: %d, alpha: %d\n", score, rootNode->alpha);
+
+    rootNode->best_score = score;
+    *pv = mv;
+    improved = true;
+    // memcpy(pv+1, next_node.subpv, sizeof(move_t) * (MAX_PLY_IN_SEARCH - 1));
+    // pv[MAX_PLY_IN_SEARCH - 1] = 0;
+
+    // Print out based on UCI (universal chess interface)
+    double et = milliseconds() - rootNode->clock->sstart;
+    char   pvbuf[MAX_CHARS_IN_MOVE];
+    getPV(*pv, pvbuf, MAX_CHARS_IN_MOVE);
+    if (et < 0.00001) {
+      et = 0.00001;  // hack so that we don't divide by 0
+    }
+
+    uint64_t nps = 1000 * *node_count_serial / et;
+    fprintf(OUT, "info depth %d move_no %d time (microsec) %d nodes %" PRIu64
+            " nps %" PRIu64 "\n",
+            rootNode->depth, mv_index + 1, (int) (et * 1000), *node_count_serial,
+            nps);
+    fprintf(OUT, "info score cp %d pv %s\n", score, pvbuf);
+  }
+
+  // Normal alpha-beta logic: if the current score is better than what the
+  // maximizer has been able to get so far, take that new value.  Likewise,
+  // score >= beta is the beta cutoff condition
+  if (score > rootNode->alpha) {
+    rootNode->alpha = score;
+  }
+  tbassert(score < rootNode->beta, "score: %d, beta: %d\n", score, rootNode->beta);
+  return improved;
+}
+
+// The searches of a thread start the root moves after the first at this one
+// of them (see set_root_rotation()).
+static __thread int root_rotation = 0;
+
+// Lazy SMP helpers each search the root moves in an order of their own, so
+// that they do not all refute the same moves first: every iteration of the
+// calling thread's search turns the root moves after the first by rotation
+// places.  The first move, the best one so far, stays in front.
+void set_root_rotation(int rotation) {
+  root_rotation = rotation;
+}
+
+static inline void rotate_root_moves(sortable_move_t *move_list,
+                                     int num_of_moves) {
+  int n = num_of_moves - 1;
+  if (root_rotation == 0 || n < 2) {
+    return;
+  }
+  int r = root_rotation % n;
+  sortable_move_t rest[MAX_NUM_MOVES];
+  for (int i = 0; i < n; i++) {
+    rest[i] = move_list[1 + (i + r) % n];
+  }
+  memcpy(move_list + 1, rest, n * sizeof(sortable_move_t));
+}
+
+// Slides the move at mv_index to the front of the move list
+static inline void root_move_to_front(sortable_move_t *move_list, int mv_index) {
+  move_t mv = get_move(move_list[mv_index]);
+  for (int j = mv_index; j > 0; j--) {
+    move_list[j] = move_list[j - 1];
+  }
+  move_list[0] = mv;
+}
+
+// The root moves after the first, searched in parallel.  Each scout search
+// starts from the best score found so far, which the tasks raise under a
+// lock as they finish, and a move that fails high is re-searched by the same
+// task (see search_root_move()).  The moves that became the best move are put in front of the list
+// once all tasks are done, in the order they became the best, which leaves
+// the list as the serial loop would have.
+static void search_root_parallel(searchNode *rootNode, sortable_move_t *move_list,
+                                 int num_of_moves, move_t *pv,
+                                 uint64_t *node_count_serial, FILE *OUT) {
+  simple_mutex_t mutex;
+  init_simple_mutex(&mutex);
+
+  move_t moves[MAX_NUM_MOVES];
+  int improved[MAX_NUM_MOVES];  // indices of the moves that became the best
+  int num_improved = 0;
+  for (int mv_index = 0; mv_index < num_of_moves; mv_index++) {
+    moves[mv_index] = get_move(move_list[mv_index]);
+  }
+
+  cilk_for (int mv_index = 1; mv_index < num_of_moves; mv_index++) {
+    searchNode next_node;
+    bool illegal;
+    score_t score = search_root_move(rootNode, &next_node, moves[mv_index],
+                                     mv_index, &illegal, node_count_serial,
+                                     &mutex);
+    if (!illegal && !search_aborted(rootNode)) {
+      simple_acquire(&mutex);
+      if (root_process_score(rootNode, moves[mv_index], mv_index, score, pv,
+                             node_count_serial, OUT)) {
+        improved[num_improved++] = mv_index;
+      }
+      simple_release(&mutex);
+    }
+  }
+
+  for (int i = 0; i < num_improved; i++) {
+    int mv_index = 0;
+    while (get_move(move_list[mv_index]) != moves[improved[i]]) {
+      mv_index++;
+    }
+    root_move_to_front(move_list, mv_index);
+  }
 }
 
 score_t searchRoot(position_t *p, score_t alpha, score_t beta, int depth,
                    int ply, move_t *pv, uint64_t *node_count_serial,
                    FILE *OUT) {
-  static int num_of_moves = 0;  // number of moves in list
+  // one list per thread, for the lazy SMP helpers (see leiserchess.c)
+  static __thread int num_of_moves = 0;  // number of moves in list
   // hopefully, more than we will need
-  static sortable_move_t move_list[MAX_NUM_MOVES];
+  static __thread sortable_move_t move_list[MAX_NUM_MOVES];
 
   if (depth == 1) {
     // we are at depth 1; generate all possible moves
@@ -964,6 +1562,7 @@ score_t searchRoot(position_t *p, score_t alpha, score_t beta, int depth,
     // }
     sort_incremental(move_list, num_of_moves);
   }
+  rotate_root_moves(move_list, num_of_moves);
 
   // printf("?? %d %d\n", depth, num_of_moves);
   searchNode rootNode;
@@ -973,107 +1572,39 @@ score_t searchRoot(position_t *p, score_t alpha, score_t beta, int depth,
 
   assert(rootNode.best_score == alpha);  // initial conditions
 
-  searchNode next_node;
-  next_node.subpv = 0;
-  next_node.parent = &rootNode;
+  // Once the first move has set alpha, the others only have to be refuted,
+  // which they can be independently of each other.  At depth 1 every move
+  // gets a full search, so there is nothing to gain.
+  bool parallel = PARALLEL_ROOT && depth > 1;
 
-  score_t score;
+  searchNode next_node;
   for (int mv_index = 0; mv_index < num_of_moves; mv_index++) {
-    move_t mv = get_move(move_list[mv_index]);
-
-    if (TRACE_MOVES) {
-      print_move_info(mv, ply);
-    }
-
-    (*node_count_serial)++;
-
-    // make the move.
-    
-    victims_t x = make_move(&(rootNode.position), &(next_node.position), mv);
-    
-    if (is_KO(x)) {
-      continue;  // not a legal move
-    }
-
-    if (is_game_over(x, rootNode.pov, rootNode.ply)) {
-      score = get_game_over_score(x, rootNode.pov, rootNode.ply);
-      next_node.subpv = 0;
-      goto scored;
-    }
-
-    if (is_repeated(&(next_node.position), rootNode.ply)) {
-      score = get_draw_score(&(next_node.position), rootNode.ply);
-      next_node.subpv = 0;
-      goto scored;
-    }
-    if (mv_index == 0 || rootNode.depth == 1) {
-      // We guess that the first move is the principle variation
-      score = -searchPV(&next_node, rootNode.depth-1, node_count_serial);
-      
-      // Check if we should abort due to time control.
-      if (abortf) {
-        return 0;
-      }
-    } else {
-      score = -scout_search(&next_node, rootNode.depth-1, node_count_serial);
+    if (parallel && mv_index == 1) {
+      search_root_parallel(&rootNode, move_list, num_of_moves, pv,
+                           node_count_serial, OUT);
       // Check if we should abort due to time control.
-      if (abortf) {
+      if (search_aborted(&rootNode)) {
         return 0;
       }
-
-      // If its score exceeds the current best score,
-      if (score > rootNode.alpha) {
-        score = -searchPV(&next_node, rootNode.depth-1, node_count_serial);
-        // Check if we should abort due to time control.
-        if (abortf) {
-          return 0;
-        }
-      }
+      break;
     }
 
-  scored:
-    // only valid for the root node:
-    tbassert((score > rootNode.best_score) == (score > rootNode.alpha),
-             "score = %d, best = %d, alpha = %d\n", score, rootNode.best_score, rootNode.alpha);
-
-    if (score > rootNode.best_score) {
-      tbassert(score > rootNode.alpha, "score: %d, alpha: %d\n", score, rootNode.alpha);
-
-      rootNode.best_score = score;
-      *pv = mv;
-      // memcpy(pv+1, next_node.subpv, sizeof(move_t) * (MAX_PLY_IN_SEARCH - 1));
-      // pv[MAX_PLY_IN_SEARCH - 1] = 0;
-
-      // Print out based on UCI (universal chess interface)
-      double et = elapsed_time();
-      char   pvbuf[MAX_CHARS_IN_MOVE];
-      getPV(*pv, pvbuf, MAX_CHARS_IN_MOVE);
-      if (et < 0.00001) {
-        et = 0.00001;  // hack so that we don't divide by 0
-      }
-
-      uint64_t nps = 1000 * *node_count_serial / et;
-      fprintf(OUT, "info depth %d move_no %d time (microsec) %d nodes %" PRIu64
-              " nps %" PRIu64 "\n",
-              depth, mv_index + 1, (int) (et * 1000), *node_count_serial, nps);
-      fprintf(OUT, "info score cp %d pv %s\n", score, pvbuf);
-
-      // Slide this move to the front of the move list
-      for (int j = mv_index; j > 0; j--) {
-        move_list[j] = move_list[j - 1];
-      }
-      move_list[0] = mv;
+    move_t mv = get_move(move_list[mv_index]);
+    bool illegal;
+    score_t score = search_root_move(&rootNode, &next_node, mv, mv_index,
+                                     &illegal, node_count_serial, NULL);
+    if (illegal) {
+      continue;
     }
 
-    // Normal alpha-beta logic: if the current score is better than what the
-    // maximizer has been able to get so far, take that new value.  Likewise,
-    // score >= beta is the beta cutoff condition
-    if (score > rootNode.alpha) {
-      rootNode.alpha = score;
+    // Check if we should abort due to time control.
+    if (search_aborted(&rootNode)) {
+      return 0;
     }
-    if (score >= rootNode.beta) {
-      tbassert(0, "score: %d, beta: %d\n", score, rootNode.beta);
-      break;
+
+    if (root_process_score(&rootNode, mv, mv_index, score, pv,
+                           node_count_serial, OUT)) {
+      root_move_to_front(move_list, mv_index);
     }
   }
 
@@ -1085,6 +1616,7 @@ score_t searchRoot(position_t *p, score_t alpha, score_t beta, int depth,
 
 #include "./eval.h"
 
+#include <inttypes.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
@@ -1092,6 +1624,7 @@ score_t searchRoot(position_t *p, score_t alpha, score_t beta, int depth,
 #include "./move_gen.h"
 #include "./tbassert.h"
 #include "./closebook.h"
+#include "./util.h"
 
 // -----------------------------------------------------------------------------
 // Evaluation
@@ -1110,6 +1643,8 @@ int KAGGRESSIVE;
 int MOBILITY;
 int PAWNPIN;
 
+int EVAL_CACHE;  // eval cache size in MBytes, 0 turns it off
+
 // Heuristics for static evaluation - described in the google doc
 // mentioned in the handout.
 
@@ -1123,18 +1658,6 @@ static const ev_score_t pcentral_s[64] = {
 181, 249, 302, 323, 323, 302, 249, 181,
 125, 181, 220, 234, 234, 220, 181, 125};
 
-static const uint64_t three_by_three_mask[100] = {
-  0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 
-  0ULL, 771ULL, 1799ULL, 3598ULL, 7196ULL, 14392ULL, 28784ULL, 57568ULL, 49344ULL, 0ULL, 
-  0ULL, 197379ULL, 460551ULL, 921102ULL, 1842204ULL, 3684408ULL, 7368816ULL, 14737632ULL, 12632256ULL, 0ULL, 
-  0ULL, 50529024ULL, 117901056ULL, 235802112ULL, 471604224ULL, 943208448ULL, 1886416896ULL, 3772833792ULL, 3233857536ULL, 0ULL, 
-  0ULL, 12935430144ULL, 30182670336ULL, 60365340672ULL, 120730681344ULL, 241461362688ULL, 482922725376ULL, 965845450752ULL, 827867529216ULL, 0ULL, 
-  0ULL, 3311470116864ULL, 7726763606016ULL, 15453527212032ULL, 30907054424064ULL, 61814108848128ULL, 123628217696256ULL, 247256435392512ULL, 211934087479296ULL, 0ULL, 
-  0ULL, 847736349917184ULL, 1978051483140096ULL, 3956102966280192ULL, 7912205932560384ULL, 15824411865120768ULL, 31648823730241536ULL, 63297647460483072ULL, 54255126394699776ULL, 0ULL, 
-  0ULL, 217020505578799104ULL, 506381179683864576ULL, 1012762359367729152ULL, 2025524718735458304ULL, 4051049437470916608ULL, 8102098874941833216ULL, 16204197749883666432ULL, 13889312357043142656ULL, 0ULL, 
-  0ULL, 217017207043915776ULL, 506373483102470144ULL, 1012746966204940288ULL, 2025493932409880576ULL, 4050987864819761152ULL, 8101975729639522304ULL, 16203951459279044608ULL, 13889101250810609664ULL, 0ULL, 
-  0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL};
-
 static const double inv_s[16] = {1.0/1, 1.0/2, 1.0/3, 1.0/4, 1.0/5, 1.0/6, 1.0/7,
 1.0/8, 1.0/9, 1.0/10, 1.0/11, 1.0/12, 1.0/13, 1.0/14, 1.0/15, 1.0/16};
 
@@ -1157,16 +1680,13 @@ static inline  bool between(int c, int a, int b) {
 
 
 // KFACE heuristic: bonus (or penalty) for King facing toward the other King
-static inline  ev_score_t kface(position_t *p, fil_t f, rnk_t r) {
-  square_t sq = square_of(f, r);
-  piece_t x = p->board[sq];
-  color_t c = color_of(x);
+static inline  ev_score_t kface(position_t *p, color_t c, fil_t f, rnk_t r) {
   square_t opp_sq = p->kloc[opp_color(c)];
   int delta_fil = fil_of(opp_sq) - f;
   int delta_rnk = rnk_of(opp_sq) - r;
   int bonus;
 
-  switch (ori_of(x)) {
+  switch (p->kori[c]) {
     case NN:
       bonus = delta_rnk;
       break;
@@ -1191,11 +1711,8 @@ static inline  ev_score_t kface(position_t *p, fil_t f, rnk_t r) {
 }
 
 // KAGGRESSIVE heuristic: bonus for King with more space to back
-static inline  ev_score_t kaggressive(position_t *p, fil_t f, rnk_t r) {
-  square_t sq = square_of(f, r);
-  piece_t x = p->board[sq];
-  color_t c = color_of(x);
-  tbassert(ptype_of(x) == KING, "ptype_of(x) = %d\n", ptype_of(x));
+static inline  ev_score_t kaggressive(position_t *p, color_t c, fil_t f, rnk_t r) {
+  tbassert(p->kloc[c] == square_of(f, r), "kloc: %d\n", p->kloc[c]);
 
   square_t opp_sq = p->kloc[opp_color(c)];
   fil_t of = fil_of(opp_sq);
@@ -1227,42 +1744,30 @@ static inline  ev_score_t kaggressive(position_t *p, fil_t f, rnk_t r) {
 //             path of the laser is marked with mark_mask.
 // mark_mask : What each square is marked with.
 
-// directions for laser: NN, EE, SS, WW
-static const int beam_64[NUM_ORI] = {1, 8, -1, -8};
-
-static inline  uint64_t mark_laser_path_bit(position_t *p, color_t c) {
-  // static int count = 0;
-  // count += 1;
-  // if (count % 10000 == 0)
-  //   printf("%d\n", count);
+static inline uint64_t mark_laser_path_bit(position_t *p, color_t c) {
   square_t sq = p->kloc[c];
-  int loc64 = fil_of(sq) * 8 + rnk_of(sq);
-  uint64_t laser_map = 0;
-  int bdir = ori_of(p->board[sq]);
+  uint64_t laser_map = square_bit(sq);
+  uint64_t occupied = p->mask[WHITE] | p->mask[BLACK];
+  int bdir = p->kori[c];
   p->kill_d[c] = false;
 
-  tbassert(ptype_of(p->board[sq]) == KING,
-           "ptype: %d\n", ptype_of(p->board[sq]));
-  laser_map |= (1ULL << loc64);
-  
+  tbassert(occupied & square_bit(sq), "sq: %d\n", sq);
+
   while (true) {
-    sq += beam_of(bdir);
-    int x = ptype_of(p->board[sq]);
-    if (x == INVALID)
-      return laser_map;
-    // tbassert(sq < ARR_SIZE && sq >= 0, "sq: %d\n", sq);
-    loc64 += beam_64[bdir];
-    laser_map |= (1ULL << loc64);
-    if (x == KING) {
+    square_t hit = laser_hit(sq, bdir, occupied);
+    if (hit == NO_SQUARE)
+      return laser_map | laser_ray_of(sq, bdir);
+    // everything past sq up to and including hit
+    laser_map |= laser_ray_of(sq, bdir) ^ laser_ray_of(hit, bdir);
+    sq = hit;
+    if (sq == p->kloc[WHITE] || sq == p->kloc[BLACK]) {
       p->kill_d[c] = true;
       return laser_map;
     }
-    if (x == PAWN) {
-      bdir = reflect_of(bdir, ori_of(p->board[sq]));
-      if (bdir < 0) {  // Hit back of Pawn
-        p->kill_d[c] = true;
-        return laser_map;
-      }
+    bdir = reflect_of(bdir, pawn_ori_at(p, sq));
+    if (bdir < 0) {  // Hit back of Pawn
+      p->kill_d[c] = true;
+      return laser_map;
     }
   }
   return laser_map;
@@ -1272,15 +1777,10 @@ static inline  uint64_t mark_laser_path_bit(position_t *p, color_t c) {
 //   opposing king's laser --- and are thus mobile.
 
 static inline int pawnpin(position_t *p, color_t color, uint64_t laser_map) {
-  tbassert(p->mask[0] == compute_mask(p, 0),
-           "p->mask: %"PRIu64", mask: %"PRIu64"\n",
-           p->mask[0], compute_mask(p, 0));
-  tbassert(p->mask[1] == compute_mask(p, 1),
-           "p->mask: %"PRIu64", mask: %"PRIu64"\n",
-           p->mask[1], compute_mask(p, 1));
+  tbassert(board_is_consistent(p), "inconsistent board\n");
 
   uint64_t mask = (~laser_map) & p -> mask[color];
-  return __builtin_popcountl(mask) - ((1ULL << (fil_of(p -> kloc[color]) * 8 + rnk_of(p -> kloc[color])) & mask) != 0);
+  return __builtin_popcountl(mask) - ((square_bit(p -> kloc[color]) & mask) != 0);
 
 }
 
@@ -1295,10 +1795,10 @@ static inline int mobility(position_t *p, color_t color, uint64_t laser_map) {
 static inline int h_squares_attackable(position_t *p, color_t c, uint64_t laser_map) {
 
   square_t o_king_sq = p->kloc[opp_color(c)];
-  tbassert(ptype_of(p->board[o_king_sq]) == KING,
-           "ptype: %d\n", ptype_of(p->board[o_king_sq]));
-  tbassert(color_of(p->board[o_king_sq]) != c,
-           "color: %d\n", color_of(p->board[o_king_sq]));
+  tbassert(ptype_of(piece_at(p, o_king_sq)) == KING,
+           "ptype: %d\n", ptype_of(piece_at(p, o_king_sq)));
+  tbassert(color_of(piece_at(p, o_king_sq)) != c,
+           "color: %d\n", color_of(piece_at(p, o_king_sq)));
 
   float h_attackable = 0;
 
@@ -1316,7 +1816,7 @@ static inline int h_squares_attackable(position_t *p, color_t c, uint64_t laser_
 }
 
 // Static evaluation.  Returns score
-static inline  score_t eval(position_t *p, bool verbose) {
+static inline score_t eval_uncached(position_t *p, bool verbose) {
   // seed rand_r with a value of 1, as per
   // http://linux.die.net/man/3/rand_r
 
@@ -1335,10 +1835,10 @@ static inline  score_t eval(position_t *p, bool verbose) {
   rnk_t r0 = rnk_of(p -> kloc[0]);
   fil_t f1 = fil_of(p -> kloc[1]);
   rnk_t r1 = rnk_of(p -> kloc[1]);
-  score += kface(p, f0, r0) + kaggressive(p, f0, r0);
+  score += kface(p, WHITE, f0, r0) + kaggressive(p, WHITE, f0, r0);
   score -= pcentral(f0 * 8 + r0);
 
-  score -= kface(p, f1, r1) + kaggressive(p, f1, r1);
+  score -= kface(p, BLACK, f1, r1) + kaggressive(p, BLACK, f1, r1);
   score += pcentral(f1 * 8 + r1);
 
 
@@ -1418,50 +1918,188 @@ static inline  score_t eval(position_t *p, bool verbose) {
   return score / EV_SCORE_RATIO;
 }
   
-//
-//
-// Copyright (c) 2015 MIT License by 6.172 Staff
 
-#include "./move_gen.h"
 
-#include <stdint.h>
-#include <stdlib.h>
-#include <stdio.h>
-#include <string.h>
+// -----------------------------------------------------------------------------
+// Eval cache
+// -----------------------------------------------------------------------------
 
-#define __STDC_FORMAT_MACROS
-#include <inttypes.h>
+// The score only depends on the board and the side to move, which is what the
+// Zobrist key covers, so transpositions and the repeated stand-pat evaluations
+// of the quiescence search can share one evaluation.
+//
+// The cache is direct-mapped and each entry is a single 64-bit word, the high
+// 48 bits of the key above the 16-bit score, so workers share it without
+// locks.  An all-zero entry is empty.
+typedef uint64_t evEntry_t;
+
+#define EV_ENTRY_SCORE_MASK 0xffffULL
+
+static struct {
+  evEntry_t *entries;
+  uint64_t mask;           // a mask to map from key to entry index
+} eval_cache;
+
+// Replaces the cache with an empty one of at most size_in_meg MBytes; 0 frees
+// it.
+static inline void eval_cache_resize(int size_in_meg) {
+  free(eval_cache.entries);
+  eval_cache.entries = NULL;
+  eval_cache.mask = 0;
+  if (size_in_meg <= 0) {
+    return;
+  }
 
-#include "./eval.h"
-#include "./fen.h"
-#include "./search.h"
-#include "./tbassert.h"
-#include "./util.h"
+  uint64_t num_of_entries = (uint64_t) size_in_meg * (1ULL << 20) /
+      sizeof(evEntry_t);
+  uint64_t pow = 1;
+  while (pow * 2 <= num_of_entries) pow *= 2;
 
-// static const uint64_t sq_to_board_bit[100] = {
-// 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL,
-// 0ULL, 1ULL<<0, 1ULL<<1, 1ULL<<2, 1ULL<<3, 1ULL<<4, 1ULL<<5, 1ULL<<6, 1ULL<<7, 0ULL,
-// 0ULL, 1ULL<<8, 1ULL<<9, 1ULL<<10, 1ULL<<11, 1ULL<<12, 1ULL<<13, 1ULL<<14, 1ULL<<15, 0ULL,
-// 0ULL, 1ULL<<16, 1ULL<<17, 1ULL<<18, 1ULL<<19, 1ULL<<20, 1ULL<<21, 1ULL<<22, 1ULL<<23, 0ULL,
-// 0ULL, 1ULL<<24, 1ULL<<25, 1ULL<<26, 1ULL<<27, 1ULL<<28, 1ULL<<29, 1ULL<<30, 1ULL<<31, 0ULL,
-// 0ULL, 1ULL<<32, 1ULL<<33, 1ULL<<34, 1ULL<<35, 1ULL<<36, 1ULL<<37, 1ULL<<38, 1ULL<<39, 0ULL,
-// 0ULL, 1ULL<<40, 1ULL<<41, 1ULL<<42, 1ULL<<43, 1ULL<<44, 1ULL<<45, 1ULL<<46, 1ULL<<47, 0ULL,
-// 0ULL, 1ULL<<48, 1ULL<<49, 1ULL<<50, 1ULL<<51, 1ULL<<52, 1ULL<<53, 1ULL<<54, 1ULL<<55, 0ULL,
-// 0ULL, 1ULL<<56, 1ULL<<57, 1ULL<<58, 1ULL<<59, 1ULL<<60, 1ULL<<61, 1ULL<<62, 1ULL<<63, 0ULL,
-// 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL};
+  eval_cache.entries = (evEntry_t *) calloc(pow, sizeof(evEntry_t));
+  if (eval_cache.entries == NULL) {
+    fprintf(stderr, "Eval cache too big\n");
+    exit(1);
+  }
+  eval_cache.mask = pow - 1;
+}
 
-int USE_KO;  // Respect the Ko rule
+// Forgets every score.  Needed whenever the evaluation parameters or the
+// Zobrist keys change.
+static inline void eval_cache_clear() {
+  if (eval_cache.entries) {
+    memset(eval_cache.entries, 0, sizeof(evEntry_t) * (eval_cache.mask + 1));
+  }
+}
 
-static const char *color_strs[2] = {"White", "Black"};
+static inline uint64_t eval_cache_get_num_of_entries() {
+  return eval_cache.entries ? eval_cache.mask + 1 : 0;
+}
 
-const char *color_to_str(color_t c) {
-  return color_strs[c];
+// Starts fetching the entry for key, see tt_prefetch().
+static inline void eval_cache_prefetch(uint64_t key) {
+  if (eval_cache.entries) {
+    __builtin_prefetch(&eval_cache.entries[key & eval_cache.mask]);
+  }
+}
+
+// Prints the cache counters (see COUNT() in util.h), if there is a cache.
+void eval_print_stats(FILE *OUT) {
+  if (eval_cache.entries == NULL) {
+    return;
+  }
+  uint64_t probes = counter_total(COUNT_EVAL_PROBES);
+  uint64_t hits = counter_total(COUNT_EVAL_HITS);
+  double hit_rate = probes ? 100.0 * hits / probes : 0.0;
+  fprintf(OUT, "info string eval cache probes %" PRIu64 " hits %" PRIu64
+          " (%.1f%%)\n", probes, hits, hit_rate);
+}
+
+// Static evaluation through the cache.  Randomized and verbose evaluations
+// bypass it.
+static inline score_t eval(position_t *p, bool verbose) {
+  if (eval_cache.entries == NULL || verbose || RANDOMIZE) {
+    return eval_uncached(p, verbose);
+  }
+
+  evEntry_t *entry = &eval_cache.entries[p->key & eval_cache.mask];
+  evEntry_t e = __atomic_load_n(entry, __ATOMIC_RELAXED);
+  COUNT(COUNT_EVAL_PROBES);
+  if (e != 0 && ((e ^ p->key) & ~EV_ENTRY_SCORE_MASK) == 0) {
+    COUNT(COUNT_EVAL_HITS);
+    return (score_t) (uint16_t) e;
+  }
+
+  score_t score = eval_uncached(p, verbose);
+  e = (p->key & ~EV_ENTRY_SCORE_MASK) | (uint16_t) score;
+  __atomic_store_n(entry, e, __ATOMIC_RELAXED);
+  return score;
+}
+//
+//
+// Copyright (c) 2015 MIT License by 6.172 Staff
+
+#include "./move_gen.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+
+#include <cilk/cilk.h>
+
+#include "./eval.h"
+#include "./fen.h"
+#include "./search.h"
+#include "./tbassert.h"
+#include "./tt.h"
+#include "./util.h"
+
+int USE_KO;  // Respect the Ko rule
+
+static const char *color_strs[2] = {"White", "Black"};
+
+const char *color_to_str(color_t c) {
+  return color_strs[c];
 }
 
 // -----------------------------------------------------------------------------
 // Piece getters and setters (including color, ptype, orientation)
 // -----------------------------------------------------------------------------
 
+// Orientation of the Pawn on sq, read off the per-orientation Pawn sets.
+// NE and SW have bit 0 set, SE and SW have bit 1 set.
+static inline int pawn_ori_at(position_t *p, square_t sq) {
+  return (((p->pawn[NE] | p->pawn[SW]) >> sq) & 1) |
+         ((((p->pawn[SE] | p->pawn[SW]) >> sq) & 1) << 1);
+}
+
+// Orientation of the piece on sq (which must be occupied).
+static inline int ori_at(position_t *p, square_t sq) {
+  if (sq == p->kloc[WHITE]) {
+    return p->kori[WHITE];
+  }
+  if (sq == p->kloc[BLACK]) {
+    return p->kori[BLACK];
+  }
+  return pawn_ori_at(p, sq);
+}
+
+// Rebuilds the piece_t encoding of whatever stands on sq (0 if empty).
+static inline piece_t piece_at(position_t *p, square_t sq) {
+  uint64_t bit = square_bit(sq);
+  if (!((p->mask[WHITE] | p->mask[BLACK]) & bit)) {
+    return 0;
+  }
+  color_t c = (p->mask[WHITE] & bit) ? WHITE : BLACK;
+  if (sq == p->kloc[c]) {
+    return (c << COLOR_SHIFT) | (KING << PTYPE_SHIFT) |
+           (p->kori[c] << ORI_SHIFT);
+  }
+  return (c << COLOR_SHIFT) | (PAWN << PTYPE_SHIFT) |
+         (pawn_ori_at(p, sq) << ORI_SHIFT);
+}
+
+// Checks the bitboard invariants: colors and Pawn orientations are disjoint,
+// and every piece is either a Pawn or a King.  (A zapped King leaves kloc
+// behind, so Kings only need to be on the board if they are still occupied.)
+static inline bool board_is_consistent(position_t *p) {
+  uint64_t pawns = 0;
+  for (int ori = 0; ori < NUM_ORI; ori++) {
+    if (pawns & p->pawn[ori]) {
+      return false;
+    }
+    pawns |= p->pawn[ori];
+  }
+  uint64_t occupied = p->mask[WHITE] | p->mask[BLACK];
+  uint64_t kings = (square_bit(p->kloc[WHITE]) | square_bit(p->kloc[BLACK])) &
+                   occupied;
+  return !(p->mask[WHITE] & p->mask[BLACK]) && !(pawns & kings) &&
+         (pawns | kings) == occupied;
+}
+
 // -----------------------------------------------------------------------------
 // Piece orientation strings
 // -----------------------------------------------------------------------------
@@ -1485,20 +2123,16 @@ static const char *pawn_ori_to_rep[2][NUM_ORI] = { { "NW", "NE", "SE", "SW" },
 // https://chessprogramming.wikispaces.com/Zobrist+Hashing
 //
 // NOTE: Zobrist hashing uses piece_t as an integer index into to the zob table.
-// So if you change your piece representation, you'll need to recompute what the
-// old piece representation is when indexing into the zob table to get the same
-// node counts.
-static uint64_t   zob[ARR_SIZE][1<<PIECE_SIZE];
+// The board itself is kept in bitboards, so piece_at() recomputes the piece_t
+// encoding of a square when the key has to be updated.
+static uint64_t   zob[NUM_SQUARES][1<<PIECE_SIZE];
 static uint64_t   zob_color;
 uint64_t myrand();
 
-static inline  uint64_t compute_zob_key(position_t *p) {
+static inline uint64_t compute_zob_key(position_t *p) {
   uint64_t key = 0;
-  for (fil_t f = 0; f < BOARD_WIDTH; f++) {
-    for (rnk_t r = 0; r < BOARD_WIDTH; r++) {
-      square_t sq = square_of(f, r);
-      key ^= zob[sq][p->board[sq]];
-    }
+  for (square_t sq = 0; sq < NUM_SQUARES; sq++) {
+    key ^= zob[sq][piece_at(p, sq)];
   }
   if (color_to_move_of(p) == BLACK)
     key ^= zob_color;
@@ -1506,20 +2140,8 @@ static inline  uint64_t compute_zob_key(position_t *p) {
   return key;
 }
 
-static inline  uint64_t compute_mask(position_t *p, color_t color) {
-  uint64_t key = 0;
-  for (fil_t f = 0; f < BOARD_WIDTH; f++) {
-    for (rnk_t r = 0; r < BOARD_WIDTH; r++) {
-      square_t sq = square_of(f, r);
-      if (p->board[sq] && color_of(p->board[sq]) == color)
-        key |= (1ULL << (f << 3) << r);
-    }
-  }
-  return key;
-}
-
 static inline void init_zob() {
-  for (int i = 0; i < ARR_SIZE; i++) {
+  for (int i = 0; i < NUM_SQUARES; i++) {
     for (int j = 0; j < (1 << PIECE_SIZE); j++) {
       zob[i][j] = myrand();
     }
@@ -1527,12 +2149,25 @@ static inline void init_zob() {
   zob_color = myrand();
 }
 
+// Copies the Zobrist table out to / in from ZOB_NUM_KEYS keys.  The keys are
+// random for every run of the engine, so anything keyed by them that is kept
+// across runs (a saved transposition table) has to carry them along.
+void zob_export(uint64_t *keys) {
+  memcpy(keys, zob, sizeof(zob));
+  keys[ZOB_NUM_KEYS - 1] = zob_color;
+}
+
+void zob_import(const uint64_t *keys) {
+  memcpy(zob, keys, sizeof(zob));
+  zob_color = keys[ZOB_NUM_KEYS - 1];
+}
+
 // -----------------------------------------------------------------------------
 // Squares
 // -----------------------------------------------------------------------------
 
 // converts a square to string notation, returns number of characters printed
-static inline  int square_to_str(square_t sq, char *buf, size_t bufsize) {
+static inline int square_to_str(square_t sq, char *buf, size_t bufsize) {
   fil_t f = fil_of(sq);
   rnk_t r = rnk_of(sq);
   if (f >= 0) {
@@ -1589,56 +2224,99 @@ void move_to_str(move_t mv, char *buf, size_t bufsize) {
 
 static inline int generate_all(position_t *p, sortable_move_t *sortable_move_list,
                  bool strict) {
-  tbassert(p->mask[0] == compute_mask(p, 0),
-           "p->mask: %"PRIu64", mask: %"PRIu64"\n",
-           p->mask[0], compute_mask(p, 0));
-  tbassert(p->mask[1] == compute_mask(p, 1),
-           "p->mask: %"PRIu64", mask: %"PRIu64"\n",
-           p->mask[1], compute_mask(p, 1));
+  tbassert(board_is_consistent(p), "inconsistent board\n");
   color_t color_to_move = color_to_move_of(p);
-  // Make sure that the enemy_laser map is marked
-  // char laser_map[ARR_SIZE];
-  
-  // memcpy(laser_map, laser_map_s, sizeof laser_map);
-  
-  // 1 = path of laser with no moves
-  // mark_laser_path(p, opp_color(color_to_move), laser_map, 1);
-  // uint64_t laser_map = mark_laser_path_bit(p, opp_color(color_to_move));
+  // Pieces on the enemy laser path cannot move.
   int move_count = 0;
   uint64_t mask = p -> mask[color_to_move] & ~p -> laser[opp_color(color_to_move)];
   while (mask) {
     uint64_t y = mask & (-mask);
     mask ^= y;
-    int i = LOG2(y);
-    fil_t f = (i >> 3);
-    rnk_t r = i & 7;
+    square_t sq = LOG2(y);
+
+    ptype_t typ = (sq == p->kloc[color_to_move]) ? KING : PAWN;
+
+    // Destinations come out in increasing square order, which is the order
+    // the old direction table produced them in.
+    uint64_t dests = neighbors_of(sq);
+    while (dests) {
+      uint64_t z = dests & (-dests);
+      dests ^= z;
+      square_t dest = LOG2(z);
+      WHEN_DEBUG_VERBOSE(char buf[MAX_CHARS_IN_MOVE]);
+      WHEN_DEBUG_VERBOSE({
+        move_to_str(move_of(typ, (rot_t) 0, sq, dest), buf, MAX_CHARS_IN_MOVE);
+        DEBUG_LOG(1, "Before: %s ", buf);
+      });
+      tbassert(move_count < MAX_NUM_MOVES, "move_count: %d\n", move_count);
+      sortable_move_list[move_count++] = move_of(typ, (rot_t) 0, sq, dest);
+      WHEN_DEBUG_VERBOSE({
+        move_to_str(get_move(sortable_move_list[move_count-1]), buf, MAX_CHARS_IN_MOVE);
+        DEBUG_LOG(1, "After: %s\n", buf);
+      });
+    }
 
-    square_t sq = (f + FIL_ORIGIN) * ARR_WIDTH + r + RNK_ORIGIN;
-    piece_t x = p->board[sq];
+    // rotations - three directions possible
+    for (int rot = 1; rot < 4; ++rot) {
+      tbassert(move_count < MAX_NUM_MOVES, "move_count: %d\n", move_count);
+      sortable_move_list[move_count++] = move_of(typ, (rot_t) rot, sq, sq);
+    }
+    if (typ == KING) {  // Also generate null move
+      tbassert(move_count < MAX_NUM_MOVES, "move_count: %d\n", move_count);
+      sortable_move_list[move_count++] = move_of(typ, (rot_t) 0, sq, sq);
+    }
+  }
 
-    ptype_t typ = ptype_of(x);
-    // color_t color = color_of(x);
-
-    if (typ == PAWN || typ == KING) {
-      for (int d = 0; d < 8; d++) {
-        int dest = sq + dir_of(d);
-        // Skip moves into invalid squares
-        if (ptype_of(p->board[dest]) == INVALID) {
-          continue;    // illegal square
-        }
-        WHEN_DEBUG_VERBOSE(char buf[MAX_CHARS_IN_MOVE]);
-        WHEN_DEBUG_VERBOSE({
-          move_to_str(move_of(typ, (rot_t) 0, sq, dest), buf, MAX_CHARS_IN_MOVE);
-          DEBUG_LOG(1, "Before: %s ", buf);
-        });
-        tbassert(move_count < MAX_NUM_MOVES, "move_count: %d\n", move_count);
-        sortable_move_list[move_count++] = move_of(typ, (rot_t) 0, sq, dest);
-        WHEN_DEBUG_VERBOSE({
-          move_to_str(get_move(sortable_move_list[move_count-1]), buf, MAX_CHARS_IN_MOVE);
-          DEBUG_LOG(1, "After: %s\n", buf);
-        });
+  WHEN_DEBUG_VERBOSE({
+      DEBUG_LOG(1, "\nGenerated moves: ");
+      for (int i = 0; i < move_count; ++i) {
+        char buf[MAX_CHARS_IN_MOVE];
+        move_to_str(get_move(sortable_move_list[i]), buf, MAX_CHARS_IN_MOVE);
+        DEBUG_LOG(1, "%s ", buf);
       }
+      DEBUG_LOG(1, "\n");
+    });
+
+  return move_count;
+}
+
+// Generates only the moves that can change what the laser of the side to move
+// hits: every move of a piece standing in the beam, and every move onto a
+// beam square.  Any other move leaves the beam where it is, so it zaps
+// nothing unless the beam already ends on a piece (kill_d), in which case all
+// moves are generated.  Used by quiescence search, which only looks at zaps.
+static inline int generate_zaps(position_t *p, sortable_move_t *sortable_move_list,
+                  bool strict) {
+  tbassert(board_is_consistent(p), "inconsistent board\n");
+  color_t color_to_move = color_to_move_of(p);
+  if (p->kill_d[color_to_move]) {
+    return generate_all(p, sortable_move_list, strict);
+  }
+
+  uint64_t beam = p->laser[color_to_move];
+  int move_count = 0;
+  // Pieces on the enemy laser path cannot move.
+  uint64_t mask = p->mask[color_to_move] & ~p->laser[opp_color(color_to_move)];
+  while (mask) {
+    uint64_t y = mask & (-mask);
+    mask ^= y;
+    square_t sq = LOG2(y);
 
+    ptype_t typ = (sq == p->kloc[color_to_move]) ? KING : PAWN;
+    bool in_beam = (beam & y) != 0;
+
+    uint64_t dests = neighbors_of(sq);
+    if (!in_beam) {
+      dests &= beam;
+    }
+    while (dests) {
+      uint64_t z = dests & (-dests);
+      dests ^= z;
+      tbassert(move_count < MAX_NUM_MOVES, "move_count: %d\n", move_count);
+      sortable_move_list[move_count++] = move_of(typ, (rot_t) 0, sq, LOG2(z));
+    }
+
+    if (in_beam) {
       // rotations - three directions possible
       for (int rot = 1; rot < 4; ++rot) {
         tbassert(move_count < MAX_NUM_MOVES, "move_count: %d\n", move_count);
@@ -1651,16 +2329,6 @@ static inline int generate_all(position_t *p, sortable_move_t *sortable_move_lis
     }
   }
 
-  WHEN_DEBUG_VERBOSE({
-      DEBUG_LOG(1, "\nGenerated moves: ");
-      for (int i = 0; i < move_count; ++i) {
-        char buf[MAX_CHARS_IN_MOVE];
-        move_to_str(get_move(sortable_move_list[i]), buf, MAX_CHARS_IN_MOVE);
-        DEBUG_LOG(1, "%s ", buf);
-      }
-      DEBUG_LOG(1, "\n");
-    });
-
   return move_count;
 }
 
@@ -1668,46 +2336,41 @@ static inline int generate_all(position_t *p, sortable_move_t *sortable_move_lis
 // Move execution
 // -----------------------------------------------------------------------------
 
+// Returns the first occupied square a beam leaving sq in direction bdir runs
+// into, or NO_SQUARE if the beam leaves the board first.  The beam jumps
+// straight there instead of stepping over the empty squares in between.
+static inline square_t laser_hit(square_t sq, int bdir, uint64_t occupied) {
+  uint64_t hits = laser_ray_of(sq, bdir) & occupied;
+  if (!hits) {
+    return NO_SQUARE;
+  }
+  return (bdir == NN || bdir == EE) ? LOG2(hits) : MSB(hits);
+}
+
 // Returns the square of piece that would be zapped by the laser if fired once,
-// or 0 if no such piece exists.
+// or NO_SQUARE if no such piece exists.
 //
 // p : Current board state.
 // c : Color of king shooting laser.
 static inline square_t fire_laser(position_t *p, color_t c) {
-  tbassert(p->mask[0] == compute_mask(p, 0),
-           "p->mask: %"PRIu64", mask: %"PRIu64"\n",
-           p->mask[0], compute_mask(p, 0));
-  tbassert(p->mask[1] == compute_mask(p, 1),
-           "p->mask: %"PRIu64", mask: %"PRIu64"\n",
-           p->mask[1], compute_mask(p, 1));
-  // color_t fake_color_to_move = (color_to_move_of(p) == WHITE) ? BLACK : WHITE;0
+  tbassert(board_is_consistent(p), "inconsistent board\n");
   square_t sq = p->kloc[c];
-  int bdir = ori_of(p->board[sq]);
+  int bdir = p->kori[c];
+  uint64_t occupied = p->mask[WHITE] | p->mask[BLACK];
 
-  tbassert(ptype_of(p->board[sq]) == KING,
-           "ptype: %d\n", ptype_of(p->board[sq]));
+  tbassert(occupied & square_bit(sq), "sq: %d\n", sq);
 
   while (true) {
-    sq += beam_of(bdir);
-    tbassert(sq < ARR_SIZE && sq >= 0, "sq: %d\n", sq);
-    switch (ptype_of(p->board[sq])) {
-      case EMPTY:  // empty square
-        break;
-      case PAWN:  // Pawn
-        bdir = reflect_of(bdir, ori_of(p->board[sq]));
-        if (bdir < 0) {  // Hit back of Pawn
-          return sq;
-        }
-        break;
-      case KING:  // King
-        return sq;  // sorry, game over my friend!
-        break;
-      case INVALID:  // Ran off edge of board
-        return 0;
-        break;
-      // default:  // Shouldna happen, man!
-      //   // tbassert(false, "Like porkchops and whipped cream.\n");
-      //   break;
+    sq = laser_hit(sq, bdir, occupied);
+    if (sq == NO_SQUARE) {  // Ran off edge of board
+      return NO_SQUARE;
+    }
+    if (sq == p->kloc[WHITE] || sq == p->kloc[BLACK]) {  // King
+      return sq;  // sorry, game over my friend!
+    }
+    bdir = reflect_of(bdir, pawn_ori_at(p, sq));  // Pawn
+    if (bdir < 0) {  // Hit back of Pawn
+      return sq;
     }
   }
 }
@@ -1720,6 +2383,66 @@ static inline square_t fire_laser(position_t *p, color_t c) {
 //   return false;
 // }
 
+// Moves (or rotates) the piece of mv on p itself and updates the hash key.
+// A translation swaps the contents of the two squares, so applying a move
+// from to_sq back to from_sq takes it back; likewise for the opposite
+// rotation.
+static inline void apply_move(position_t *p, move_t mv) {
+  square_t from_sq = from_square(mv);
+  square_t to_sq = to_square(mv);
+  rot_t rot = rot_of(mv);
+
+  tbassert(from_sq < NUM_SQUARES, "from_sq: %d\n", from_sq);
+  tbassert(to_sq < NUM_SQUARES, "to_sq: %d\n", to_sq);
+  tbassert(board_is_consistent(p), "inconsistent board\n");
+
+  p->key ^= zob_color;   // swap color to move
+
+  piece_t from_piece = piece_at(p, from_sq);
+  piece_t to_piece = piece_at(p, to_sq);
+
+  if (to_sq != from_sq) {  // move, not rotation
+    // Hash key updates
+    p->key ^= zob[from_sq][from_piece];  // remove from_piece from from_sq
+    p->key ^= zob[to_sq][to_piece];  // remove to_piece from to_sq
+
+    p->key ^= zob[to_sq][from_piece];  // place from_piece in to_sq
+    p->key ^= zob[from_sq][to_piece];  // place to_piece in from_sq
+
+    // swap from_piece and to_piece on board: every set that holds exactly one
+    // of the two pieces gets both squares flipped.
+    uint64_t tmp = square_bit(from_sq) ^ square_bit(to_sq);
+    p->mask[color_of(from_piece)] ^= tmp;
+    if (to_piece)
+      p->mask[color_of(to_piece)] ^= tmp;
+
+    // Update King locations and Pawn sets
+    if (ptype_of(from_piece) == KING) {
+      p->kloc[color_of(from_piece)] = to_sq;
+    } else {
+      p->pawn[ori_of(from_piece)] ^= tmp;
+    }
+    if (ptype_of(to_piece) == KING) {
+      p->kloc[color_of(to_piece)] = from_sq;
+    } else if (to_piece) {
+      p->pawn[ori_of(to_piece)] ^= tmp;
+    }
+
+  } else {  // rotation
+    // remove from_piece from from_sq in hash
+    p->key ^= zob[from_sq][from_piece];
+    int ori = ORI_MASK & (rot + ori_of(from_piece));
+    if (ptype_of(from_piece) == KING) {
+      p->kori[color_of(from_piece)] = ori;
+    } else {
+      p->pawn[ori_of(from_piece)] ^= square_bit(from_sq);
+      p->pawn[ori] ^= square_bit(from_sq);
+    }
+    set_ori(&from_piece, ori);  // rotate from_piece
+    p->key ^= zob[from_sq][from_piece];              // ... and in hash
+  }
+}
+
 static inline void low_level_make_move(position_t *old, position_t *p, move_t mv) {
   tbassert(mv != 0, "mv was zero.\n");
 
@@ -1732,12 +2455,7 @@ static inline void low_level_make_move(position_t *old, position_t *p, move_t mv
   tbassert(old->key == compute_zob_key(old),
            "old->key: %"PRIu64", zob-key: %"PRIu64"\n",
            old->key, compute_zob_key(old));
-  tbassert(old->mask[0] == compute_mask(old, 0),
-           "old->key: %"PRIu64", zob-key: %"PRIu64"\n",
-           old->mask[0], compute_mask(old, 0));
-  tbassert(old->mask[1] == compute_mask(old, 1),
-           "old->key: %"PRIu64", zob-key: %"PRIu64"\n",
-           old->mask[1], compute_mask(old, 1));
+  tbassert(board_is_consistent(old), "inconsistent board\n");
 
 
   WHEN_DEBUG_VERBOSE({
@@ -1745,11 +2463,10 @@ static inline void low_level_make_move(position_t *old, position_t *p, move_t mv
       display(old);
     });
 
-  square_t from_sq = from_square(mv);
-  square_t to_sq = to_square(mv);
-  rot_t rot = rot_of(mv);
-
   WHEN_DEBUG_VERBOSE({
+      square_t from_sq = from_square(mv);
+      square_t to_sq = to_square(mv);
+      rot_t rot = rot_of(mv);
       DEBUG_LOG(1, "low_level_make_move 2:\n");
       square_to_str(from_sq, buf, MAX_CHARS_IN_MOVE);
       DEBUG_LOG(1, "from_sq: %s\n", buf);
@@ -1779,64 +2496,7 @@ static inline void low_level_make_move(position_t *old, position_t *p, move_t mv
   p->history = old;
   p->last_move = mv;
 
-  tbassert(from_sq < ARR_SIZE && from_sq > 0, "from_sq: %d\n", from_sq);
-  tbassert(p->board[from_sq] < (1 << PIECE_SIZE) && p->board[from_sq] >= 0,
-           "p->board[from_sq]: %d\n", p->board[from_sq]);
-  tbassert(to_sq < ARR_SIZE && to_sq > 0, "to_sq: %d\n", to_sq);
-  tbassert(p->board[to_sq] < (1 << PIECE_SIZE) && p->board[to_sq] >= 0,
-           "p->board[to_sq]: %d\n", p->board[to_sq]);
-  tbassert(p->mask[0] == compute_mask(p, 0),
-           "p->mask: %"PRIu64", mask: %"PRIu64"\n",
-           p->mask[0], compute_mask(p, 0));
-  tbassert(p->mask[1] == compute_mask(p, 1),
-           "p->mask: %"PRIu64", mask: %"PRIu64"\n",
-           p->mask[1], compute_mask(p, 1));
-
-  p->key ^= zob_color;   // swap color to move
-
-  piece_t from_piece = p->board[from_sq];
-  piece_t to_piece = p->board[to_sq];
-
-    
-  // printf("?? %d %d\n", from_sq, to_sq);
-
-  if (to_sq != from_sq) {  // move, not rotation
-    // Hash key updates
-    p->key ^= zob[from_sq][from_piece];  // remove from_piece from from_sq
-    p->key ^= zob[to_sq][to_piece];  // remove to_piece from to_sq
-
-    p->board[to_sq] = from_piece;  // swap from_piece and to_piece on board
-    p->board[from_sq] = to_piece;
-
-    p->key ^= zob[to_sq][from_piece];  // place from_piece in to_sq
-    p->key ^= zob[from_sq][to_piece];  // place to_piece in from_sq
-
-    // if (!to_piece) {
-
-    uint64_t tmp = sq_to_board_bit[from_sq] ^ sq_to_board_bit[to_sq];
-    p->mask[color_of(from_piece)] ^= tmp;
-    if (to_piece)
-      p->mask[color_of(to_piece)] ^= tmp;
-    // }
-    // if ()
-    // Update King locations if necessary
-    if (ptype_of(from_piece) == KING) {
-      p->kloc[color_of(from_piece)] = to_sq;
-    }
-    if (ptype_of(to_piece) == KING) {
-      p->kloc[color_of(to_piece)] = from_sq;
-    }
-
-  } else {  // rotation
-    // remove from_piece from from_sq in hash
-    p->key ^= zob[from_sq][from_piece];
-    set_ori(&from_piece, rot + ori_of(from_piece));  // rotate from_piece
-    p->board[from_sq] = from_piece;  // place rotated piece on board
-    p->key ^= zob[from_sq][from_piece];              // ... and in hash
-  }
-
-  // p->laser[0] = mark_laser_path_bit(p, 0);
-  // p->laser[1] = mark_laser_path_bit(p, 1);
+  apply_move(p, mv);
 
   // Increment ply
   p->ply++;
@@ -1845,12 +2505,7 @@ static inline void low_level_make_move(position_t *old, position_t *p, move_t mv
            "p->key: %"PRIu64", zob-key: %"PRIu64"\n",
            p->key, compute_zob_key(p));
 
-  tbassert(p->mask[0] == compute_mask(p, 0),
-           "p->mask: %"PRIu64", mask: %"PRIu64"\n",
-           p->mask[0], compute_mask(p, 0));
-  tbassert(p->mask[1] == compute_mask(p, 1),
-           "p->mask: %"PRIu64", mask: %"PRIu64"\n",
-           p->mask[1], compute_mask(p, 1));
+  tbassert(board_is_consistent(p), "inconsistent board\n");
 
   WHEN_DEBUG_VERBOSE({
       fprintf(stderr, "After:\n");
@@ -1858,6 +2513,20 @@ static inline void low_level_make_move(position_t *old, position_t *p, move_t mv
     });
 }
 
+// Whether two positions have the same pieces on the same squares.  The board
+// is a handful of words, so this ORs together their differences instead of
+// branching on each one; the compiler turns it into a few vector compares.
+// Callers test the hash keys first, which almost always differ.
+static inline bool same_board(position_t *a, position_t *b) {
+  uint64_t diff = (a->mask[WHITE] ^ b->mask[WHITE]) |
+                  (a->mask[BLACK] ^ b->mask[BLACK]) |
+                  (a->pawn[NW] ^ b->pawn[NW]) | (a->pawn[NE] ^ b->pawn[NE]) |
+                  (a->pawn[SE] ^ b->pawn[SE]) | (a->pawn[SW] ^ b->pawn[SW]);
+  diff |= (a->kloc[WHITE] ^ b->kloc[WHITE]) | (a->kloc[BLACK] ^ b->kloc[BLACK]) |
+          (a->kori[WHITE] ^ b->kori[WHITE]) | (a->kori[BLACK] ^ b->kori[BLACK]);
+  return diff == 0;
+}
+
 // return victim pieces or KO
 static inline victims_t make_move(position_t *old, position_t *p, move_t mv) {
 
@@ -1869,37 +2538,34 @@ static inline victims_t make_move(position_t *old, position_t *p, move_t mv) {
   low_level_make_move(old, p, mv);
 
   // move phase 2 - shooting the laser
-  square_t victim_sq = 0;
+  square_t victim_sq = NO_SQUARE;
   p->victims = 0;
   
   // static int count = 0, cnt = 0;
   // count += 1;
 
   
-  while ((victim_sq = fire_laser(p, color_to_move_of(old)))) {
+  while ((victim_sq = fire_laser(p, color_to_move_of(old))) != NO_SQUARE) {
     WHEN_DEBUG_VERBOSE({
         square_to_str(victim_sq, buf, MAX_CHARS_IN_MOVE);
         DEBUG_LOG(1, "Zapping piece on %s\n", buf);
       });
 
     // we definitely hit something with laser, remove it from board
-    piece_t victim_piece = p->board[victim_sq];
+    piece_t victim_piece = piece_at(p, victim_sq);
     p->victims ++;
     p->victims |= 16 << color_of(victim_piece);
     p->key ^= zob[victim_sq][victim_piece];
-    p->board[victim_sq] = 0;
     p->key ^= zob[victim_sq][0];
-    p->mask[color_of(victim_piece)] ^= sq_to_board_bit[victim_sq];
+    p->mask[color_of(victim_piece)] ^= square_bit(victim_sq);
+    if (ptype_of(victim_piece) == PAWN) {
+      p->pawn[ori_of(victim_piece)] ^= square_bit(victim_sq);
+    }
     
     tbassert(p->key == compute_zob_key(p),
              "p->key: %"PRIu64", zob-key: %"PRIu64"\n",
              p->key, compute_zob_key(p));
-    tbassert(p->mask[0] == compute_mask(p, 0),
-           "p->mask: %"PRIu64", mask: %"PRIu64"\n",
-           p->mask[0], compute_mask(p, 0));
-    tbassert(p->mask[1] == compute_mask(p, 1),
-           "p->mask: %"PRIu64", mask: %"PRIu64"\n",
-           p->mask[1], compute_mask(p, 1));
+    tbassert(board_is_consistent(p), "inconsistent board\n");
 
     WHEN_DEBUG_VERBOSE({
         square_to_str(victim_sq, buf, MAX_CHARS_IN_MOVE);
@@ -1920,31 +2586,12 @@ static inline victims_t make_move(position_t *old, position_t *p, move_t mv) {
   // square_t to_sq = to_square(mv);
 
   if (USE_KO) {  // Ko rule
-    if (p->key == (old->key ^ zob_color) && p->mask[0] == old->mask[0] && p->mask[1] == old->mask[1]) {
-      bool match = true;
-
-
-      for (fil_t f = FIL_ORIGIN * ARR_WIDTH; f < FIL_ORIGIN * ARR_WIDTH + BOARD_WIDTH * ARR_WIDTH; f += ARR_WIDTH) {
-        for (rnk_t r = f + RNK_ORIGIN; r < f + RNK_ORIGIN + BOARD_WIDTH; ++r) {
-          if (p -> board[r] != old -> board[r])
-            match = false;
-        }
-      }
-
-      if (match) return KO();
+    if (p->key == (old->key ^ zob_color) && same_board(p, old)) {
+      return KO();
     }
 
-    if (p->key == old->history->key && p->mask[0] == old->history->mask[0] && p->mask[1] == old->history->mask[1]) {
-      bool match = true;
-
-      for (fil_t f = FIL_ORIGIN * ARR_WIDTH; f < FIL_ORIGIN * ARR_WIDTH + BOARD_WIDTH * ARR_WIDTH; f += ARR_WIDTH) {
-        for (rnk_t r = f + RNK_ORIGIN; r < f + RNK_ORIGIN + BOARD_WIDTH; ++r) {
-          if (p -> board[r] != old -> history -> board[r])
-            match = false;
-        }
-      }
-
-      if (match) return KO();
+    if (p->key == old->history->key && same_board(p, old->history)) {
+      return KO();
     }
   }
   // printf("in\n");
@@ -1956,6 +2603,49 @@ static inline victims_t make_move(position_t *old, position_t *p, move_t mv) {
   return p->victims;
 }
 
+// How many laser paths update_laser_paths() was asked for, and how many of
+// those it could copy from the parent position instead of recomputing.  Reset
+// when a search starts.  Only kept in STATS builds (see util.h).
+static struct {
+  uint64_t updates, skipped;
+} laser_stats;
+
+#define LASER_COUNT(field, n) \
+  WHEN_STATS(__atomic_fetch_add(&laser_stats.field, (n), __ATOMIC_RELAXED))
+
+static inline void laser_reset_stats() {
+  memset(&laser_stats, 0, sizeof(laser_stats));
+}
+
+void laser_print_stats(FILE *OUT) {
+  if (!STATS) {
+    return;
+  }
+  double skip_rate = laser_stats.updates ?
+      100.0 * laser_stats.skipped / laser_stats.updates : 0.0;
+  fprintf(OUT, "info string laser paths %" PRIu64 " recomputations skipped %"
+          PRIu64 " (%.1f%%)\n", laser_stats.updates, laser_stats.skipped,
+          skip_rate);
+}
+
+// Brings p->laser[] (and p->kill_d[]), which still hold the paths of the
+// parent position, up to date.  A laser path only depends on what stands on
+// its own squares, so a color keeps its old path unless the move touched one
+// of them: the from/to squares (which also covers a King moving or rotating,
+// and a piece stepping into the beam) and the squares of the zapped pieces.
+static inline void update_laser_paths(position_t *p, uint64_t touched) {
+  for (int c = WHITE; c <= BLACK; c++) {
+    if (p->laser[c] & touched) {
+      p->laser[c] = mark_laser_path_bit(p, c);
+    } else {
+      LASER_COUNT(skipped, 1);
+    }
+    tbassert(p->laser[c] == mark_laser_path_bit(p, c),
+             "stale laser path for color %d\n", c);
+  }
+  LASER_COUNT(updates, 2);
+}
+
 victims_t make_move2(position_t *old, position_t *p, move_t mv) {
 
   tbassert(mv != 0, "mv was zero.\n");
@@ -1964,40 +2654,43 @@ victims_t make_move2(position_t *old, position_t *p, move_t mv) {
 
   // move phase 1 - moving a piece
   low_level_make_move(old, p, mv);
+
+  // The search probes the table for the child next, and then evaluates it.
+  // Unless the laser zaps something, the key is final now; fetch its set and
+  // its eval cache entry while the laser is fired.
+  tt_prefetch(p->key);
+  eval_cache_prefetch(p->key);
   
   //================================================
 
   // move phase 2 - shooting the laser
-  square_t victim_sq = 0;
+  square_t victim_sq = NO_SQUARE;
   p->victims = 0;
   
   // static int count = 0, cnt = 0;
   // count += 1;
 
-  while ((victim_sq = fire_laser(p, color_to_move_of(old)))) {
+  while ((victim_sq = fire_laser(p, color_to_move_of(old))) != NO_SQUARE) {
     WHEN_DEBUG_VERBOSE({
         square_to_str(victim_sq, buf, MAX_CHARS_IN_MOVE);
         DEBUG_LOG(1, "Zapping piece on %s\n", buf);
       });
 
     // we definitely hit something with laser, remove it from board
-    piece_t victim_piece = p->board[victim_sq];
+    piece_t victim_piece = piece_at(p, victim_sq);
     p->victims ++;
     p->victims |= 16 << color_of(victim_piece);
     p->key ^= zob[victim_sq][victim_piece];
-    p->board[victim_sq] = 0;
     p->key ^= zob[victim_sq][0];
-    p->mask[color_of(victim_piece)] ^= sq_to_board_bit[victim_sq];
+    p->mask[color_of(victim_piece)] ^= square_bit(victim_sq);
+    if (ptype_of(victim_piece) == PAWN) {
+      p->pawn[ori_of(victim_piece)] ^= square_bit(victim_sq);
+    }
     
     tbassert(p->key == compute_zob_key(p),
              "p->key: %"PRIu64", zob-key: %"PRIu64"\n",
              p->key, compute_zob_key(p));
-    tbassert(p->mask[0] == compute_mask(p, 0),
-           "p->mask: %"PRIu64", mask: %"PRIu64"\n",
-           p->mask[0], compute_mask(p, 0));
-    tbassert(p->mask[1] == compute_mask(p, 1),
-           "p->mask: %"PRIu64", mask: %"PRIu64"\n",
-           p->mask[1], compute_mask(p, 1));
+    tbassert(board_is_consistent(p), "inconsistent board\n");
 
     WHEN_DEBUG_VERBOSE({
         square_to_str(victim_sq, buf, MAX_CHARS_IN_MOVE);
@@ -2017,46 +2710,163 @@ victims_t make_move2(position_t *old, position_t *p, move_t mv) {
   // square_t to_sq = to_square(mv);
 
   if (USE_KO) {  // Ko rule
-    if (p->key == (old->key ^ zob_color) && p->mask[0] == old->mask[0] && p->mask[1] == old->mask[1]) {
-      bool match = true;
+    if (p->key == (old->key ^ zob_color) && same_board(p, old)) {
+      return KO();
+    }
 
+    if (p->key == old->history->key && same_board(p, old->history)) {
+      return KO();
+    }
+  }
 
-      for (fil_t f = FIL_ORIGIN * ARR_WIDTH; f < FIL_ORIGIN * ARR_WIDTH + BOARD_WIDTH * ARR_WIDTH; f += ARR_WIDTH) {
-        for (rnk_t r = f + RNK_ORIGIN; r < f + RNK_ORIGIN + BOARD_WIDTH; ++r) {
-          if (p -> board[r] != old -> board[r])
-            match = false;
-        }
-      }
+  // the laser paths are stale only if the move touched them
+  if (!(p->victims & 128)) {
+    uint64_t touched = square_bit(from_square(mv)) | square_bit(to_square(mv)) |
+        ((old->mask[WHITE] | old->mask[BLACK]) ^ (p->mask[WHITE] | p->mask[BLACK]));
+    update_laser_paths(p, touched);
+  }
+  return p->victims;
+}
 
-      if (match) return KO();
-    }
+// -----------------------------------------------------------------------------
+// In-place move execution
+// -----------------------------------------------------------------------------
 
-    if (p->key == old->history->key && p->mask[0] == old->history->mask[0] && p->mask[1] == old->history->mask[1]) {
-      bool match = true;
+// make_move() and make_move2() build the child in a second position_t and
+// chain it through history, which the search needs: every spawned child owns
+// its board, and the Ko rule compares against the earlier boards.  Perft
+// needs neither, so it makes the move on the board itself and takes it back
+// with unmake_move().
+//
+// Moves and rotations are their own undo (see apply_move), so the undo record
+// only has to remember what the laser destroyed and the state derived from
+// the board.
 
-      for (fil_t f = FIL_ORIGIN * ARR_WIDTH; f < FIL_ORIGIN * ARR_WIDTH + BOARD_WIDTH * ARR_WIDTH; f += ARR_WIDTH) {
-        for (rnk_t r = f + RNK_ORIGIN; r < f + RNK_ORIGIN + BOARD_WIDTH; ++r) {
-          if (p -> board[r] != old -> history -> board[r])
-            match = false;
-        }
-      }
+// Moves the piece and fires the laser on p itself, remembering in undo
+// everything that unmake_move() needs.  Lasers and Ko are left alone.
+static inline victims_t do_move_in_place(position_t *p, move_t mv,
+                                         undo_t *undo) {
+  tbassert(mv != 0, "mv was zero.\n");
+  color_t c = color_to_move_of(p);
+
+  undo->key = p->key;
+  undo->last_move = p->last_move;
+  undo->victims = p->victims;
+  undo->laser[WHITE] = p->laser[WHITE];
+  undo->laser[BLACK] = p->laser[BLACK];
+  undo->kill_d[WHITE] = p->kill_d[WHITE];
+  undo->kill_d[BLACK] = p->kill_d[BLACK];
+  undo->num_zapped = 0;
+
+  apply_move(p, mv);
+  p->last_move = mv;
+  p->ply++;
+
+  square_t victim_sq = NO_SQUARE;
+  p->victims = 0;
+
+  while ((victim_sq = fire_laser(p, c)) != NO_SQUARE) {
+    piece_t victim_piece = piece_at(p, victim_sq);
+    tbassert(undo->num_zapped < MAX_ZAPS, "num_zapped: %d\n", undo->num_zapped);
+    undo->zapped_sq[undo->num_zapped] = victim_sq;
+    undo->zapped_piece[undo->num_zapped++] = victim_piece;
 
-      if (match) return KO();
+    p->victims++;
+    p->victims |= 16 << color_of(victim_piece);
+    p->key ^= zob[victim_sq][victim_piece];   // remove from board
+    p->key ^= zob[victim_sq][0];
+    p->mask[color_of(victim_piece)] ^= square_bit(victim_sq);
+    if (ptype_of(victim_piece) == PAWN) {
+      p->pawn[ori_of(victim_piece)] ^= square_bit(victim_sq);
+    }
+
+    if (ptype_of(victim_piece) == KING) {
+      p->victims |= 128;
+      if (color_of(victim_piece))
+        p->victims |= 64;
+      break;
     }
   }
+
+  tbassert(p->key == compute_zob_key(p),
+           "p->key: %"PRIu64", zob-key: %"PRIu64"\n",
+           p->key, compute_zob_key(p));
+  tbassert(board_is_consistent(p), "inconsistent board\n");
   return p->victims;
 }
 
+#ifndef NDEBUG
+// Whether unmake_move() brought a back to b: the board and every field
+// do_move_in_place() touches.
+static inline bool same_position(position_t *a, position_t *b) {
+  return same_board(a, b) && a->key == b->key && a->ply == b->ply &&
+      a->last_move == b->last_move && a->victims == b->victims &&
+      a->laser[WHITE] == b->laser[WHITE] && a->laser[BLACK] == b->laser[BLACK] &&
+      a->kill_d[WHITE] == b->kill_d[WHITE] && a->kill_d[BLACK] == b->kill_d[BLACK];
+}
+#endif
+
+// Takes back the move recorded in undo.
+static inline void unmake_move(position_t *p, undo_t *undo) {
+  // put the zapped pieces back
+  for (int i = undo->num_zapped - 1; i >= 0; i--) {
+    square_t sq = undo->zapped_sq[i];
+    piece_t x = undo->zapped_piece[i];
+    p->mask[color_of(x)] ^= square_bit(sq);
+    if (ptype_of(x) == PAWN) {
+      p->pawn[ori_of(x)] ^= square_bit(sq);
+    }
+  }
+
+  // a move from to_sq back to from_sq, with the opposite rotation
+  move_t mv = p->last_move;
+  apply_move(p, move_of(ptype_mv_of(mv), (rot_t) (ROT_MASK & -rot_of(mv)),
+                        to_square(mv), from_square(mv)));
+
+  p->key = undo->key;
+  p->last_move = undo->last_move;
+  p->victims = undo->victims;
+  p->laser[WHITE] = undo->laser[WHITE];
+  p->laser[BLACK] = undo->laser[BLACK];
+  p->kill_d[WHITE] = undo->kill_d[WHITE];
+  p->kill_d[BLACK] = undo->kill_d[BLACK];
+  p->ply--;
+
+  tbassert(p->key == compute_zob_key(p),
+           "p->key: %"PRIu64", zob-key: %"PRIu64"\n",
+           p->key, compute_zob_key(p));
+  tbassert(board_is_consistent(p), "inconsistent board\n");
+}
+
 // -----------------------------------------------------------------------------
 // Move path enumeration (perft)
 // -----------------------------------------------------------------------------
 
-// Helper function for do_perft() (ply starting with 0).
+// Perft transposition table.  A subtree count only depends on the position
+// and the remaining depth (the laser paths stay those of the root for the
+// whole run), so counts are cached by hash key and depth.  Each entry keeps
+// the count next to check = key ^ salt(depth) ^ count: an entry torn by two
+// parallel writers fails the check and reads as a miss.
+typedef struct perft_entry {
+  uint64_t check;
+  uint64_t count;
+} perft_entry_t;
+
+typedef struct perft_table {
+  perft_entry_t *entries;
+  uint64_t mask;  // number of entries - 1
+} perft_table_t;
+
+#define perft_lock_of(key, depth) \
+  ((key) ^ ((uint64_t) (depth) * 0x9e3779b97f4a7c15ULL))
+
+// Helper function for do_perft() (ply starting with 0).  tt may be NULL.
 //
 // NOTE: This function reimplements some of the logic for make_move().
-static uint64_t perft_search(position_t *p, int depth, int ply) {
+static uint64_t perft_search(position_t *p, int depth, int ply,
+                             perft_table_t *tt) {
   uint64_t node_count = 0;
-  position_t np;
+  undo_t undo;
   sortable_move_t lst[MAX_NUM_MOVES];
   int num_moves;
   int i;
@@ -2071,62 +2881,111 @@ static uint64_t perft_search(position_t *p, int depth, int ply) {
     return num_moves;
   }
 
+  perft_entry_t *entry = NULL;
+  uint64_t lock = perft_lock_of(p->key, depth);
+  if (tt) {
+    entry = &tt->entries[p->key & tt->mask];
+    perft_entry_t cached = *entry;
+    if ((cached.check ^ cached.count) == lock) {
+      return cached.count;
+    }
+  }
+
   for (i = 0; i < num_moves; i++) {
     move_t mv = get_move(lst[i]);
+#ifndef NDEBUG
+    position_t before = *p;
+#endif
 
-    low_level_make_move(p, &np, mv);  // make the move baby!
+    // make the move baby!  Lasers are not updated, just as before.
+    victims_t victims = do_move_in_place(p, mv, &undo);
 
-    square_t victim_sq = 0;  // the guys to disappear
-    np.victims = 0;
-    
-    while ((victim_sq = fire_laser(&np, color_to_move_of(p)))) {  // hit a piece
-      piece_t victim_piece = np.board[victim_sq];
-      tbassert((ptype_of(victim_piece) != EMPTY) &&
-               (ptype_of(victim_piece) != INVALID),
-               "type: %d\n", ptype_of(victim_piece));
-
-      np.victims++;
-      np.victims |= 16 << color_of(victim_piece);
-      np.key ^= zob[victim_sq][victim_piece];   // remove from board
-      np.board[victim_sq] = 0;
-      np.key ^= zob[victim_sq][0];
-      np.mask[color_of(victim_piece)] ^= sq_to_board_bit[victim_sq];
-
-      if (ptype_of(victim_piece) == KING) {
-        np.victims |= 128;
-        if (color_of(victim_piece))
-          np.victims |= 64;
-        break;
-      }
-    }
-
-    if (np.victims & 128) {
+    if (victims & 128) {
       // do not expand further: hit a King
       node_count++;
-      continue;
+    } else {
+      node_count += perft_search(p, depth-1, ply+1, tt);
     }
 
-    uint64_t partialcount = perft_search(&np, depth-1, ply+1);
-    node_count += partialcount;
+    unmake_move(p, &undo);
+    tbassert(same_position(p, &before), "unmake_move did not restore the "
+             "position before move %d\n", i);
   }
 
-  np.laser[0] = mark_laser_path_bit(&np, 0);
-  np.laser[1] = mark_laser_path_bit(&np, 1);
+  if (entry) {
+    entry->count = node_count;
+    entry->check = lock ^ node_count;
+  }
   return node_count;
 }
 
+// Counts the paths of the given depth that start with the root move mv.
+static uint64_t perft_root_move(position_t *p, move_t mv, int depth,
+                                perft_table_t *tt) {
+  if (depth == 1) {
+    return 1;
+  }
+  position_t np = *p;  // every parallel subtree gets its own board
+  undo_t undo;
+  if (do_move_in_place(&np, mv, &undo) & 128) {
+    return 1;  // hit a King
+  }
+  return perft_search(&np, depth-1, 1, tt);
+}
+
 // Debugging function to help verify that the move generator is working
-// correctly.
+// correctly.  Counts the move paths of length 1..depth from p, searching the
+// subtrees of the root moves in parallel.  With divide set, also prints the
+// count of every root move at the last depth.  hash_mb > 0 caches subtree
+// counts in a table of that many megabytes.
 //
 // https://chessprogramming.wikispaces.com/Perft
-void do_perft(position_t *gme, int depth, int ply) {
-  fen_to_pos(gme, "");
+void do_perft(position_t *p, int depth, bool divide, int hash_mb) {
+  perft_table_t table;
+  perft_table_t *tt = NULL;
+  if (hash_mb > 0) {
+    uint64_t num_entries = 1;
+    while (num_entries * 2 * sizeof(perft_entry_t) <= ((uint64_t) hash_mb << 20)) {
+      num_entries *= 2;
+    }
+    table.entries = (perft_entry_t *) calloc(num_entries, sizeof(perft_entry_t));
+    table.mask = num_entries - 1;
+    if (table.entries == NULL) {
+      printf("info string Could not allocate %d MB for the perft table\n",
+             hash_mb);
+    } else {
+      tt = &table;
+    }
+  }
+
+  sortable_move_t lst[MAX_NUM_MOVES];
+  uint64_t counts[MAX_NUM_MOVES];
+  int num_moves = generate_all(p, lst, true);
 
   for (int d = 1; d <= depth; d++) {
     printf("perft %2d ", d);
-    uint64_t j = perft_search(gme, d, 0);
+    fflush(stdout);
+    cilk_for (int i = 0; i < num_moves; i++) {
+      counts[i] = perft_root_move(p, get_move(lst[i]), d, tt);
+    }
+    uint64_t j = 0;
+    for (int i = 0; i < num_moves; i++) {
+      j += counts[i];
+    }
     printf("%" PRIu64 "\n", j);
   }
+
+  if (divide && depth >= 1) {
+    for (int i = 0; i < num_moves; i++) {
+      char buf[MAX_CHARS_IN_MOVE];
+      move_to_str(get_move(lst[i]), buf, MAX_CHARS_IN_MOVE);
+      printf("  %s %" PRIu64 "\n", buf, counts[i]);
+    }
+  }
+
+  if (tt) {
+    free(table.entries);
+  }
 }
 
 // -----------------------------------------------------------------------------
@@ -2151,31 +3010,25 @@ void display(position_t *p) {
     printf("info Last move: NULL\n");
   }
 
-  for (rnk_t r = BOARD_WIDTH - 1; r >=0 ; --r) {
+  for (int r = BOARD_WIDTH - 1; r >= 0; --r) {
     printf("\ninfo %1d  ", r);
     for (fil_t f = 0; f < BOARD_WIDTH; ++f) {
-      square_t sq = square_of(f, r);
+      piece_t x = piece_at(p, square_of(f, r));
 
-      tbassert(ptype_of(p->board[sq]) != INVALID,
-               "ptype_of(p->board[sq]): %d\n", ptype_of(p->board[sq]));
-      /*if (p->blocked[sq]) {
-        printf(" xx");
-        continue;
-      }*/
-      if (ptype_of(p->board[sq]) == EMPTY) {       // empty square
+      if (ptype_of(x) == EMPTY) {       // empty square
         printf(" --");
         continue;
       }
 
-      int ori = ori_of(p->board[sq]);  // orientation
-      color_t c = color_of(p->board[sq]);
+      int ori = ori_of(x);  // orientation
+      color_t c = color_of(x);
 
-      if (ptype_of(p->board[sq]) == KING) {
+      if (ptype_of(x) == KING) {
         printf(" %2s", king_ori_to_rep[c][ori]);
         continue;
       }
 
-      if (ptype_of(p->board[sq]) == PAWN) {
+      if (ptype_of(x) == PAWN) {
         printf(" %2s", pawn_ori_to_rep[c][ori]);
         continue;
       }
@@ -2198,60 +3051,265 @@ void display(position_t *p) {
 
 #include "./tt.h"
 
+#include <cilk/cilk.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "./tbassert.h"
+#include "./util.h"
 
 int HASH;     // hash table size in MBytes
 int USE_TT;   // Use the transposition table.
 // Turn off for deterministic behavior of the search.
+int LAZY_CLEAR;  // Clear the table by starting a new age instead of zeroing it.
+int TT_DEPTH_SLOTS;  // Records per set that prefer deeper searches.
+int TT_SHARED;  // If not 0, the shared memory segment that holds the table.
+
+// A record is packed into a single 64-bit word, so it is always read and
+// written whole: workers share the table without locks and can never see half
+// of one store and half of another.  The set index already fixes the low bits
+// of the key, so only the top 16 bits are kept to tell records apart.
+//
+//   63 ... 58 | 57 56 | 55 ... 48 | 47 ... 32 | 31 ... 16 | 15 ... 0
+//      age    | bound |  quality  |   score   |   move    |   key
+//
+// https://chessprogramming.wikispaces.com/Shared+Hash+Table#Lockless
+typedef uint64_t ttEntry_t;
+
+#define ENTRY_KEY_SHIFT 0
+#define ENTRY_MOVE_SHIFT 16
+#define ENTRY_SCORE_SHIFT 32
+#define ENTRY_QUALITY_SHIFT 48
+#define ENTRY_BOUND_SHIFT 56
+#define ENTRY_BOUND_MASK 3
+#define ENTRY_AGE_SHIFT 58
+#define ENTRY_AGE_MASK 0x3F
+
+// the bits of the key that are kept in the entry
+#define key_check_of(key) ((uint16_t) ((key) >> 48))
+
+static inline ttEntry_t pack_record(uint64_t key, move_t move, score_t score,
+                                    int quality, ttBound_t bound,
+                                    unsigned age) {
+  return ((uint64_t) key_check_of(key) << ENTRY_KEY_SHIFT) |
+      ((uint64_t) move << ENTRY_MOVE_SHIFT) |
+      ((uint64_t) (uint16_t) score << ENTRY_SCORE_SHIFT) |
+      ((uint64_t) (uint8_t) quality << ENTRY_QUALITY_SHIFT) |
+      ((uint64_t) (bound & ENTRY_BOUND_MASK) << ENTRY_BOUND_SHIFT) |
+      ((uint64_t) (age & ENTRY_AGE_MASK) << ENTRY_AGE_SHIFT);
+}
 
-// the actual record that holds the data for the transposition
-// typedef to be ttRec_t in tt.h
-struct ttRec {
-  uint64_t  key;
-  move_t    move;
-  score_t   score;
-  int       quality;
-  ttBound_t bound;
-  int       age;
-};
+static inline void unpack_record(uint64_t key, ttEntry_t entry, ttRec_t *rec) {
+  rec->key = key;
+  rec->move = (move_t) (entry >> ENTRY_MOVE_SHIFT);
+  rec->score = (score_t) (uint16_t) (entry >> ENTRY_SCORE_SHIFT);
+  rec->quality = (int8_t) (entry >> ENTRY_QUALITY_SHIFT);
+  rec->bound = (ttBound_t) ((entry >> ENTRY_BOUND_SHIFT) & ENTRY_BOUND_MASK);
+  rec->age = (entry >> ENTRY_AGE_SHIFT) & ENTRY_AGE_MASK;
+}
+
+#define entry_matches(entry, key) \
+  ((uint16_t) ((entry) >> ENTRY_KEY_SHIFT) == key_check_of(key))
 
+static inline ttEntry_t load_entry(ttEntry_t *entry) {
+  return __atomic_load_n(entry, __ATOMIC_RELAXED);
+}
+
+static inline void store_entry(ttEntry_t *entry, ttEntry_t value) {
+  __atomic_store_n(entry, value, __ATOMIC_RELAXED);
+}
+
+
+// each set is an 8-way set-associative cache that fills one cache line
+#define RECORDS_PER_SET 8
+#define SET_ALIGNMENT 64
+typedef struct {
+  ttEntry_t records[RECORDS_PER_SET];
+} __attribute__((aligned(SET_ALIGNMENT))) ttSet_t;
+
+
+// A saved or shared table is a header followed by the sets exactly as they are
+// laid out in memory.  Records only mean something under the Zobrist keys that
+// made them, so the header carries those along.
+#define TT_FILE_MAGIC 0x3130545443534c4cULL  // "LLSCTT01"
 
-// each set is a 4-way set-associative cache and contains 4 records
-#define RECORDS_PER_SET 4
 typedef struct {
-  ttRec_t records[RECORDS_PER_SET];
-} ttSet_t;
+  uint64_t magic;
+  uint64_t num_of_sets;
+  uint64_t age;
+  uint64_t clear_age;
+  uint64_t zob[ZOB_NUM_KEYS];
+} ttFileHeader_t;
+
+// sets start on a cache line boundary within the file
+#define TT_FILE_SETS_OFFSET \
+  ((sizeof(ttFileHeader_t) + SET_ALIGNMENT - 1) & ~(SET_ALIGNMENT - 1))
+
+
+// where the memory of the table came from
+typedef enum {
+  PAGES_NONE,         // no table allocated
+  PAGES_NORMAL,       // posix_memalign
+  PAGES_TRANSPARENT,  // anonymous mapping advised to use transparent huge pages
+  PAGES_HUGETLB,      // anonymous mapping of reserved huge pages
+  PAGES_SHARED        // POSIX shared memory segment, see tt_attach_shared()
+} ttPages_t;
 
+static const char *pages_strs[] = {"none", "normal", "transparent huge",
+                                   "hugetlb", "shared"};
 
 // struct def for the global transposition table
 struct ttHashtable {
   uint64_t num_of_sets;    // how many sets in the hashtable
   uint64_t mask;           // a mask to map from key to set index
   unsigned age;
+  unsigned clear_age;      // age started by the last lazy clear
   ttSet_t *tt_set;         // array of sets that contains the transposition
+  size_t num_of_bytes;     // size of the allocation behind tt_set
+  ttPages_t pages;
+  ttFileHeader_t *shared;  // header of the shared segment, if any
 } hashtable;  // name of the global transposition table
 
+#define HUGE_PAGE_SIZE (2ULL << 20)
+
+
+// Counts of table events, for tuning the table size (see COUNT() in util.h).
+void tt_print_stats(FILE *OUT) {
+  uint64_t probes = counter_total(COUNT_TT_PROBES);
+  uint64_t hits = counter_total(COUNT_TT_HITS);
+  double hit_rate = probes ? 100.0 * hits / probes : 0.0;
+  fprintf(OUT, "info string tt probes %" PRIu64 " hits %" PRIu64 " (%.1f%%)"
+          " stores %" PRIu64 " updates %" PRIu64 " overwrites %" PRIu64
+          " collisions %" PRIu64 "\n", probes, hits, hit_rate,
+          counter_total(COUNT_TT_STORES), counter_total(COUNT_TT_UPDATES),
+          counter_total(COUNT_TT_OVERWRITES),
+          counter_total(COUNT_TT_COLLISIONS));
+}
+
+
+// getting the move out of the record
+static inline move_t tt_move_of(ttRec_t *rec) {
+  return rec->move;
+}
+
+// getting the score out of the record
+static inline score_t tt_score_of(ttRec_t *rec) {
+  return rec->score;
+}
+
+static inline size_t tt_get_bytes_per_record() {
+  return sizeof(ttEntry_t);
+}
+
+static inline uint32_t tt_get_num_of_records() {
+  return hashtable.num_of_sets * RECORDS_PER_SET;
+}
+
+// Every probe lands on a random set, so with 4 KB pages nearly every probe
+// also misses the TLB.  Try reserved huge pages first, then an anonymous
+// mapping advised to use transparent huge pages, then plain aligned memory.
+static void tt_alloc_sets(size_t num_of_bytes) {
+  hashtable.tt_set = NULL;
+  hashtable.num_of_bytes = num_of_bytes;
+  hashtable.pages = PAGES_NONE;
+
+#if defined(MAP_ANONYMOUS) && (defined(MAP_HUGETLB) || defined(MADV_HUGEPAGE))
+  size_t len = (num_of_bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+#endif
+
+#if defined(MAP_ANONYMOUS) && defined(MAP_HUGETLB)
+  void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (mem != MAP_FAILED) {
+    hashtable.tt_set = (ttSet_t *) mem;
+    hashtable.num_of_bytes = len;
+    hashtable.pages = PAGES_HUGETLB;
+    return;
+  }
+#endif
+
+#if defined(MAP_ANONYMOUS) && defined(MADV_HUGEPAGE)
+  // Map one huge page extra and trim the ends, so that the table starts on a
+  // huge page boundary.
+  size_t mapped = len + HUGE_PAGE_SIZE;
+  char *base = (char *) mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base != MAP_FAILED) {
+    char *start = (char *) (((uintptr_t) base + HUGE_PAGE_SIZE - 1) &
+                            ~(HUGE_PAGE_SIZE - 1));
+    if (start > base) {
+      munmap(base, start - base);
+    }
+    if (base + mapped > start + len) {
+      munmap(start + len, base + mapped - (start + len));
+    }
+    if (madvise(start, len, MADV_HUGEPAGE) == 0) {
+      hashtable.tt_set = (ttSet_t *) start;
+      hashtable.num_of_bytes = len;
+      hashtable.pages = PAGES_TRANSPARENT;
+      return;
+    }
+    munmap(start, len);
+  }
+#endif
+
+  // one set per cache line, so that a probe touches only one line
+  if (posix_memalign((void **) &hashtable.tt_set, SET_ALIGNMENT,
+                     num_of_bytes) != 0) {
+    hashtable.tt_set = NULL;
+    return;
+  }
+  hashtable.pages = PAGES_NORMAL;
+}
 
-// getting the move out of the record
-static inline move_t tt_move_of(ttRec_t *rec) {
-  return rec->move;
+static void tt_release_sets() {
+  switch (hashtable.pages) {
+    case PAGES_NORMAL:
+      free(hashtable.tt_set);
+      break;
+    case PAGES_TRANSPARENT:
+    case PAGES_HUGETLB:
+      munmap(hashtable.tt_set, hashtable.num_of_bytes);
+      break;
+    case PAGES_SHARED:
+      munmap(hashtable.shared, hashtable.num_of_bytes);
+      hashtable.shared = NULL;
+      break;
+    case PAGES_NONE:
+      break;
+  }
+  hashtable.tt_set = NULL;
+  hashtable.pages = PAGES_NONE;
 }
 
-// getting the score out of the record
-static inline score_t tt_score_of(ttRec_t *rec) {
-  return rec->score;
+// Zeroes the sets one huge page at a time, spread over the workers.  For a
+// fresh table this is also where its pages are first touched, so the page
+// faults are taken in parallel rather than during the search.
+static void tt_zero_sets(ttSet_t *sets, uint64_t num_of_sets) {
+  const uint64_t chunk = HUGE_PAGE_SIZE / sizeof(ttSet_t);
+  uint64_t num_of_chunks = (num_of_sets + chunk - 1) / chunk;
+
+  cilk_for (uint64_t i = 0; i < num_of_chunks; i++) {
+    uint64_t first = i * chunk;
+    uint64_t count = (num_of_sets - first < chunk) ? num_of_sets - first : chunk;
+    memset(sets + first, 0, sizeof(ttSet_t) * count);
+  }
 }
 
-static inline size_t tt_get_bytes_per_record() {
-  return sizeof(struct ttRec);
+static inline const char *tt_get_page_type() {
+  return pages_strs[hashtable.pages];
 }
 
-static inline uint32_t tt_get_num_of_records() {
-  return hashtable.num_of_sets * RECORDS_PER_SET;
+static inline bool tt_is_shared() {
+  return hashtable.pages == PAGES_SHARED;
 }
 
+static void tt_resize_sets(uint64_t num_of_sets);
+static bool tt_attach_shared(uint64_t num_of_sets);
+
 static inline void tt_resize_hashtable(int size_in_meg) {
   uint64_t size_in_bytes = (uint64_t) size_in_meg * (1ULL << 20);
   // total number of sets we could have in the hashtable
@@ -2260,14 +3318,23 @@ static inline void tt_resize_hashtable(int size_in_meg) {
   uint64_t pow = 1;
   num_of_sets--;
   while (pow <= num_of_sets) pow *= 2;
-  num_of_sets = pow;
+  tt_resize_sets(pow);
+}
 
+// Replaces the table with an empty one of num_of_sets sets, a power of 2.
+// With TT_SHARED set, attaches to that segment instead; if other processes
+// already made it, its size wins and its records are kept.
+static void tt_resize_sets(uint64_t num_of_sets) {
   hashtable.num_of_sets = num_of_sets;
   hashtable.mask = num_of_sets - 1;
   hashtable.age = 0;
+  hashtable.clear_age = 0;
 
-  free(hashtable.tt_set);  // free the old ones
-  hashtable.tt_set = (ttSet_t *) malloc(sizeof(ttSet_t) * num_of_sets);
+  tt_release_sets();  // free the old ones
+  if (TT_SHARED && tt_attach_shared(num_of_sets)) {
+    return;
+  }
+  tt_alloc_sets(sizeof(ttSet_t) * num_of_sets);
 
   if (hashtable.tt_set == NULL) {
     fprintf(stderr,  "Hash table too big\n");
@@ -2275,104 +3342,203 @@ static inline void tt_resize_hashtable(int size_in_meg) {
   }
 
   // might as well clear the table while we are at it
-  memset(hashtable.tt_set, 0, sizeof(ttSet_t) * hashtable.num_of_sets);
+  tt_zero_sets(hashtable.tt_set, hashtable.num_of_sets);
 }
 
 static inline void tt_make_hashtable(int size_in_meg) {
   hashtable.tt_set = NULL;
+  hashtable.pages = PAGES_NONE;
+  hashtable.shared = NULL;
   tt_resize_hashtable(size_in_meg);
 }
 
 static inline void tt_free_hashtable() {
-  free(hashtable.tt_set);
-  hashtable.tt_set = NULL;
+  tt_release_sets();
+}
+
+// all processes on a shared table count ages together
+static inline unsigned next_age() {
+  if (hashtable.shared) {
+    return __atomic_add_fetch(&hashtable.shared->age, 1, __ATOMIC_RELAXED);
+  }
+  return hashtable.age + 1;
 }
 
 // age the hash table by incrementing global age
 static inline void tt_age_hashtable() {
-  hashtable.age++;
+  hashtable.age = next_age();
 }
 
+// With LAZY_CLEAR the table is not touched: a new age starts, and records
+// from before it count as empty (see is_stale()).  Otherwise the table is
+// zeroed by all workers.  A shared table is always cleared lazily, so that
+// the other processes keep their records.
 static inline void tt_clear_hashtable() {
-  memset(hashtable.tt_set, 0, sizeof(ttSet_t) * hashtable.num_of_sets);
+  if (LAZY_CLEAR || hashtable.shared) {
+    hashtable.age = next_age();
+    hashtable.clear_age = hashtable.age;
+    return;
+  }
+  tt_zero_sets(hashtable.tt_set, hashtable.num_of_sets);
   hashtable.age = 0;
+  hashtable.clear_age = 0;
+}
+
+
+// Whether a record was stored before the last lazy clear.  Records only keep
+// the age modulo 64, so this can only be told for the first 63 ages after the
+// clear; after that, records older than the clear count as ordinary records
+// again.  They still describe their positions correctly, they are just not
+// wiped.
+static inline bool is_stale(unsigned rec_age) {
+  unsigned since_clear = hashtable.age - hashtable.clear_age;
+  if (since_clear >= ENTRY_AGE_MASK) {
+    return false;
+  }
+  return ((rec_age - hashtable.clear_age) & ENTRY_AGE_MASK) > since_clear;
+}
+
+// How much a record of another position is worth keeping when a store has
+// to evict something: records of the current search first, then exact
+// scores, then deeper ones.
+static inline int keep_value(ttRec_t *rec, unsigned age) {
+  return (rec->age == age ? 256 : 0) + (rec->bound == EXACT ? 128 : 0) +
+      rec->quality;
+}
+
+// Whether a new record of depth and bound_type may take a depth-preferred
+// slot that holds rec, a live record of another position.
+static inline bool takes_depth_slot(ttRec_t *rec, unsigned age, int depth,
+                                    int bound_type) {
+  if (rec->age != age || depth > rec->quality) {
+    return true;
+  }
+  return depth == rec->quality && (bound_type == EXACT || rec->bound != EXACT);
+}
+
+// The first empty slot from first on, or else the one least worth keeping.
+static inline int weakest_slot(ttRec_t *recs, bool *empty, int first,
+                               unsigned age) {
+  int weakest = first;
+  for (int i = first; i < RECORDS_PER_SET; i++) {
+    if (empty[i]) {
+      return i;
+    }
+    if (keep_value(&recs[i], age) < keep_value(&recs[weakest], age)) {
+      weakest = i;
+    }
+  }
+  return weakest;
 }
 
+static inline void count_eviction(bool empty, ttRec_t *rec, unsigned age) {
+  if (!empty) {
+    COUNT(COUNT_TT_OVERWRITES);
+    if (rec->age == age) {
+      COUNT(COUNT_TT_COLLISIONS);
+    }
+  }
+}
 
+// Two-tier replacement.  The first TT_DEPTH_SLOTS records of a set only give
+// way to searches at least as deep, or to anything once they are from an
+// older search; a record pushed out of them moves down if it is worth more
+// than what it would replace.  The remaining records take whatever comes and
+// evict the one least worth keeping.  A record of the same position is
+// always updated, unless that would swap a deeper exact score of the current
+// search for a bound.
 static inline void tt_hashtable_put(uint64_t key, int depth, score_t score,
                       int bound_type, move_t move) {
   tbassert(abs(score) != INF, "Score was infinite.\n");
 
   uint64_t set_index = key & hashtable.mask;
-  // current record that we are looking into
-  ttRec_t *curr_rec = hashtable.tt_set[set_index].records;
-  // best record to replace that we found so far
-  ttRec_t *rec_to_replace = curr_rec;
-  int replacemt_val = -99;            // value of doing the replacement
+  ttEntry_t *set = hashtable.tt_set[set_index].records;
+  ttEntry_t entries[RECORDS_PER_SET];
+  ttRec_t recs[RECORDS_PER_SET];
+  bool empty[RECORDS_PER_SET];
+  unsigned age = hashtable.age & ENTRY_AGE_MASK;
 
   move = move & MOVE_MASK;
+  COUNT(COUNT_TT_STORES);
 
-  for (int i = 0; i < RECORDS_PER_SET; i++, curr_rec++) {
-    int value = 0;  // points for sorting
+  for (int i = 0; i < RECORDS_PER_SET; i++) {
+    entries[i] = load_entry(&set[i]);
+    unpack_record(key, entries[i], &recs[i]);
+    empty[i] = !entries[i] || is_stale(recs[i].age);
 
-    // always use entry if it's not used or has same key
-    if (!curr_rec->key || key == curr_rec->key) {
+    if (!empty[i] && entry_matches(entries[i], key)) {
+      if (recs[i].bound == EXACT && bound_type != EXACT &&
+          recs[i].quality > depth && recs[i].age == age) {
+        return;
+      }
       if (move == 0) {
-        move = curr_rec->move;
+        move = recs[i].move;
       }
-      curr_rec->key = key;
-      curr_rec->quality = depth;
-      curr_rec->move = move;
-      curr_rec->age = hashtable.age;
-      curr_rec->score = score;
-      curr_rec->bound = (ttBound_t) bound_type;
-
+      COUNT(COUNT_TT_UPDATES);
+      store_entry(&set[i], pack_record(key, move, score, depth,
+                                       (ttBound_t) bound_type, age));
       return;
     }
+  }
 
-    // otherwise, potential candidate for replacement
-    if (curr_rec->age == hashtable.age) {
-      value -= 6;   // prefer not to replace if same age
-    }
-    if (curr_rec->quality < rec_to_replace->quality) {
-      value += 1;   // prefer to replace if worse quality
+  int depth_slots = TT_DEPTH_SLOTS;
+  tbassert(depth_slots < RECORDS_PER_SET, "depth_slots: %d\n", depth_slots);
+  int slot = -1;
+  for (int i = 0; i < depth_slots; i++) {
+    if (empty[i] || takes_depth_slot(&recs[i], age, depth, bound_type)) {
+      slot = i;
+      break;
     }
-    if (value > replacemt_val) {
-      replacemt_val = value;
-      rec_to_replace = curr_rec;
+  }
+
+  if (slot >= 0 && !empty[slot]) {
+    int down = weakest_slot(recs, empty, depth_slots, age);
+    if (empty[down] ||
+        keep_value(&recs[down], age) < keep_value(&recs[slot], age)) {
+      count_eviction(empty[down], &recs[down], age);
+      store_entry(&set[down], entries[slot]);
+    } else {
+      count_eviction(false, &recs[slot], age);
     }
+  } else if (slot < 0) {
+    slot = weakest_slot(recs, empty, depth_slots, age);
+    count_eviction(empty[slot], &recs[slot], age);
   }
-  // update the record that we are replacing with this record
-  rec_to_replace->key = key;
-  rec_to_replace->quality = depth;
-  rec_to_replace->move = move;
-  rec_to_replace->age = hashtable.age;
-  rec_to_replace->score = score;
-  rec_to_replace->bound = (ttBound_t) bound_type;
+
+  store_entry(&set[slot], pack_record(key, move, score, depth,
+                                      (ttBound_t) bound_type, age));
+}
+
+
+// Starts loading the set for key into the cache, so that a tt_hashtable_get()
+// for key shortly after does not have to wait on memory.
+static inline void tt_prefetch(uint64_t key) {
+  __builtin_prefetch(&hashtable.tt_set[key & hashtable.mask]);
 }
 
 
-static inline ttRec_t *tt_hashtable_get(uint64_t key) {
+// Copies the record for key into *rec.  Returns false if there is none.
+static inline bool tt_hashtable_get(uint64_t key, ttRec_t *rec) {
   if (!USE_TT) {
-    return NULL;  // done if we are not using the transposition table
+    return false;  // done if we are not using the transposition table
   }
 
   uint64_t set_index = key & hashtable.mask;
-  ttRec_t *rec = hashtable.tt_set[set_index].records;
-
-  //Assume RECORDS_PER_SET= 1
-  // if (rec -> key == key)
-  //   return rec;
-  // else
-  //   return NULL;
-  ttRec_t *found = NULL;
-  for (int i = 0; i < RECORDS_PER_SET; i++, rec++) {
-    if (rec->key == key) {  // found the record that we are looking for
-      found = rec;
-      return rec;
+  ttEntry_t *slot = hashtable.tt_set[set_index].records;
+
+  COUNT(COUNT_TT_PROBES);
+  for (int i = 0; i < RECORDS_PER_SET; i++, slot++) {
+    ttEntry_t entry = load_entry(slot);
+    if (entry && entry_matches(entry, key)) {  // found the record
+      unpack_record(key, entry, rec);
+      if (is_stale(rec->age)) {
+        return false;
+      }
+      COUNT(COUNT_TT_HITS);
+      return true;
     }
   }
-  return found;
+  return false;
 }
 
 
@@ -2429,6 +3595,346 @@ static inline bool tt_is_usable(ttRec_t *tt, int depth, score_t beta) {
   return false;
 }
 
+
+
+// -----------------------------------------------------------------------------
+// Saving and loading
+// -----------------------------------------------------------------------------
+
+// Writes the table to filename through a shared mapping, leaving out records
+// of depth less than min_depth.
+bool tt_save_hashtable(const char *filename, int min_depth, FILE *OUT) {
+  size_t num_of_bytes = TT_FILE_SETS_OFFSET +
+      sizeof(ttSet_t) * hashtable.num_of_sets;
+
+  int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, num_of_bytes) != 0) {
+    fprintf(OUT, "info string cannot write %s\n", filename);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return false;
+  }
+  char *file = (char *) mmap(NULL, num_of_bytes, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, fd, 0);
+  close(fd);
+  if (file == MAP_FAILED) {
+    fprintf(OUT, "info string cannot map %s\n", filename);
+    return false;
+  }
+
+  ttFileHeader_t *header = (ttFileHeader_t *) file;
+  header->magic = TT_FILE_MAGIC;
+  header->num_of_sets = hashtable.num_of_sets;
+  header->age = hashtable.age;
+  header->clear_age = hashtable.clear_age;
+  zob_export(header->zob);
+
+  ttSet_t *sets = (ttSet_t *) (file + TT_FILE_SETS_OFFSET);
+  const uint64_t chunk = HUGE_PAGE_SIZE / sizeof(ttSet_t);
+  uint64_t num_of_chunks = (hashtable.num_of_sets + chunk - 1) / chunk;
+  uint64_t saved = 0;
+
+  cilk_for (uint64_t c = 0; c < num_of_chunks; c++) {
+    uint64_t first = c * chunk;
+    uint64_t last = (first + chunk < hashtable.num_of_sets) ?
+        first + chunk : hashtable.num_of_sets;
+    uint64_t my_saved = 0;
+    for (uint64_t i = first; i < last; i++) {
+      for (int j = 0; j < RECORDS_PER_SET; j++) {
+        ttEntry_t entry = load_entry(&hashtable.tt_set[i].records[j]);
+        ttRec_t rec;
+        unpack_record(0, entry, &rec);
+        if (!entry || is_stale(rec.age) || rec.quality < min_depth) {
+          entry = 0;
+        } else {
+          my_saved++;
+        }
+        sets[i].records[j] = entry;
+      }
+    }
+    __sync_fetch_and_add(&saved, my_saved);
+  }
+
+  munmap(file, num_of_bytes);
+  fprintf(OUT, "info string saved %" PRIu64 " records to %s\n", saved,
+          filename);
+  return true;
+}
+
+// Replaces the table, and the Zobrist keys, with the ones saved in filename.
+// The caller has to recompute the keys of any positions it holds.
+bool tt_load_hashtable(const char *filename, FILE *OUT) {
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(OUT, "info string cannot read %s\n", filename);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return false;
+  }
+  if (hashtable.shared) {
+    fprintf(OUT, "info string cannot load into a shared hash table\n");
+    close(fd);
+    return false;
+  }
+  size_t num_of_bytes = st.st_size;
+  char *file = NULL;
+  if (num_of_bytes >= TT_FILE_SETS_OFFSET) {
+    file = (char *) mmap(NULL, num_of_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (file == NULL || file == MAP_FAILED) {
+    fprintf(OUT, "info string %s is not a saved hash table\n", filename);
+    return false;
+  }
+
+  ttFileHeader_t *header = (ttFileHeader_t *) file;
+  uint64_t num_of_sets = header->num_of_sets;
+  if (header->magic != TT_FILE_MAGIC || num_of_sets == 0 ||
+      (num_of_sets & (num_of_sets - 1)) != 0 ||
+      num_of_bytes != TT_FILE_SETS_OFFSET + sizeof(ttSet_t) * num_of_sets) {
+    fprintf(OUT, "info string %s is not a saved hash table\n", filename);
+    munmap(file, num_of_bytes);
+    return false;
+  }
+
+  tt_resize_sets(num_of_sets);
+  hashtable.age = header->age;
+  hashtable.clear_age = header->clear_age;
+  zob_import(header->zob);
+
+  ttSet_t *sets = (ttSet_t *) (file + TT_FILE_SETS_OFFSET);
+  const uint64_t chunk = HUGE_PAGE_SIZE / sizeof(ttSet_t);
+  uint64_t num_of_chunks = (num_of_sets + chunk - 1) / chunk;
+  cilk_for (uint64_t c = 0; c < num_of_chunks; c++) {
+    uint64_t first = c * chunk;
+    uint64_t count = (num_of_sets - first < chunk) ? num_of_sets - first : chunk;
+    memcpy(hashtable.tt_set + first, sets + first, sizeof(ttSet_t) * count);
+  }
+
+  munmap(file, num_of_bytes);
+  HASH = (sizeof(ttSet_t) * num_of_sets) >> 20;
+  if (HASH < 1) {
+    HASH = 1;
+  }
+  fprintf(OUT, "info string loaded a table of %" PRIu64 " records from %s\n",
+          num_of_sets * RECORDS_PER_SET, filename);
+  return true;
+}
+
+
+// -----------------------------------------------------------------------------
+// Shared memory
+// -----------------------------------------------------------------------------
+
+// With TT_SHARED = n the table lives in the POSIX shared memory segment
+// /leiserchess-tt-n, so that several engine processes analysing on one
+// machine search with one table.  Records are single words, so sharing them
+// between processes is no different from sharing them between workers.
+//
+// The segment has the layout of a saved table (see ttFileHeader_t).  The process that
+// creates it sizes it and puts its Zobrist keys in the header; processes that
+// attach later take the size and the keys from there, and have to recompute
+// the keys of any positions they hold.  The segment outlives the processes;
+// remove /dev/shm/leiserchess-tt-n to free it.
+#define TT_SHARED_NAME "/leiserchess-tt-%d"
+
+// how long to wait for the creator of a segment to set it up
+#define TT_SHARED_WAIT_MS 1000
+
+static bool tt_attach_shared(uint64_t num_of_sets) {
+  char name[32];
+  snprintf(name, sizeof(name), TT_SHARED_NAME, TT_SHARED);
+
+  size_t num_of_bytes = TT_FILE_SETS_OFFSET + sizeof(ttSet_t) * num_of_sets;
+  bool created = true;
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0 && errno == EEXIST) {
+    created = false;
+    fd = shm_open(name, O_RDWR, 0600);
+  }
+  if (fd < 0) {
+    return false;
+  }
+
+  if (created) {
+    // a fresh segment reads as zeros, so the table starts out empty
+    if (ftruncate(fd, num_of_bytes) != 0) {
+      close(fd);
+      shm_unlink(name);
+      return false;
+    }
+  } else {
+    struct stat st;
+    for (int ms = 0; ; ms++) {
+      if (fstat(fd, &st) != 0 || ms == TT_SHARED_WAIT_MS) {
+        close(fd);
+        return false;
+      }
+      if ((size_t) st.st_size > TT_FILE_SETS_OFFSET) {
+        break;
+      }
+      usleep(1000);
+    }
+    num_of_bytes = st.st_size;
+  }
+
+  char *mem = (char *) mmap(NULL, num_of_bytes, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    if (created) {
+      shm_unlink(name);
+    }
+    return false;
+  }
+
+  ttFileHeader_t *header = (ttFileHeader_t *) mem;
+  if (created) {
+    header->num_of_sets = num_of_sets;
+    zob_export(header->zob);
+    __atomic_store_n(&header->magic, TT_FILE_MAGIC, __ATOMIC_RELEASE);
+  } else {
+    for (int ms = 0; __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) == 0 &&
+             ms < TT_SHARED_WAIT_MS; ms++) {
+      usleep(1000);
+    }
+    num_of_sets = header->num_of_sets;
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != TT_FILE_MAGIC ||
+        num_of_sets == 0 || (num_of_sets & (num_of_sets - 1)) != 0 ||
+        num_of_bytes != TT_FILE_SETS_OFFSET + sizeof(ttSet_t) * num_of_sets) {
+      munmap(mem, num_of_bytes);
+      return false;
+    }
+    zob_import(header->zob);
+  }
+
+  hashtable.shared = header;
+  hashtable.tt_set = (ttSet_t *) (mem + TT_FILE_SETS_OFFSET);
+  hashtable.num_of_bytes = num_of_bytes;
+  hashtable.pages = PAGES_SHARED;
+  hashtable.num_of_sets = num_of_sets;
+  hashtable.mask = num_of_sets - 1;
+  // Records of the other processes are not stale to this one.
+  hashtable.age = __atomic_load_n(&header->age, __ATOMIC_RELAXED);
+  hashtable.clear_age = hashtable.age - ENTRY_AGE_MASK;
+
+  HASH = (sizeof(ttSet_t) * num_of_sets) >> 20;
+  if (HASH < 1) {
+    HASH = 1;
+  }
+  return true;
+}
+
+
+// -----------------------------------------------------------------------------
+// Stress test
+// -----------------------------------------------------------------------------
+
+// Number of sets in the table used by tt_stress_test().  Small, so that the
+// workers keep colliding on the same entries.
+#define STRESS_SETS 16
+#define STRESS_KEYS 4096
+
+// Stress key n keeps n + 1 in the bits that the entries store, so every
+// entry in the table can be traced back to the key that wrote it, and the
+// record that key stores can be recomputed.
+static inline uint64_t stress_key(uint32_t n) {
+  return ((uint64_t) (n + 1) << 48) | ((n * 2654435761U) & 0xffffffffffffULL);
+}
+
+static inline move_t stress_move(uint64_t key) {
+  return (move_t) (key >> 32) | 1;  // never 0, which put() treats as no move
+}
+
+static inline score_t stress_score(uint64_t key) {
+  return (score_t) ((key >> 40) % 2000) - 1000;
+}
+
+// Whether an entry holds exactly what its key stored.
+static inline bool is_stress_entry(ttEntry_t entry) {
+  uint32_t n = key_check_of((uint64_t) entry << 48) - 1;
+  if (n >= STRESS_KEYS) {
+    return false;
+  }
+  ttRec_t rec;
+  uint64_t key = stress_key(n);
+  unpack_record(key, entry, &rec);
+  return rec.move == stress_move(key) && rec.score == stress_score(key) &&
+      rec.bound == LOWER;
+}
+
+// Stores and probes stress keys on a tiny table from all workers and counts
+// what the probes saw.  "wrong" counts probes that returned a record other
+// than the one their key stores, "torn" counts entries in the table that
+// mix two stores; both must be 0.  The regular table is set aside while this
+// runs.
+void tt_stress_test(int rounds, FILE *OUT) {
+  struct ttHashtable saved = hashtable;
+  int saved_use_tt = USE_TT;
+
+  hashtable.num_of_sets = STRESS_SETS;
+  hashtable.mask = STRESS_SETS - 1;
+  hashtable.age = 0;
+  if (posix_memalign((void **) &hashtable.tt_set, SET_ALIGNMENT,
+                     sizeof(ttSet_t) * STRESS_SETS) != 0) {
+    fprintf(stderr, "Hash table too big\n");
+    exit(1);
+  }
+  memset(hashtable.tt_set, 0, sizeof(ttSet_t) * STRESS_SETS);
+  USE_TT = true;
+
+  const int num_tasks = 64;
+  uint64_t probes = 0, hits = 0, torn = 0, wrong = 0;
+
+  cilk_for (int task = 0; task < num_tasks; task++) {
+    uint64_t my_probes = 0, my_hits = 0, my_torn = 0, my_wrong = 0;
+    uint32_t seed = task;
+
+    for (int r = 0; r < rounds; r++) {
+      seed = seed * 1103515245 + 12345;
+      uint64_t key = stress_key((seed >> 16) % STRESS_KEYS);
+      if (r & 1) {
+        tt_hashtable_put(key, (seed >> 8) & 31, stress_score(key), LOWER,
+                         stress_move(key));
+        continue;
+      }
+
+      ttRec_t rec;
+      my_probes++;
+      if (tt_hashtable_get(key, &rec)) {
+        my_hits++;
+        if (rec.move != stress_move(key) || rec.score != stress_score(key) ||
+            rec.bound != LOWER) {
+          my_wrong++;
+        }
+      }
+
+      ttEntry_t *slot = hashtable.tt_set[key & hashtable.mask].records;
+      for (int i = 0; i < RECORDS_PER_SET; i++) {
+        ttEntry_t entry = load_entry(&slot[i]);
+        if (entry && !is_stress_entry(entry)) {
+          my_torn++;
+        }
+      }
+    }
+
+    __sync_fetch_and_add(&probes, my_probes);
+    __sync_fetch_and_add(&hits, my_hits);
+    __sync_fetch_and_add(&torn, my_torn);
+    __sync_fetch_and_add(&wrong, my_wrong);
+  }
+
+  fprintf(OUT, "info string ttstress tasks %d probes %" PRIu64 " hits %" PRIu64
+          " torn %" PRIu64 " wrong %" PRIu64 "\n",
+          num_tasks, probes, hits, torn, wrong);
+
+  free(hashtable.tt_set);
+  hashtable = saved;
+  USE_TT = saved_use_tt;
+}
 //
 //
 // Copyright (c) 2015 MIT License by 6.172 Staff
@@ -2454,10 +3960,10 @@ static void fen_error(char *fen, int c_count, char *msg) {
 
 // parse_fen_board
 // Input:   board representation as a fen string
-//          unpopulated board position struct
+//          array of NUM_SQUARES pieces, indexed by square
 // Output:  index of where board description ends or 0 if parsing error
-//          (populated) board position struct
-static int parse_fen_board(position_t *p, char *fen) {
+//          (populated) array of pieces
+static int parse_fen_board(piece_t *board, char *fen) {
   // Invariant: square (f, r) is last square filled.
   // Fill from last rank to first rank, from first file to last file
   fil_t f = -1;
@@ -2504,7 +4010,7 @@ static int parse_fen_board(position_t *p, char *fen) {
             fen_error(fen, c_count, "Too many squares in rank.\n");
             return 0;
           }
-          set_ptype(&p->board[square_of(f, r)], EMPTY);
+          set_ptype(&board[square_of(f, r)], EMPTY);
           c--;
         }
         break;
@@ -2530,9 +4036,9 @@ static int parse_fen_board(position_t *p, char *fen) {
           fen_error(fen, c_count+1, "Syntax error");
           return 0;
         }
-        set_ptype(&p->board[square_of(f, r)], typ);
-        set_color(&p->board[square_of(f, r)], WHITE);
-        set_ori(&p->board[square_of(f, r)], ori);
+        set_ptype(&board[square_of(f, r)], typ);
+        set_color(&board[square_of(f, r)], WHITE);
+        set_ori(&board[square_of(f, r)], ori);
         break;
 
       case 'n':
@@ -2555,9 +4061,9 @@ static int parse_fen_board(position_t *p, char *fen) {
           fen_error(fen, c_count+1, "Syntax error");
           return 0;
         }
-        set_ptype(&p->board[square_of(f, r)], typ);
-        set_color(&p->board[square_of(f, r)], BLACK);
-        set_ori(&p->board[square_of(f, r)], ori);
+        set_ptype(&board[square_of(f, r)], typ);
+        set_color(&board[square_of(f, r)], BLACK);
+        set_ori(&board[square_of(f, r)], ori);
         break;
 
       case 'S':
@@ -2580,9 +4086,9 @@ static int parse_fen_board(position_t *p, char *fen) {
           fen_error(fen, c_count+1, "Syntax error");
           return 0;
         }
-        set_ptype(&p->board[square_of(f, r)], typ);
-        set_color(&p->board[square_of(f, r)], WHITE);
-        set_ori(&p->board[square_of(f, r)], ori);
+        set_ptype(&board[square_of(f, r)], typ);
+        set_color(&board[square_of(f, r)], WHITE);
+        set_ori(&board[square_of(f, r)], ori);
         break;
 
       case 's':
@@ -2605,9 +4111,9 @@ static int parse_fen_board(position_t *p, char *fen) {
           fen_error(fen, c_count+1, "Syntax error");
           return 0;
         }
-        set_ptype(&p->board[square_of(f, r)], typ);
-        set_color(&p->board[square_of(f, r)], BLACK);
-        set_ori(&p->board[square_of(f, r)], ori);
+        set_ptype(&board[square_of(f, r)], typ);
+        set_color(&board[square_of(f, r)], BLACK);
+        set_ori(&board[square_of(f, r)], ori);
         break;
 
       case 'E':
@@ -2618,9 +4124,9 @@ static int parse_fen_board(position_t *p, char *fen) {
         next_c = fen[c_count++];
 
         if (next_c == 'E') {  // White King facing East
-          set_ptype(&p->board[square_of(f, r)], KING);
-          set_color(&p->board[square_of(f, r)], WHITE);
-          set_ori(&p->board[square_of(f, r)], EE);
+          set_ptype(&board[square_of(f, r)], KING);
+          set_color(&board[square_of(f, r)], WHITE);
+          set_ori(&board[square_of(f, r)], EE);
         } else {
           fen_error(fen, c_count+1, "Syntax error");
           return 0;
@@ -2635,9 +4141,9 @@ static int parse_fen_board(position_t *p, char *fen) {
         next_c = fen[c_count++];
 
         if (next_c == 'W') {  // White King facing West
-          set_ptype(&p->board[square_of(f, r)], KING);
-          set_color(&p->board[square_of(f, r)], WHITE);
-          set_ori(&p->board[square_of(f, r)], WW);
+          set_ptype(&board[square_of(f, r)], KING);
+          set_color(&board[square_of(f, r)], WHITE);
+          set_ori(&board[square_of(f, r)], WW);
         } else {
           fen_error(fen, c_count+1, "Syntax error");
           return 0;
@@ -2652,9 +4158,9 @@ static int parse_fen_board(position_t *p, char *fen) {
         next_c = fen[c_count++];
 
         if (next_c == 'e') {  // Black King facing East
-          set_ptype(&p->board[square_of(f, r)], KING);
-          set_color(&p->board[square_of(f, r)], BLACK);
-          set_ori(&p->board[square_of(f, r)], EE);
+          set_ptype(&board[square_of(f, r)], KING);
+          set_color(&board[square_of(f, r)], BLACK);
+          set_ori(&board[square_of(f, r)], EE);
         } else {
           fen_error(fen, c_count+1, "Syntax error");
           return 0;
@@ -2669,9 +4175,9 @@ static int parse_fen_board(position_t *p, char *fen) {
         next_c = fen[c_count++];
 
         if (next_c == 'w') {  // Black King facing West
-          set_ptype(&p->board[square_of(f, r)], KING);
-          set_color(&p->board[square_of(f, r)], BLACK);
-          set_ori(&p->board[square_of(f, r)], WW);
+          set_ptype(&board[square_of(f, r)], KING);
+          set_color(&board[square_of(f, r)], BLACK);
+          set_ori(&board[square_of(f, r)], WW);
         } else {
           fen_error(fen, c_count+1, "Syntax error");
           return 0;
@@ -2772,28 +4278,32 @@ int fen_to_pos(position_t *p, char *fen) {
 
   int c_count = 0;  // Invariant: fen[c_count] is next char to be read
 
-  for (int i = 0; i < ARR_SIZE; ++i) {
-    p->board[i] = 0;
-    set_ptype(&p->board[i], INVALID);  // squares are invalid until filled
-  }
-
-  c_count = parse_fen_board(p, fen);
+  piece_t board[NUM_SQUARES] = {0};
+  c_count = parse_fen_board(board, fen);
   if (!c_count) {
     return 1;  // parse error of board
   }
 
-  // King check
+  // Move the pieces into the bitboards, checking the Kings on the way
 
   int Kings[2] = {0, 0};
-  for (fil_t f = 0; f < BOARD_WIDTH; ++f) {
-    for (rnk_t r = 0; r < BOARD_WIDTH; ++r) {
-      square_t sq = square_of(f, r);
-      piece_t x = p->board[sq];
-      ptype_t typ = ptype_of(x);
-      if (typ == KING) {
-        Kings[color_of(x)]++;
-        p->kloc[color_of(x)] = sq;
-      }
+  p->mask[WHITE] = p->mask[BLACK] = 0;
+  for (int ori = 0; ori < NUM_ORI; ++ori) {
+    p->pawn[ori] = 0;
+  }
+  for (square_t sq = 0; sq < NUM_SQUARES; ++sq) {
+    piece_t x = board[sq];
+    ptype_t typ = ptype_of(x);
+    if (typ == EMPTY) {
+      continue;
+    }
+    p->mask[color_of(x)] |= square_bit(sq);
+    if (typ == KING) {
+      Kings[color_of(x)]++;
+      p->kloc[color_of(x)] = sq;
+      p->kori[color_of(x)] = ori_of(x);
+    } else {
+      p->pawn[ori_of(x)] |= square_bit(sq);
     }
   }
 
@@ -2852,8 +4362,6 @@ int fen_to_pos(position_t *p, char *fen) {
   if (lm_from_sq == 0) {   // from-square of last move
     p->last_move = 0;  // no last move specified
     p->key = compute_zob_key(p);
-    p->mask[0] = compute_mask(p, 0);
-    p->mask[1] = compute_mask(p, 1);
     p->laser[0] = mark_laser_path_bit(p, 0);
     p->laser[1] = mark_laser_path_bit(p, 1);
     return 0;
@@ -2887,9 +4395,7 @@ int fen_to_pos(position_t *p, char *fen) {
   }
   p->last_move = move_of(EMPTY, lm_rot, lm_from_sq, lm_to_sq);
   p->key = compute_zob_key(p);
-  p->mask[0] = compute_mask(p, 0);
-  p->mask[1] = compute_mask(p, 1);
-  
+
   return 0;  // everything is okay
 }
 
@@ -2907,31 +4413,27 @@ int pos_to_fen(position_t *p, char *fen) {
   int pos = 0;
   int i;
 
-  for (rnk_t r = BOARD_WIDTH - 1; r >=0 ; --r) {
+  for (int r = BOARD_WIDTH - 1; r >= 0; --r) {
     int empty_in_a_row = 0;
     for (fil_t f = 0; f < BOARD_WIDTH; ++f) {
-      square_t sq = square_of(f, r);
+      piece_t x = piece_at(p, square_of(f, r));
 
-      if (ptype_of(p->board[sq]) == INVALID) {     // invalid square
-        tbassert(false, "Bad news, yo.\n");        // This is bad!
-      }
-
-      if (ptype_of(p->board[sq]) == EMPTY) {       // empty square
+      if (ptype_of(x) == EMPTY) {       // empty square
         empty_in_a_row++;
         continue;
       } else {
         if (empty_in_a_row) fen[pos++] = '0' + empty_in_a_row;
         empty_in_a_row = 0;
 
-        int ori = ori_of(p->board[sq]);  // orientation
-        color_t c = color_of(p->board[sq]);
+        int ori = ori_of(x);  // orientation
+        color_t c = color_of(x);
 
-        if (ptype_of(p->board[sq]) == KING) {
+        if (ptype_of(x) == KING) {
           for (i = 0; i < 2; i++) fen[pos++] = king_ori_to_rep[c][ori][i];
           continue;
         }
 
-        if (ptype_of(p->board[sq]) == PAWN) {
+        if (ptype_of(x) == PAWN) {
           for (i = 0; i < 2; i++) fen[pos++] = pawn_ori_to_rep[c][ori][i];
           continue;
         }
@@ -2970,6 +4472,7 @@ int pos_to_fen(position_t *p, char *fen) {
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 void debug_log(int log_level, const char *errstr, ...) {
   if (log_level >= DEBUG_LOG_THRESH) {
@@ -3036,3 +4539,240 @@ static inline uint64_t myrand() {
 
   return x + y + z1 + ((uint64_t)z2 << 32);  // Return 64-bit result
 }
+
+#define MAX_COUNTERS 256
+
+static counters_t counters[MAX_COUNTERS];
+static __thread counters_t *my_counters = NULL;
+
+static counters_t *claim_counters() {
+  for (int i = 0; i < MAX_COUNTERS; i++) {
+    if (!counters[i].in_use &&
+        __sync_bool_compare_and_swap(&counters[i].in_use, false, true)) {
+      return &counters[i];
+    }
+  }
+  fprintf(stderr, "Out of counters: too many threads\n");
+  exit(1);
+}
+
+// The calling thread's counters.
+static inline counters_t *thread_counters() {
+  if (my_counters == NULL) {
+    my_counters = claim_counters();
+  }
+  return my_counters;
+}
+
+// Gives up the calling thread's counters.  Must be called before a thread
+// that counted exits.
+void release_thread_counters() {
+  if (my_counters != NULL) {
+    __atomic_store_n(&my_counters->in_use, false, __ATOMIC_RELEASE);
+    my_counters = NULL;
+  }
+}
+
+// Zeroes every counter.  Meant to be called while no other thread counts.
+void reset_counters() {
+  for (int i = 0; i < MAX_COUNTERS; i++) {
+    memset(counters[i].count, 0, sizeof(counters[i].count));
+  }
+}
+
+uint64_t counter_total(counter_t counter) {
+  uint64_t total = 0;
+  for (int i = 0; i < MAX_COUNTERS; i++) {
+    total += __atomic_load_n(&counters[i].count[counter], __ATOMIC_RELAXED);
+  }
+  return total;
+}
+//
+//
+// Copyright (c) 2015 MIT License by 6.172 Staff
+
+// Fixed-workload benchmark.  Times the move generator, the evaluator and a
+// fixed-depth search over a corpus of middle-game positions taken from
+// tests/book.dta.
+//
+// Every line prints its deterministic columns (operation counts, checksums,
+// best moves, node counts) before the timing columns, so the output of two
+// builds can be compared after stripping the timings:
+//
+//   printf 'bench\nquit\n' | ./leiserchess | sed 's/ \(ns\/op\|ms\) .*//' > a.txt
+//
+// A change that is meant to be a pure speedup should leave that file
+// unchanged.  The search lines depend on the transposition table, so they are
+// only reproducible when the Zobrist keys are (see init_zob).
+
+#include "./bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+
+#include "./eval.h"
+#include "./fen.h"
+#include "./move_gen.h"
+#include "./search.h"
+#include "./tt.h"
+#include "./util.h"
+
+// defined in eval.c
+extern int EVAL_CACHE;
+
+// Number of passes over the corpus for each primitive.
+#define BENCH_REPS 2000
+
+// Effectively unbounded time for the fixed-depth searches.
+#define BENCH_TIME 99999999999.0
+
+static const char *bench_fens[] = {
+  "ss3nw3/3nw4/2nw1nw1SE1/1nw3SE2/2nw3SW1/nw2SE1SE2/4SE3/3SE3NN B",
+  "ss3nw3/3nw4/2nw1nw1SE1/1nw3SE2/2nw3SW1/3SE1SE2/nw3NW3/3SE3NN B",
+  "ss3nw3/3se4/2nw1nw1SW1/1ne3SE2/nw1nw3SE1/3SE1SE2/2SE1SE3/7NN B",
+  "ss3nw3/3se2SE1/2nw1nw3/1ne3SE2/1nwnw3SW1/3SE1SE2/4SE3/3SE3NN W",
+  "ss3nw3/3nw4/2nw1nw1SW1/1ne3SE2/2nw3SW1/3SE1SE2/nw3NW3/3SE3NN B",
+  "ss3nw3/3se2SW1/2nw1nw3/1ne3SE2/2nw3SW1/nw2SE1SE2/4SE3/3SE3NN B",
+  "ss3nw3/3nw4/2nw1nw1SE1/1ne3SE2/2nw3SW1/1nw1SE1SE2/4SW2NN/3SE4 W",
+  "ss3se3/3se2SW1/2nw1nw3/1ne3SE2/2nw3SW1/nw2SE1SE2/4SE3/3SE3NN W",
+  "ss7/3senw3/2nw1nw1SW1/1ne3SE2/2nw3SW1/nw2SE1SE2/2SE1SE3/7NN W",
+  "ss3nw3/3se4/2nw1nw1SW1/1ne3SE2/2nw3SW1/3SE1SE2/nw1SE1NW3/7NN B",
+  "ss7/3nw1nw2/2nw1nw1SE1/1ne3SE2/2nw3SW1/3SE1SE2/nw3SW2NN/3NE4 B",
+  "ss3ne3/3se2SW1/2nw1nw3/1ne3SE2/2nw3SW1/3SE1SE2/nw3NW3/3SE3NN W",
+  "ss3nw3/3se4/2nw1nw1SW1/1ne3SE2/2ne2SESW1/3SE4/nw3NW3/3SE3NN W",
+  "ss3se3/7SW/2nw1nw3/1ne3SE2/2nw3SW1/3SE1SE2/ne7/3SW3NN W",
+  "ss7/3se1nw2/2nw1nw1SW1/1ne3SE2/2nw3SW1/3SE1SE2/nw3NW2NN/3SE4 W",
+};
+
+#define NUM_BENCH_POSITIONS ((int) (sizeof(bench_fens) / sizeof(bench_fens[0])))
+
+static void bench_report(FILE *OUT, const char *name, uint64_t ops,
+                         uint64_t check, double ms) {
+  fprintf(OUT, "bench %s ops %" PRIu64 " check %" PRIu64
+          " ns/op %.1f\n", name, ops, check, ms * 1e6 / ops);
+}
+
+// Runs the fixed benchmark and prints one line per measurement to OUT.  The
+// search part goes to the given depth; depth 0 skips it.
+void bench(int depth, FILE *OUT) {
+  position_t *pos = (position_t *) malloc(sizeof(position_t) * NUM_BENCH_POSITIONS);
+  sortable_move_t lst[MAX_NUM_MOVES];
+  position_t child;
+  double start;
+
+  for (int i = 0; i < NUM_BENCH_POSITIONS; i++) {
+    char fen[MAX_FEN_CHARS];
+    snprintf(fen, MAX_FEN_CHARS, "%s", bench_fens[i]);
+    if (fen_to_pos(&pos[i], fen) != 0) {
+      fprintf(OUT, "bench: bad position %d\n", i);
+      free(pos);
+      return;
+    }
+  }
+
+  fprintf(OUT, "bench positions %d reps %d\n", NUM_BENCH_POSITIONS, BENCH_REPS);
+
+  uint64_t ops = 0;
+  uint64_t check = 0;
+  start = milliseconds();
+  for (int r = 0; r < BENCH_REPS; r++) {
+    for (int i = 0; i < NUM_BENCH_POSITIONS; i++) {
+      check += generate_all(&pos[i], lst, true);
+      ops++;
+    }
+  }
+  bench_report(OUT, "generate_all", ops, check, milliseconds() - start);
+
+  ops = 0;
+  check = 0;
+  double elapsed = 0.0;
+  for (int i = 0; i < NUM_BENCH_POSITIONS; i++) {
+    int num_moves = generate_all(&pos[i], lst, true);
+    start = milliseconds();
+    for (int r = 0; r < BENCH_REPS; r++) {
+      for (int j = 0; j < num_moves; j++) {
+        victims_t victims = make_move2(&pos[i], &child, get_move(lst[j]));
+        check += !is_ILLEGAL(victims) && !is_KO(victims);
+      }
+    }
+    elapsed += milliseconds() - start;
+    ops += (uint64_t) num_moves * BENCH_REPS;
+  }
+  bench_report(OUT, "make_move2", ops, check, elapsed);
+
+  ops = 0;
+  check = 0;
+  start = milliseconds();
+  for (int r = 0; r < BENCH_REPS; r++) {
+    for (int i = 0; i < NUM_BENCH_POSITIONS; i++) {
+      check += fire_laser(&pos[i], WHITE) + fire_laser(&pos[i], BLACK);
+      ops += 2;
+    }
+  }
+  bench_report(OUT, "fire_laser", ops, check, milliseconds() - start);
+
+  // Every pass after the first would hit the eval cache, so time the
+  // evaluator without it.
+  eval_cache_resize(0);
+  ops = 0;
+  check = 0;
+  start = milliseconds();
+  for (int r = 0; r < BENCH_REPS; r++) {
+    for (int i = 0; i < NUM_BENCH_POSITIONS; i++) {
+      check += (uint16_t) eval(&pos[i], false);
+      ops++;
+    }
+  }
+  bench_report(OUT, "eval", ops, check, milliseconds() - start);
+  eval_cache_resize(EVAL_CACHE);
+
+  if (depth <= 0) {
+    free(pos);
+    return;
+  }
+
+  // The searches print their usual info lines; only the summary is wanted.
+  FILE *devnull = fopen("/dev/null", "w");
+  uint64_t total_nodes = 0;
+  elapsed = 0.0;
+  for (int i = 0; i < NUM_BENCH_POSITIONS; i++) {
+    uint64_t nodes = 0;
+    move_t subpv = 0;
+    score_t score = 0;
+    char bms[MAX_CHARS_IN_MOVE];
+
+    tt_clear_hashtable();
+    eval_cache_clear();
+    init_best_move_history();
+    init_abort_timer(BENCH_TIME);
+    init_tics();
+
+    start = milliseconds();
+    for (int d = 1; d <= depth; d++) {
+      reset_abort();
+      score = searchRoot(&pos[i], -INF, INF, d, 0, &subpv, &nodes, devnull);
+      merge_best_move_history();
+    }
+    double ms = milliseconds() - start;
+    elapsed += ms;
+    total_nodes += nodes;
+
+    move_to_str(subpv, bms, MAX_CHARS_IN_MOVE);
+    fprintf(OUT, "bench search %d depth %d bestmove %s score %d nodes %" PRIu64
+            " ms %.0f\n", i, depth, bms, score, nodes, ms);
+  }
+  fclose(devnull);
+
+  if (elapsed < 1.0) {
+    elapsed = 1.0;  // don't divide by 0
+  }
+  fprintf(OUT, "bench search total depth %d nodes %" PRIu64
+          " ms %.0f nps %" PRIu64 "\n", depth, total_nodes, elapsed,
+          (uint64_t) (1000 * total_nodes / elapsed));
+
+  free(pos);
+}
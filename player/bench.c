@@ -0,0 +1,187 @@
+// Copyright (c) 2015 MIT License by 6.172 Staff
+
+// Fixed-workload benchmark.  Times the move generator, the evaluator and a
+// fixed-depth search over a corpus of middle-game positions taken from
+// tests/book.dta.
+//
+// Every line prints its deterministic columns (operation counts, checksums,
+// best moves, node counts) before the timing columns, so the output of two
+// builds can be compared after stripping the timings:
+//
+//   printf 'bench\nquit\n' | ./leiserchess | sed 's/ \(ns\/op\|ms\) .*//' > a.txt
+//
+// A change that is meant to be a pure speedup should leave that file
+// unchanged.  The search lines depend on the transposition table, so they are
+// only reproducible when the Zobrist keys are (see init_zob).
+
+#include "./bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+
+#include "./eval.h"
+#include "./fen.h"
+#include "./move_gen.h"
+#include "./search.h"
+#include "./tt.h"
+#include "./util.h"
+
+// defined in eval.c
+extern int EVAL_CACHE;
+
+// Number of passes over the corpus for each primitive.
+#define BENCH_REPS 2000
+
+// Effectively unbounded time for the fixed-depth searches.
+#define BENCH_TIME 99999999999.0
+
+static const char *bench_fens[] = {
+  "ss3nw3/3nw4/2nw1nw1SE1/1nw3SE2/2nw3SW1/nw2SE1SE2/4SE3/3SE3NN B",
+  "ss3nw3/3nw4/2nw1nw1SE1/1nw3SE2/2nw3SW1/3SE1SE2/nw3NW3/3SE3NN B",
+  "ss3nw3/3se4/2nw1nw1SW1/1ne3SE2/nw1nw3SE1/3SE1SE2/2SE1SE3/7NN B",
+  "ss3nw3/3se2SE1/2nw1nw3/1ne3SE2/1nwnw3SW1/3SE1SE2/4SE3/3SE3NN W",
+  "ss3nw3/3nw4/2nw1nw1SW1/1ne3SE2/2nw3SW1/3SE1SE2/nw3NW3/3SE3NN B",
+  "ss3nw3/3se2SW1/2nw1nw3/1ne3SE2/2nw3SW1/nw2SE1SE2/4SE3/3SE3NN B",
+  "ss3nw3/3nw4/2nw1nw1SE1/1ne3SE2/2nw3SW1/1nw1SE1SE2/4SW2NN/3SE4 W",
+  "ss3se3/3se2SW1/2nw1nw3/1ne3SE2/2nw3SW1/nw2SE1SE2/4SE3/3SE3NN W",
+  "ss7/3senw3/2nw1nw1SW1/1ne3SE2/2nw3SW1/nw2SE1SE2/2SE1SE3/7NN W",
+  "ss3nw3/3se4/2nw1nw1SW1/1ne3SE2/2nw3SW1/3SE1SE2/nw1SE1NW3/7NN B",
+  "ss7/3nw1nw2/2nw1nw1SE1/1ne3SE2/2nw3SW1/3SE1SE2/nw3SW2NN/3NE4 B",
+  "ss3ne3/3se2SW1/2nw1nw3/1ne3SE2/2nw3SW1/3SE1SE2/nw3NW3/3SE3NN W",
+  "ss3nw3/3se4/2nw1nw1SW1/1ne3SE2/2ne2SESW1/3SE4/nw3NW3/3SE3NN W",
+  "ss3se3/7SW/2nw1nw3/1ne3SE2/2nw3SW1/3SE1SE2/ne7/3SW3NN W",
+  "ss7/3se1nw2/2nw1nw1SW1/1ne3SE2/2nw3SW1/3SE1SE2/nw3NW2NN/3SE4 W",
+};
+
+#define NUM_BENCH_POSITIONS ((int) (sizeof(bench_fens) / sizeof(bench_fens[0])))
+
+static void bench_report(FILE *OUT, const char *name, uint64_t ops,
+                         uint64_t check, double ms) {
+  fprintf(OUT, "bench %s ops %" PRIu64 " check %" PRIu64
+          " ns/op %.1f\n", name, ops, check, ms * 1e6 / ops);
+}
+
+// Runs the fixed benchmark and prints one line per measurement to OUT.  The
+// search part goes to the given depth; depth 0 skips it.
+void bench(int depth, FILE *OUT) {
+  position_t *pos = (position_t *) malloc(sizeof(position_t) * NUM_BENCH_POSITIONS);
+  sortable_move_t lst[MAX_NUM_MOVES];
+  position_t child;
+  double start;
+
+  for (int i = 0; i < NUM_BENCH_POSITIONS; i++) {
+    char fen[MAX_FEN_CHARS];
+    snprintf(fen, MAX_FEN_CHARS, "%s", bench_fens[i]);
+    if (fen_to_pos(&pos[i], fen) != 0) {
+      fprintf(OUT, "bench: bad position %d\n", i);
+      free(pos);
+      return;
+    }
+  }
+
+  fprintf(OUT, "bench positions %d reps %d\n", NUM_BENCH_POSITIONS, BENCH_REPS);
+
+  uint64_t ops = 0;
+  uint64_t check = 0;
+  start = milliseconds();
+  for (int r = 0; r < BENCH_REPS; r++) {
+    for (int i = 0; i < NUM_BENCH_POSITIONS; i++) {
+      check += generate_all(&pos[i], lst, true);
+      ops++;
+    }
+  }
+  bench_report(OUT, "generate_all", ops, check, milliseconds() - start);
+
+  ops = 0;
+  check = 0;
+  double elapsed = 0.0;
+  for (int i = 0; i < NUM_BENCH_POSITIONS; i++) {
+    int num_moves = generate_all(&pos[i], lst, true);
+    start = milliseconds();
+    for (int r = 0; r < BENCH_REPS; r++) {
+      for (int j = 0; j < num_moves; j++) {
+        victims_t victims = make_move2(&pos[i], &child, get_move(lst[j]));
+        check += !is_ILLEGAL(victims) && !is_KO(victims);
+      }
+    }
+    elapsed += milliseconds() - start;
+    ops += (uint64_t) num_moves * BENCH_REPS;
+  }
+  bench_report(OUT, "make_move2", ops, check, elapsed);
+
+  ops = 0;
+  check = 0;
+  start = milliseconds();
+  for (int r = 0; r < BENCH_REPS; r++) {
+    for (int i = 0; i < NUM_BENCH_POSITIONS; i++) {
+      check += fire_laser(&pos[i], WHITE) + fire_laser(&pos[i], BLACK);
+      ops += 2;
+    }
+  }
+  bench_report(OUT, "fire_laser", ops, check, milliseconds() - start);
+
+  // Every pass after the first would hit the eval cache, so time the
+  // evaluator without it.
+  eval_cache_resize(0);
+  ops = 0;
+  check = 0;
+  start = milliseconds();
+  for (int r = 0; r < BENCH_REPS; r++) {
+    for (int i = 0; i < NUM_BENCH_POSITIONS; i++) {
+      check += (uint16_t) eval(&pos[i], false);
+      ops++;
+    }
+  }
+  bench_report(OUT, "eval", ops, check, milliseconds() - start);
+  eval_cache_resize(EVAL_CACHE);
+
+  if (depth <= 0) {
+    free(pos);
+    return;
+  }
+
+  // The searches print their usual info lines; only the summary is wanted.
+  FILE *devnull = fopen("/dev/null", "w");
+  uint64_t total_nodes = 0;
+  elapsed = 0.0;
+  for (int i = 0; i < NUM_BENCH_POSITIONS; i++) {
+    uint64_t nodes = 0;
+    move_t subpv = 0;
+    score_t score = 0;
+    char bms[MAX_CHARS_IN_MOVE];
+
+    tt_clear_hashtable();
+    eval_cache_clear();
+    init_best_move_history();
+    init_abort_timer(BENCH_TIME);
+    init_tics();
+
+    start = milliseconds();
+    for (int d = 1; d <= depth; d++) {
+      reset_abort();
+      score = searchRoot(&pos[i], -INF, INF, d, 0, &subpv, &nodes, devnull);
+      merge_best_move_history();
+    }
+    double ms = milliseconds() - start;
+    elapsed += ms;
+    total_nodes += nodes;
+
+    move_to_str(subpv, bms, MAX_CHARS_IN_MOVE);
+    fprintf(OUT, "bench search %d depth %d bestmove %s score %d nodes %" PRIu64
+            " ms %.0f\n", i, depth, bms, score, nodes, ms);
+  }
+  fclose(devnull);
+
+  if (elapsed < 1.0) {
+    elapsed = 1.0;  // don't divide by 0
+  }
+  fprintf(OUT, "bench search total depth %d nodes %" PRIu64
+          " ms %.0f nps %" PRIu64 "\n", depth, total_nodes, elapsed,
+          (uint64_t) (1000 * total_nodes / elapsed));
+
+  free(pos);
+}
@@ -0,0 +1,10 @@
+// Copyright (c) 2015 MIT License by 6.172 Staff
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+
+void bench(int depth, FILE *OUT);
+
+#endif  // BENCH_H
@@ -2,6 +2,7 @@
 
 #include "./eval.h"
 
+#include <inttypes.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
@@ -9,6 +10,7 @@
 #include "./move_gen.h"
 #include "./tbassert.h"
 #include "./closebook.h"
+#include "./util.h"
 
 // -----------------------------------------------------------------------------
 // Evaluation
@@ -27,6 +29,8 @@ int KAGGRESSIVE;
 int MOBILITY;
 int PAWNPIN;
 
+int EVAL_CACHE;  // eval cache size in MBytes, 0 turns it off
+
 // Heuristics for static evaluation - described in the google doc
 // mentioned in the handout.
 
@@ -40,18 +44,6 @@ static const ev_score_t pcentral_s[64] = {
 181, 249, 302, 323, 323, 302, 249, 181,
 125, 181, 220, 234, 234, 220, 181, 125};
 
-static const uint64_t three_by_three_mask[100] = {
-  0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 
-  0ULL, 771ULL, 1799ULL, 3598ULL, 7196ULL, 14392ULL, 28784ULL, 57568ULL, 49344ULL, 0ULL, 
-  0ULL, 197379ULL, 460551ULL, 921102ULL, 1842204ULL, 3684408ULL, 7368816ULL, 14737632ULL, 12632256ULL, 0ULL, 
-  0ULL, 50529024ULL, 117901056ULL, 235802112ULL, 471604224ULL, 943208448ULL, 1886416896ULL, 3772833792ULL, 3233857536ULL, 0ULL, 
-  0ULL, 12935430144ULL, 30182670336ULL, 60365340672ULL, 120730681344ULL, 241461362688ULL, 482922725376ULL, 965845450752ULL, 827867529216ULL, 0ULL, 
-  0ULL, 3311470116864ULL, 7726763606016ULL, 15453527212032ULL, 30907054424064ULL, 61814108848128ULL, 123628217696256ULL, 247256435392512ULL, 211934087479296ULL, 0ULL, 
-  0ULL, 847736349917184ULL, 1978051483140096ULL, 3956102966280192ULL, 7912205932560384ULL, 15824411865120768ULL, 31648823730241536ULL, 63297647460483072ULL, 54255126394699776ULL, 0ULL, 
-  0ULL, 217020505578799104ULL, 506381179683864576ULL, 1012762359367729152ULL, 2025524718735458304ULL, 4051049437470916608ULL, 8102098874941833216ULL, 16204197749883666432ULL, 13889312357043142656ULL, 0ULL, 
-  0ULL, 217017207043915776ULL, 506373483102470144ULL, 1012746966204940288ULL, 2025493932409880576ULL, 4050987864819761152ULL, 8101975729639522304ULL, 16203951459279044608ULL, 13889101250810609664ULL, 0ULL, 
-  0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL};
-
 static const double inv_s[16] = {1.0/1, 1.0/2, 1.0/3, 1.0/4, 1.0/5, 1.0/6, 1.0/7,
 1.0/8, 1.0/9, 1.0/10, 1.0/11, 1.0/12, 1.0/13, 1.0/14, 1.0/15, 1.0/16};
 
@@ -74,16 +66,13 @@ static inline  bool between(int c, int a, int b) {
 
 
 // KFACE heuristic: bonus (or penalty) for King facing toward the other King
-static inline  ev_score_t kface(position_t *p, fil_t f, rnk_t r) {
-  square_t sq = square_of(f, r);
-  piece_t x = p->board[sq];
-  color_t c = color_of(x);
+static inline  ev_score_t kface(position_t *p, color_t c, fil_t f, rnk_t r) {
   square_t opp_sq = p->kloc[opp_color(c)];
   int delta_fil = fil_of(opp_sq) - f;
   int delta_rnk = rnk_of(opp_sq) - r;
   int bonus;
 
-  switch (ori_of(x)) {
+  switch (p->kori[c]) {
     case NN:
       bonus = delta_rnk;
       break;
@@ -108,11 +97,8 @@ static inline  ev_score_t kface(position_t *p, fil_t f, rnk_t r) {
 }
 
 // KAGGRESSIVE heuristic: bonus for King with more space to back
-static inline  ev_score_t kaggressive(position_t *p, fil_t f, rnk_t r) {
-  square_t sq = square_of(f, r);
-  piece_t x = p->board[sq];
-  color_t c = color_of(x);
-  tbassert(ptype_of(x) == KING, "ptype_of(x) = %d\n", ptype_of(x));
+static inline  ev_score_t kaggressive(position_t *p, color_t c, fil_t f, rnk_t r) {
+  tbassert(p->kloc[c] == square_of(f, r), "kloc: %d\n", p->kloc[c]);
 
   square_t opp_sq = p->kloc[opp_color(c)];
   fil_t of = fil_of(opp_sq);
@@ -144,42 +130,30 @@ static inline  ev_score_t kaggressive(position_t *p, fil_t f, rnk_t r) {
 //             path of the laser is marked with mark_mask.
 // mark_mask : What each square is marked with.
 
-// directions for laser: NN, EE, SS, WW
-static const int beam_64[NUM_ORI] = {1, 8, -1, -8};
-
 uint64_t mark_laser_path_bit(position_t *p, color_t c) {
-  // static int count = 0;
-  // count += 1;
-  // if (count % 10000 == 0)
-  //   printf("%d\n", count);
   square_t sq = p->kloc[c];
-  int loc64 = fil_of(sq) * 8 + rnk_of(sq);
-  uint64_t laser_map = 0;
-  int bdir = ori_of(p->board[sq]);
+  uint64_t laser_map = square_bit(sq);
+  uint64_t occupied = p->mask[WHITE] | p->mask[BLACK];
+  int bdir = p->kori[c];
   p->kill_d[c] = false;
 
-  tbassert(ptype_of(p->board[sq]) == KING,
-           "ptype: %d\n", ptype_of(p->board[sq]));
-  laser_map |= (1ULL << loc64);
-  
+  tbassert(occupied & square_bit(sq), "sq: %d\n", sq);
+
   while (true) {
-    sq += beam_of(bdir);
-    int x = ptype_of(p->board[sq]);
-    if (x == INVALID)
-      return laser_map;
-    // tbassert(sq < ARR_SIZE && sq >= 0, "sq: %d\n", sq);
-    loc64 += beam_64[bdir];
-    laser_map |= (1ULL << loc64);
-    if (x == KING) {
+    square_t hit = laser_hit(sq, bdir, occupied);
+    if (hit == NO_SQUARE)
+      return laser_map | laser_ray_of(sq, bdir);
+    // everything past sq up to and including hit
+    laser_map |= laser_ray_of(sq, bdir) ^ laser_ray_of(hit, bdir);
+    sq = hit;
+    if (sq == p->kloc[WHITE] || sq == p->kloc[BLACK]) {
       p->kill_d[c] = true;
       return laser_map;
     }
-    if (x == PAWN) {
-      bdir = reflect_of(bdir, ori_of(p->board[sq]));
-      if (bdir < 0) {  // Hit back of Pawn
-        p->kill_d[c] = true;
-        return laser_map;
-      }
+    bdir = reflect_of(bdir, pawn_ori_at(p, sq));
+    if (bdir < 0) {  // Hit back of Pawn
+      p->kill_d[c] = true;
+      return laser_map;
     }
   }
   return laser_map;
@@ -189,15 +163,10 @@ uint64_t mark_laser_path_bit(position_t *p, color_t c) {
 //   opposing king's laser --- and are thus mobile.
 
 static inline int pawnpin(position_t *p, color_t color, uint64_t laser_map) {
-  tbassert(p->mask[0] == compute_mask(p, 0),
-           "p->mask: %"PRIu64", mask: %"PRIu64"\n",
-           p->mask[0], compute_mask(p, 0));
-  tbassert(p->mask[1] == compute_mask(p, 1),
-           "p->mask: %"PRIu64", mask: %"PRIu64"\n",
-           p->mask[1], compute_mask(p, 1));
+  tbassert(board_is_consistent(p), "inconsistent board\n");
 
   uint64_t mask = (~laser_map) & p -> mask[color];
-  return __builtin_popcountl(mask) - ((1ULL << (fil_of(p -> kloc[color]) * 8 + rnk_of(p -> kloc[color])) & mask) != 0);
+  return __builtin_popcountl(mask) - ((square_bit(p -> kloc[color]) & mask) != 0);
 
 }
 
@@ -212,10 +181,10 @@ static inline int mobility(position_t *p, color_t color, uint64_t laser_map) {
 static inline int h_squares_attackable(position_t *p, color_t c, uint64_t laser_map) {
 
   square_t o_king_sq = p->kloc[opp_color(c)];
-  tbassert(ptype_of(p->board[o_king_sq]) == KING,
-           "ptype: %d\n", ptype_of(p->board[o_king_sq]));
-  tbassert(color_of(p->board[o_king_sq]) != c,
-           "color: %d\n", color_of(p->board[o_king_sq]));
+  tbassert(ptype_of(piece_at(p, o_king_sq)) == KING,
+           "ptype: %d\n", ptype_of(piece_at(p, o_king_sq)));
+  tbassert(color_of(piece_at(p, o_king_sq)) != c,
+           "color: %d\n", color_of(piece_at(p, o_king_sq)));
 
   float h_attackable = 0;
 
@@ -233,7 +202,7 @@ static inline int h_squares_attackable(position_t *p, color_t c, uint64_t laser_
 }
 
 // Static evaluation.  Returns score
-score_t eval(position_t *p, bool verbose) {
+static inline score_t eval_uncached(position_t *p, bool verbose) {
   // seed rand_r with a value of 1, as per
   // http://linux.die.net/man/3/rand_r
 
@@ -252,10 +221,10 @@ score_t eval(position_t *p, bool verbose) {
   rnk_t r0 = rnk_of(p -> kloc[0]);
   fil_t f1 = fil_of(p -> kloc[1]);
   rnk_t r1 = rnk_of(p -> kloc[1]);
-  score += kface(p, f0, r0) + kaggressive(p, f0, r0);
+  score += kface(p, WHITE, f0, r0) + kaggressive(p, WHITE, f0, r0);
   score -= pcentral(f0 * 8 + r0);
 
-  score -= kface(p, f1, r1) + kaggressive(p, f1, r1);
+  score -= kface(p, BLACK, f1, r1) + kaggressive(p, BLACK, f1, r1);
   score += pcentral(f1 * 8 + r1);
 
 
@@ -335,3 +304,99 @@ score_t eval(position_t *p, bool verbose) {
   return score / EV_SCORE_RATIO;
 }
   
+
+
+// -----------------------------------------------------------------------------
+// Eval cache
+// -----------------------------------------------------------------------------
+
+// The score only depends on the board and the side to move, which is what the
+// Zobrist key covers, so transpositions and the repeated stand-pat evaluations
+// of the quiescence search can share one evaluation.
+//
+// The cache is direct-mapped and each entry is a single 64-bit word, the high
+// 48 bits of the key above the 16-bit score, so workers share it without
+// locks.  An all-zero entry is empty.
+typedef uint64_t evEntry_t;
+
+#define EV_ENTRY_SCORE_MASK 0xffffULL
+
+static struct {
+  evEntry_t *entries;
+  uint64_t mask;           // a mask to map from key to entry index
+} eval_cache;
+
+// Replaces the cache with an empty one of at most size_in_meg MBytes; 0 frees
+// it.
+void eval_cache_resize(int size_in_meg) {
+  free(eval_cache.entries);
+  eval_cache.entries = NULL;
+  eval_cache.mask = 0;
+  if (size_in_meg <= 0) {
+    return;
+  }
+
+  uint64_t num_of_entries = (uint64_t) size_in_meg * (1ULL << 20) /
+      sizeof(evEntry_t);
+  uint64_t pow = 1;
+  while (pow * 2 <= num_of_entries) pow *= 2;
+
+  eval_cache.entries = (evEntry_t *) calloc(pow, sizeof(evEntry_t));
+  if (eval_cache.entries == NULL) {
+    fprintf(stderr, "Eval cache too big\n");
+    exit(1);
+  }
+  eval_cache.mask = pow - 1;
+}
+
+// Forgets every score.  Needed whenever the evaluation parameters or the
+// Zobrist keys change.
+void eval_cache_clear() {
+  if (eval_cache.entries) {
+    memset(eval_cache.entries, 0, sizeof(evEntry_t) * (eval_cache.mask + 1));
+  }
+}
+
+uint64_t eval_cache_get_num_of_entries() {
+  return eval_cache.entries ? eval_cache.mask + 1 : 0;
+}
+
+// Starts fetching the entry for key, see tt_prefetch().
+void eval_cache_prefetch(uint64_t key) {
+  if (eval_cache.entries) {
+    __builtin_prefetch(&eval_cache.entries[key & eval_cache.mask]);
+  }
+}
+
+// Prints the cache counters (see COUNT() in util.h), if there is a cache.
+void eval_print_stats(FILE *OUT) {
+  if (eval_cache.entries == NULL) {
+    return;
+  }
+  uint64_t probes = counter_total(COUNT_EVAL_PROBES);
+  uint64_t hits = counter_total(COUNT_EVAL_HITS);
+  double hit_rate = probes ? 100.0 * hits / probes : 0.0;
+  fprintf(OUT, "info string eval cache probes %" PRIu64 " hits %" PRIu64
+          " (%.1f%%)\n", probes, hits, hit_rate);
+}
+
+// Static evaluation through the cache.  Randomized and verbose evaluations
+// bypass it.
+score_t eval(position_t *p, bool verbose) {
+  if (eval_cache.entries == NULL || verbose || RANDOMIZE) {
+    return eval_uncached(p, verbose);
+  }
+
+  evEntry_t *entry = &eval_cache.entries[p->key & eval_cache.mask];
+  evEntry_t e = __atomic_load_n(entry, __ATOMIC_RELAXED);
+  COUNT(COUNT_EVAL_PROBES);
+  if (e != 0 && ((e ^ p->key) & ~EV_ENTRY_SCORE_MASK) == 0) {
+    COUNT(COUNT_EVAL_HITS);
+    return (score_t) (uint16_t) e;
+  }
+
+  score_t score = eval_uncached(p, verbose);
+  e = (p->key & ~EV_ENTRY_SCORE_MASK) | (uint16_t) score;
+  __atomic_store_n(entry, e, __ATOMIC_RELAXED);
+  return score;
+}
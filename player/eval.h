@@ -4,6 +4,8 @@
 #define EVAL_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 
 #include "./move_gen.h"
 #include "./search.h"
@@ -19,4 +21,10 @@ static inline uint64_t mark_laser_path_bit(position_t *p, color_t c);
 
 static inline score_t eval(position_t *p, bool verbose);
 
+static inline void eval_cache_resize(int size_in_meg);
+static inline void eval_cache_clear();
+static inline uint64_t eval_cache_get_num_of_entries();
+static inline void eval_cache_prefetch(uint64_t key);
+void eval_print_stats(FILE *OUT);
+
 #endif  // EVAL_H
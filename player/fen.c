@@ -21,10 +21,10 @@ static void fen_error(char *fen, int c_count, char *msg) {
 
 // parse_fen_board
 // Input:   board representation as a fen string
-//          unpopulated board position struct
+//          array of NUM_SQUARES pieces, indexed by square
 // Output:  index of where board description ends or 0 if parsing error
-//          (populated) board position struct
-static int parse_fen_board(position_t *p, char *fen) {
+//          (populated) array of pieces
+static int parse_fen_board(piece_t *board, char *fen) {
   // Invariant: square (f, r) is last square filled.
   // Fill from last rank to first rank, from first file to last file
   fil_t f = -1;
@@ -71,7 +71,7 @@ static int parse_fen_board(position_t *p, char *fen) {
             fen_error(fen, c_count, "Too many squares in rank.\n");
             return 0;
           }
-          set_ptype(&p->board[square_of(f, r)], EMPTY);
+          set_ptype(&board[square_of(f, r)], EMPTY);
           c--;
         }
         break;
@@ -97,9 +97,9 @@ static int parse_fen_board(position_t *p, char *fen) {
           fen_error(fen, c_count+1, "Syntax error");
           return 0;
         }
-        set_ptype(&p->board[square_of(f, r)], typ);
-        set_color(&p->board[square_of(f, r)], WHITE);
-        set_ori(&p->board[square_of(f, r)], ori);
+        set_ptype(&board[square_of(f, r)], typ);
+        set_color(&board[square_of(f, r)], WHITE);
+        set_ori(&board[square_of(f, r)], ori);
         break;
 
       case 'n':
@@ -122,9 +122,9 @@ static int parse_fen_board(position_t *p, char *fen) {
           fen_error(fen, c_count+1, "Syntax error");
           return 0;
         }
-        set_ptype(&p->board[square_of(f, r)], typ);
-        set_color(&p->board[square_of(f, r)], BLACK);
-        set_ori(&p->board[square_of(f, r)], ori);
+        set_ptype(&board[square_of(f, r)], typ);
+        set_color(&board[square_of(f, r)], BLACK);
+        set_ori(&board[square_of(f, r)], ori);
         break;
 
       case 'S':
@@ -147,9 +147,9 @@ static int parse_fen_board(position_t *p, char *fen) {
           fen_error(fen, c_count+1, "Syntax error");
           return 0;
         }
-        set_ptype(&p->board[square_of(f, r)], typ);
-        set_color(&p->board[square_of(f, r)], WHITE);
-        set_ori(&p->board[square_of(f, r)], ori);
+        set_ptype(&board[square_of(f, r)], typ);
+        set_color(&board[square_of(f, r)], WHITE);
+        set_ori(&board[square_of(f, r)], ori);
         break;
 
       case 's':
@@ -172,9 +172,9 @@ static int parse_fen_board(position_t *p, char *fen) {
           fen_error(fen, c_count+1, "Syntax error");
           return 0;
         }
-        set_ptype(&p->board[square_of(f, r)], typ);
-        set_color(&p->board[square_of(f, r)], BLACK);
-        set_ori(&p->board[square_of(f, r)], ori);
+        set_ptype(&board[square_of(f, r)], typ);
+        set_color(&board[square_of(f, r)], BLACK);
+        set_ori(&board[square_of(f, r)], ori);
         break;
 
       case 'E':
@@ -185,9 +185,9 @@ static int parse_fen_board(position_t *p, char *fen) {
         next_c = fen[c_count++];
 
         if (next_c == 'E') {  // White King facing East
-          set_ptype(&p->board[square_of(f, r)], KING);
-          set_color(&p->board[square_of(f, r)], WHITE);
-          set_ori(&p->board[square_of(f, r)], EE);
+          set_ptype(&board[square_of(f, r)], KING);
+          set_color(&board[square_of(f, r)], WHITE);
+          set_ori(&board[square_of(f, r)], EE);
         } else {
           fen_error(fen, c_count+1, "Syntax error");
           return 0;
@@ -202,9 +202,9 @@ static int parse_fen_board(position_t *p, char *fen) {
         next_c = fen[c_count++];
 
         if (next_c == 'W') {  // White King facing West
-          set_ptype(&p->board[square_of(f, r)], KING);
-          set_color(&p->board[square_of(f, r)], WHITE);
-          set_ori(&p->board[square_of(f, r)], WW);
+          set_ptype(&board[square_of(f, r)], KING);
+          set_color(&board[square_of(f, r)], WHITE);
+          set_ori(&board[square_of(f, r)], WW);
         } else {
           fen_error(fen, c_count+1, "Syntax error");
           return 0;
@@ -219,9 +219,9 @@ static int parse_fen_board(position_t *p, char *fen) {
         next_c = fen[c_count++];
 
         if (next_c == 'e') {  // Black King facing East
-          set_ptype(&p->board[square_of(f, r)], KING);
-          set_color(&p->board[square_of(f, r)], BLACK);
-          set_ori(&p->board[square_of(f, r)], EE);
+          set_ptype(&board[square_of(f, r)], KING);
+          set_color(&board[square_of(f, r)], BLACK);
+          set_ori(&board[square_of(f, r)], EE);
         } else {
           fen_error(fen, c_count+1, "Syntax error");
           return 0;
@@ -236,9 +236,9 @@ static int parse_fen_board(position_t *p, char *fen) {
         next_c = fen[c_count++];
 
         if (next_c == 'w') {  // Black King facing West
-          set_ptype(&p->board[square_of(f, r)], KING);
-          set_color(&p->board[square_of(f, r)], BLACK);
-          set_ori(&p->board[square_of(f, r)], WW);
+          set_ptype(&board[square_of(f, r)], KING);
+          set_color(&board[square_of(f, r)], BLACK);
+          set_ori(&board[square_of(f, r)], WW);
         } else {
           fen_error(fen, c_count+1, "Syntax error");
           return 0;
@@ -339,28 +339,32 @@ int fen_to_pos(position_t *p, char *fen) {
 
   int c_count = 0;  // Invariant: fen[c_count] is next char to be read
 
-  for (int i = 0; i < ARR_SIZE; ++i) {
-    p->board[i] = 0;
-    set_ptype(&p->board[i], INVALID);  // squares are invalid until filled
-  }
-
-  c_count = parse_fen_board(p, fen);
+  piece_t board[NUM_SQUARES] = {0};
+  c_count = parse_fen_board(board, fen);
   if (!c_count) {
     return 1;  // parse error of board
   }
 
-  // King check
+  // Move the pieces into the bitboards, checking the Kings on the way
 
   int Kings[2] = {0, 0};
-  for (fil_t f = 0; f < BOARD_WIDTH; ++f) {
-    for (rnk_t r = 0; r < BOARD_WIDTH; ++r) {
-      square_t sq = square_of(f, r);
-      piece_t x = p->board[sq];
-      ptype_t typ = ptype_of(x);
-      if (typ == KING) {
-        Kings[color_of(x)]++;
-        p->kloc[color_of(x)] = sq;
-      }
+  p->mask[WHITE] = p->mask[BLACK] = 0;
+  for (int ori = 0; ori < NUM_ORI; ++ori) {
+    p->pawn[ori] = 0;
+  }
+  for (square_t sq = 0; sq < NUM_SQUARES; ++sq) {
+    piece_t x = board[sq];
+    ptype_t typ = ptype_of(x);
+    if (typ == EMPTY) {
+      continue;
+    }
+    p->mask[color_of(x)] |= square_bit(sq);
+    if (typ == KING) {
+      Kings[color_of(x)]++;
+      p->kloc[color_of(x)] = sq;
+      p->kori[color_of(x)] = ori_of(x);
+    } else {
+      p->pawn[ori_of(x)] |= square_bit(sq);
     }
   }
 
@@ -419,8 +423,6 @@ int fen_to_pos(position_t *p, char *fen) {
   if (lm_from_sq == 0) {   // from-square of last move
     p->last_move = 0;  // no last move specified
     p->key = compute_zob_key(p);
-    p->mask[0] = compute_mask(p, 0);
-    p->mask[1] = compute_mask(p, 1);
     p->laser[0] = mark_laser_path_bit(p, 0);
     p->laser[1] = mark_laser_path_bit(p, 1);
     return 0;
@@ -454,9 +456,7 @@ int fen_to_pos(position_t *p, char *fen) {
   }
   p->last_move = move_of(EMPTY, lm_rot, lm_from_sq, lm_to_sq);
   p->key = compute_zob_key(p);
-  p->mask[0] = compute_mask(p, 0);
-  p->mask[1] = compute_mask(p, 1);
-  
+
   return 0;  // everything is okay
 }
 
@@ -480,31 +480,27 @@ int pos_to_fen(position_t *p, char *fen) {
   int pos = 0;
   int i;
 
-  for (rnk_t r = BOARD_WIDTH - 1; r >=0 ; --r) {
+  for (int r = BOARD_WIDTH - 1; r >= 0; --r) {
     int empty_in_a_row = 0;
     for (fil_t f = 0; f < BOARD_WIDTH; ++f) {
-      square_t sq = square_of(f, r);
-
-      if (ptype_of(p->board[sq]) == INVALID) {     // invalid square
-        tbassert(false, "Bad news, yo.\n");        // This is bad!
-      }
+      piece_t x = piece_at(p, square_of(f, r));
 
-      if (ptype_of(p->board[sq]) == EMPTY) {       // empty square
+      if (ptype_of(x) == EMPTY) {       // empty square
         empty_in_a_row++;
         continue;
       } else {
         if (empty_in_a_row) fen[pos++] = '0' + empty_in_a_row;
         empty_in_a_row = 0;
 
-        int ori = ori_of(p->board[sq]);  // orientation
-        color_t c = color_of(p->board[sq]);
+        int ori = ori_of(x);  // orientation
+        color_t c = color_of(x);
 
-        if (ptype_of(p->board[sq]) == KING) {
+        if (ptype_of(x) == KING) {
           for (i = 0; i < 2; i++) fen[pos++] = king_ori_to_rep[c][ori][i];
           continue;
         }
 
-        if (ptype_of(p->board[sq]) == PAWN) {
+        if (ptype_of(x) == PAWN) {
           for (i = 0; i < 2; i++) fen[pos++] = pawn_ori_to_rep[c][ori][i];
           continue;
         }
@@ -1,6 +1,7 @@
 // Copyright (c) 2015 MIT License by 6.172 Staff
 
 #include <ctype.h>
+#include <math.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -17,6 +18,7 @@
 #include <cilk/reducer.h>
 #endif
 
+#include "./bench.h"
 #include "./eval.h"
 #include "./fen.h"
 #include "./move_gen.h"
@@ -55,6 +57,8 @@ extern int USE_NMM;
 extern int FUT_DEPTH;
 extern int TRACE_MOVES;
 extern int DETECT_DRAWS;
+extern int PARALLEL_ROOT;
+extern int PARALLEL_PV;
 
 // defined in eval.c
 extern int RANDOMIZE;
@@ -65,6 +69,7 @@ extern int KFACE;
 extern int KAGGRESSIVE;
 extern int MOBILITY;
 extern int PAWNPIN;
+extern int EVAL_CACHE;
 
 // defined in move_gen.c
 extern int USE_KO;
@@ -72,6 +77,17 @@ extern int USE_KO;
 // defined in tt.c
 extern int USE_TT;
 extern int HASH;
+extern int LAZY_CLEAR;
+extern int TT_DEPTH_SLOTS;
+extern int TT_SHARED;
+
+// parallel search mode, see the lazy SMP section below
+#define SMP_CILK 0  // parallelism from the Cilk keywords inside the search
+#define SMP_LAZY 1
+#define MAX_THREADS 64
+
+static int THREADS;   // number of search threads in lazy SMP mode
+static int SMP_MODE;  // SMP_CILK or SMP_LAZY
 
 // struct for manipulating options below
 typedef struct {
@@ -99,6 +115,7 @@ static int_options iopts[] = {
   { "pbetween",           &PBETWEEN,   0.2 * PAWN_EV_VALUE,   -PAWN_EV_VALUE, PAWN_EV_VALUE },
   { "pcentral",           &PCENTRAL,   0.05 * PAWN_EV_VALUE,  -PAWN_EV_VALUE, PAWN_EV_VALUE },
   { "hash",                   &HASH,   1024,                    1,              MAX_HASH   },
+  { "eval_cache",       &EVAL_CACHE,   0,                     0,              MAX_HASH   },
   { "draw",                   &DRAW,   -0.07 * PAWN_VALUE,    -PAWN_VALUE,    PAWN_VALUE    },
   { "randomize",         &RANDOMIZE,   0,                     0,              PAWN_EV_VALUE },
   { "lmr_r1",               &LMR_R1,   5,                     1,              MAX_NUM_MOVES },
@@ -108,12 +125,33 @@ static int_options iopts[] = {
   // debug options
   { "use_nmm",             &USE_NMM,   1,                     0,              1             },
   { "detect_draws",   &DETECT_DRAWS,   1,                     0,              1             },
+  { "parallel_root", &PARALLEL_ROOT,   0,                     0,              1             },
+  { "parallel_pv",     &PARALLEL_PV,   1,                     0,              1             },
+  { "threads",             &THREADS,   1,                     1,              MAX_THREADS   },
+  { "smp_mode",           &SMP_MODE,   SMP_CILK,              SMP_CILK,       SMP_LAZY      },
   { "use_tt",               &USE_TT,   1,                     0,              1             },
+  { "lazy_clear",       &LAZY_CLEAR,   1,                     0,              1             },
+  { "tt_depth_slots", &TT_DEPTH_SLOTS, 1,                     0,              7             },
+  { "tt_shared",         &TT_SHARED,   0,                     0,              999           },
   { "use_ko",               &USE_KO,   1,                     0,              1             },
   { "trace_moves",     &TRACE_MOVES,   0,                     0,              1             },
   { "",                        NULL,   0,                     0,              0             }
 };
 
+// Whether the option changes what eval() returns for a position.
+static bool is_eval_option(const char *name) {
+  static const char *eval_options[] = {
+    "hattack", "mobility", "kaggressive", "kface", "pawnpin", "pbetween",
+    "pcentral", NULL
+  };
+  for (int i = 0; eval_options[i] != NULL; i++) {
+    if (strcmp(name, eval_options[i]) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
 // -----------------------------------------------------------------------------
 // Printing helpers
 // -----------------------------------------------------------------------------
@@ -180,6 +218,97 @@ typedef struct {
   double tme;
 } entry_point_args;
 
+// -----------------------------------------------------------------------------
+// Lazy SMP
+// -----------------------------------------------------------------------------
+
+// With smp_mode set to SMP_LAZY, threads - 1 helper threads run their own
+// iterative deepening on the position next to the main search.  They share
+// nothing with it but the transposition table (and the move ordering
+// tables), which they fill with results the main search then finds.  Half of
+// them search one ply deeper than the main search, and each starts the root
+// moves at a different one (set_root_rotation()), so that they are ahead of
+// it rather than repeating its work.
+//
+// Each helper searches on a clock of its own with no time limit, so that
+// only the main search decides when the search stops: smp_stop() aborts the
+// helpers once the main search is done.
+//
+// This needs no runtime support beyond pthreads, so it also runs in builds
+// without Cilk (make NOCILK=1).
+//
+// https://chessprogramming.wikispaces.com/Lazy+SMP
+typedef struct {
+  pthread_t thread;
+  int id;
+  position_t position;
+  int depth;
+  uint64_t node_count;
+  searchClock clock;
+} smp_helper_args;
+
+static smp_helper_args smp_helpers[MAX_THREADS];
+static int num_smp_helpers = 0;
+static FILE *smp_out;  // where the helpers' info lines go
+
+static void *smp_helper(void *arg) {
+  smp_helper_args *helper = (smp_helper_args *) arg;
+  move_t pv;
+
+  use_search_clock(&helper->clock);
+  set_root_rotation(helper->id);
+  init_abort_timer(HUGE_VAL);
+  init_tics();
+
+  for (int d = 1; d <= helper->depth && !should_abort(); d++) {
+    // depth 1 sets up the root move list
+    int helper_depth = d + (d > 1 && (helper->id & 1));
+    if (helper_depth > helper->depth) {
+      helper_depth = helper->depth;
+    }
+    searchRoot(&helper->position, -INF, INF, helper_depth, 0, &pv,
+               &helper->node_count, smp_out);
+  }
+  release_thread_tables();
+  release_thread_counters();
+  return NULL;
+}
+
+// Starts the helper threads on a search of p to the given depth.
+static void smp_start(position_t *p, int depth) {
+  num_smp_helpers = (SMP_MODE == SMP_LAZY) ? THREADS - 1 : 0;
+  if (num_smp_helpers > 0 && smp_out == NULL) {
+    smp_out = fopen("/dev/null", "w");
+  }
+  for (int i = 0; i < num_smp_helpers; i++) {
+    smp_helper_args *helper = &smp_helpers[i];
+    helper->id = i + 1;
+    helper->position = *p;
+    helper->depth = depth;
+    helper->node_count = 0;
+    helper->clock.abortf = false;
+    if (pthread_create(&helper->thread, NULL, smp_helper, helper) != 0) {
+      num_smp_helpers = i;
+      break;
+    }
+  }
+}
+
+// Stops the helper threads and returns the number of nodes they searched.
+static uint64_t smp_stop() {
+  for (int i = 0; i < num_smp_helpers; i++) {
+    abort_search(&smp_helpers[i].clock);
+  }
+
+  uint64_t node_count = 0;
+  for (int i = 0; i < num_smp_helpers; i++) {
+    pthread_join(smp_helpers[i].thread, NULL);
+    node_count += smp_helpers[i].node_count;
+  }
+  num_smp_helpers = 0;
+  return node_count;
+}
+
 void *entry_point(void *arg) {
   move_t subpv;
 
@@ -195,14 +324,18 @@ void *entry_point(void *arg) {
 
   init_best_move_history();
   tt_age_hashtable();
+  reset_counters();
+  laser_reset_stats();
 
   init_tics();
+  smp_start(p, depth);
 
   for (int d = 1; d <= depth; d++) {  // Iterative deepening
     reset_abort();
 
     searchRoot(p, -INF, INF, d, 0, &subpv, &node_count_serial,
                 OUT);
+    merge_best_move_history();
 
     et = elapsed_time();
     bestMoveSoFar = subpv;
@@ -217,6 +350,11 @@ void *entry_point(void *arg) {
     if (et > tme * RATIO_FOR_TIMEOUT) break;
   }
 
+  uint64_t helper_node_count = smp_stop();
+  if (helper_node_count > 0) {
+    fprintf(OUT, "info string lazy smp helpers searched %" PRIu64 " nodes\n",
+            helper_node_count);
+  }
 
   // This unlock will allow the main thread lock/unlock in UCIBeginSearch to
   // proceed
@@ -243,6 +381,9 @@ void UciBeginSearch(position_t *p, int depth, double tme) {
   entry_point(&args);
   move_to_str(bestMoveSoFar, bms, MAX_CHARS_IN_MOVE);
   snprintf(theMove, MAX_CHARS_IN_MOVE, "%s", bms);
+  tt_print_stats(OUT);
+  eval_print_stats(OUT);
+  laser_print_stats(OUT);
   fprintf(OUT, "bestmove %s\n", bms);
   return;
 }
@@ -253,6 +394,11 @@ void UciBeginSearch(position_t *p, int depth, double tme) {
 
 // print help messages in uci
 void help()  {
+  printf("bench     - Time move generation, evaluation and a fixed-depth search\n");
+  printf("            over a built-in set of positions.  Possible arguments are:\n");
+  printf("            <depth>:     search depth (default 5, 0 skips the search)\n");
+  printf("            Sample usage: \n");
+  printf("                bench 6\n");
   printf("eval      - Evaluate current position.\n");
   printf("display   - Display current board state.\n");
   printf("generate  - Generate all possible moves.\n");
@@ -267,13 +413,21 @@ void help()  {
   printf("help      - Display help (this info).\n");
   printf("isready   - Ask if the UCI engine is ready, if so it echoes \"readyok\".\n");
   printf("            This is mainly used to synchronize the engine with the GUI.\n");
+  printf("loadhash  - Replace the hash table with one saved by savehash.\n");
+  printf("            Sample usage: \n");
+  printf("                loadhash opening.tt\n");
   printf("move      - Make a move for current player.\n");
   printf("            Sample usage: \n");
   printf("                move j0j1: move a piece from j0 to j1\n");
-  printf("perft     - Output the number of possible moves upto a given depth.\n");
-  printf("            Used to verify move the generator.\n");
+  printf("perft     - Output the number of possible moves upto a given depth,\n");
+  printf("            starting from the current position.\n");
+  printf("            Used to verify move the generator.  Possible arguments are:\n");
+  printf("            <depth>:     count move paths of length 1--<depth>\n");
+  printf("            divide:      also print the count of every first move\n");
+  printf("            hash <size>: cache subtree counts in a <size> MB table\n");
   printf("            Sample usage: \n");
-  printf("                depth 3: generate all possible moves for depth 1--3\n");
+  printf("                perft 3: generate all possible moves for depth 1--3\n");
+  printf("                perft 6 divide hash 256\n");
   printf("position  - Set up the board using the fenstring given.  Possible arguments are:\n");
   printf("            startpos:     set up the board with default starting position.\n");
   printf("            endgame:      set up the board with endgame configuration.\n");
@@ -282,12 +436,22 @@ void help()  {
   printf("            Sample usage: \n");
   printf("                position endgame: set up the board so that only kings remain\n");
   printf("quit      - Quit this program\n");
+  printf("savehash  - Save the hash table to a file.  Possible arguments are:\n");
+  printf("            <file>:      where to save it\n");
+  printf("            <depth>:     leave out records searched less deep than <depth>\n");
+  printf("            Sample usage: \n");
+  printf("                savehash opening.tt 6\n");
   printf("setoption - Set configuration options used in the engine, the format is: \n");
   printf("            setoption name <name> value <val>.\n");
   printf("            Use the comment \"uci\" to see possible options and their current values\n");
   printf("            Sample usage: \n");
   printf("                setoption name fut_depth value 4: set fut_depth to 4\n");
+  printf("ttstress  - Store and probe the transposition table from all workers at once\n");
+  printf("            and count torn records.  Possible arguments are:\n");
+  printf("            <rounds>:    accesses per task (default 1000000)\n");
   printf("uci       - Display UCI version and options\n");
+  printf("ucinewgame - Forget the previous game: clear the hash table.  With option\n");
+  printf("            lazy_clear set this starts a new age instead of zeroing memory.\n");
   printf("\n");
 }
 
@@ -429,6 +593,7 @@ int main(int argc, char *argv[]) {
 
 
   tt_make_hashtable(HASH);   // initial hash table
+  eval_cache_resize(EVAL_CACHE);
   fen_to_pos(&gme[ix], "");  // initialize with an actual position
 
   //  Check to make sure we don't loop infinitely if we don't get input.
@@ -541,6 +706,11 @@ int main(int argc, char *argv[]) {
         continue;
       }
 
+      if (strcmp(tok[0], "ucinewgame") == 0) {
+        tt_clear_hashtable();
+        continue;
+      }
+
       if (strcmp(tok[0], "setoption") == 0) {
         int sostate = 0;
         char  name[MAX_CHARS_IN_TOKEN];
@@ -601,13 +771,35 @@ int main(int argc, char *argv[]) {
               printf("info setting %s to %d\n", iopts[j].name, v);
               *(iopts[j].var) = v;
 
-              if (strcmp(name+1, "hash") == 0) {
+              if (strcmp(name+1, "hash") == 0 ||
+                  strcmp(name+1, "tt_shared") == 0) {
                 tt_resize_hashtable(HASH);
+                if (TT_SHARED && !tt_is_shared()) {
+                  printf("info string cannot attach shared hash table %d\n",
+                         TT_SHARED);
+                  TT_SHARED = 0;
+                }
+                // a shared table may come with its own Zobrist keys
+                for (int i = 0; i <= ix; i++) {
+                  gme[i].key = compute_zob_key(&gme[i]);
+                }
                 printf("info string Hash table set to %d records of "
                        "%zu bytes each\n",
                        tt_get_num_of_records(), tt_get_bytes_per_record());
                 printf("info string Total hash table size: %zu bytes\n",
                        tt_get_num_of_records() * tt_get_bytes_per_record());
+                printf("info string Hash table pages: %s\n", tt_get_page_type());
+                // scores cached under the old keys are lost
+                eval_cache_clear();
+              }
+              if (strcmp(name+1, "eval_cache") == 0) {
+                eval_cache_resize(EVAL_CACHE);
+                printf("info string Eval cache set to %" PRIu64 " entries\n",
+                       eval_cache_get_num_of_entries());
+              }
+              if (is_eval_option(name+1)) {
+                // scores cached under the old parameters are off now
+                eval_cache_clear();
               }
               break;
             }
@@ -695,8 +887,54 @@ int main(int argc, char *argv[]) {
         continue;
       }
 
+      if (strcmp(tok[0], "bench") == 0) {
+        int depth = 5;
+        if (token_count >= 2) {
+          depth = strtol(tok[1], (char **)NULL, 10);
+        }
+        bench(depth, OUT);
+        continue;
+      }
+
+      if (strcmp(tok[0], "savehash") == 0) {
+        if (token_count < 2) {
+          fprintf(OUT, "Second argument (file name) required.\n");
+          continue;
+        }
+        int min_depth = 0;
+        if (token_count >= 3) {
+          min_depth = strtol(tok[2], (char **)NULL, 10);
+        }
+        tt_save_hashtable(tok[1], min_depth, OUT);
+        continue;
+      }
+
+      if (strcmp(tok[0], "loadhash") == 0) {
+        if (token_count < 2) {
+          fprintf(OUT, "Second argument (file name) required.\n");
+          continue;
+        }
+        if (tt_load_hashtable(tok[1], OUT)) {
+          // the saved table comes with its own Zobrist keys
+          for (int i = 0; i <= ix; i++) {
+            gme[i].key = compute_zob_key(&gme[i]);
+          }
+          eval_cache_clear();
+        }
+        continue;
+      }
+
+      if (strcmp(tok[0], "ttstress") == 0) {  // Test the transposition table
+        int rounds = 1000000;
+        if (token_count >= 2) {
+          rounds = strtol(tok[1], (char **)NULL, 10);
+        }
+        tt_stress_test(rounds, OUT);
+        continue;
+      }
+
       if (strcmp(tok[0], "perft") == 0) {  // Test move generator
-        // Correct output to depth 4
+        // Correct output to depth 4 from the starting position
         // perft  1 78
         // perft  2 6084
         // perft  3 473126
@@ -704,10 +942,21 @@ int main(int argc, char *argv[]) {
 
 
         int depth = 4;
+        bool divide = false;
+        int hash_mb = 0;
+        int n = 1;
         if (token_count >= 2) {  // Takes a depth argument to test deeper
           depth = strtol(tok[1], (char **)NULL, 10);
+          n++;
+        }
+        for (; n < token_count; n++) {
+          if (strcmp(tok[n], "divide") == 0) {
+            divide = true;
+          } else if (strcmp(tok[n], "hash") == 0 && n + 1 < token_count) {
+            hash_mb = strtol(tok[++n], (char **)NULL, 10);
+          }
         }
-        do_perft(gme, depth, 0);
+        do_perft(&gme[ix], depth, divide, hash_mb);
         continue;
       }
 
@@ -1,6 +1,6 @@
 #!/bin/bash
 rm all.c
-for codefile in fasttime tbassert simple_mutex leiserchess search eval move_gen tt fen util
+for codefile in fasttime tbassert simple_mutex leiserchess search eval move_gen tt fen util bench
 do
 	if [ -f ${codefile}.c ]; then
 		echo '//' >> all.c 
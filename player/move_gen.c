@@ -10,24 +10,15 @@
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
 
+#include <cilk/cilk.h>
+
 #include "./eval.h"
 #include "./fen.h"
 #include "./search.h"
 #include "./tbassert.h"
+#include "./tt.h"
 #include "./util.h"
 
-// static const uint64_t sq_to_board_bit[100] = {
-// 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL,
-// 0ULL, 1ULL<<0, 1ULL<<1, 1ULL<<2, 1ULL<<3, 1ULL<<4, 1ULL<<5, 1ULL<<6, 1ULL<<7, 0ULL,
-// 0ULL, 1ULL<<8, 1ULL<<9, 1ULL<<10, 1ULL<<11, 1ULL<<12, 1ULL<<13, 1ULL<<14, 1ULL<<15, 0ULL,
-// 0ULL, 1ULL<<16, 1ULL<<17, 1ULL<<18, 1ULL<<19, 1ULL<<20, 1ULL<<21, 1ULL<<22, 1ULL<<23, 0ULL,
-// 0ULL, 1ULL<<24, 1ULL<<25, 1ULL<<26, 1ULL<<27, 1ULL<<28, 1ULL<<29, 1ULL<<30, 1ULL<<31, 0ULL,
-// 0ULL, 1ULL<<32, 1ULL<<33, 1ULL<<34, 1ULL<<35, 1ULL<<36, 1ULL<<37, 1ULL<<38, 1ULL<<39, 0ULL,
-// 0ULL, 1ULL<<40, 1ULL<<41, 1ULL<<42, 1ULL<<43, 1ULL<<44, 1ULL<<45, 1ULL<<46, 1ULL<<47, 0ULL,
-// 0ULL, 1ULL<<48, 1ULL<<49, 1ULL<<50, 1ULL<<51, 1ULL<<52, 1ULL<<53, 1ULL<<54, 1ULL<<55, 0ULL,
-// 0ULL, 1ULL<<56, 1ULL<<57, 1ULL<<58, 1ULL<<59, 1ULL<<60, 1ULL<<61, 1ULL<<62, 1ULL<<63, 0ULL,
-// 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL};
-
 int USE_KO;  // Respect the Ko rule
 
 static const char *color_strs[2] = {"White", "Black"};
@@ -40,6 +31,57 @@ const char *color_to_str(color_t c) {
 // Piece getters and setters (including color, ptype, orientation)
 // -----------------------------------------------------------------------------
 
+// Orientation of the Pawn on sq, read off the per-orientation Pawn sets.
+// NE and SW have bit 0 set, SE and SW have bit 1 set.
+static inline int pawn_ori_at(position_t *p, square_t sq) {
+  return (((p->pawn[NE] | p->pawn[SW]) >> sq) & 1) |
+         ((((p->pawn[SE] | p->pawn[SW]) >> sq) & 1) << 1);
+}
+
+// Orientation of the piece on sq (which must be occupied).
+int ori_at(position_t *p, square_t sq) {
+  if (sq == p->kloc[WHITE]) {
+    return p->kori[WHITE];
+  }
+  if (sq == p->kloc[BLACK]) {
+    return p->kori[BLACK];
+  }
+  return pawn_ori_at(p, sq);
+}
+
+// Rebuilds the piece_t encoding of whatever stands on sq (0 if empty).
+piece_t piece_at(position_t *p, square_t sq) {
+  uint64_t bit = square_bit(sq);
+  if (!((p->mask[WHITE] | p->mask[BLACK]) & bit)) {
+    return 0;
+  }
+  color_t c = (p->mask[WHITE] & bit) ? WHITE : BLACK;
+  if (sq == p->kloc[c]) {
+    return (c << COLOR_SHIFT) | (KING << PTYPE_SHIFT) |
+           (p->kori[c] << ORI_SHIFT);
+  }
+  return (c << COLOR_SHIFT) | (PAWN << PTYPE_SHIFT) |
+         (pawn_ori_at(p, sq) << ORI_SHIFT);
+}
+
+// Checks the bitboard invariants: colors and Pawn orientations are disjoint,
+// and every piece is either a Pawn or a King.  (A zapped King leaves kloc
+// behind, so Kings only need to be on the board if they are still occupied.)
+bool board_is_consistent(position_t *p) {
+  uint64_t pawns = 0;
+  for (int ori = 0; ori < NUM_ORI; ori++) {
+    if (pawns & p->pawn[ori]) {
+      return false;
+    }
+    pawns |= p->pawn[ori];
+  }
+  uint64_t occupied = p->mask[WHITE] | p->mask[BLACK];
+  uint64_t kings = (square_bit(p->kloc[WHITE]) | square_bit(p->kloc[BLACK])) &
+                   occupied;
+  return !(p->mask[WHITE] & p->mask[BLACK]) && !(pawns & kings) &&
+         (pawns | kings) == occupied;
+}
+
 // -----------------------------------------------------------------------------
 // Piece orientation strings
 // -----------------------------------------------------------------------------
@@ -63,20 +105,16 @@ static const char *pawn_ori_to_rep[2][NUM_ORI] = { { "NW", "NE", "SE", "SW" },
 // https://chessprogramming.wikispaces.com/Zobrist+Hashing
 //
 // NOTE: Zobrist hashing uses piece_t as an integer index into to the zob table.
-// So if you change your piece representation, you'll need to recompute what the
-// old piece representation is when indexing into the zob table to get the same
-// node counts.
-static uint64_t   zob[ARR_SIZE][1<<PIECE_SIZE];
+// The board itself is kept in bitboards, so piece_at() recomputes the piece_t
+// encoding of a square when the key has to be updated.
+static uint64_t   zob[NUM_SQUARES][1<<PIECE_SIZE];
 static uint64_t   zob_color;
 uint64_t myrand();
 
 uint64_t compute_zob_key(position_t *p) {
   uint64_t key = 0;
-  for (fil_t f = 0; f < BOARD_WIDTH; f++) {
-    for (rnk_t r = 0; r < BOARD_WIDTH; r++) {
-      square_t sq = square_of(f, r);
-      key ^= zob[sq][p->board[sq]];
-    }
+  for (square_t sq = 0; sq < NUM_SQUARES; sq++) {
+    key ^= zob[sq][piece_at(p, sq)];
   }
   if (color_to_move_of(p) == BLACK)
     key ^= zob_color;
@@ -84,20 +122,8 @@ uint64_t compute_zob_key(position_t *p) {
   return key;
 }
 
-uint64_t compute_mask(position_t *p, color_t color) {
-  uint64_t key = 0;
-  for (fil_t f = 0; f < BOARD_WIDTH; f++) {
-    for (rnk_t r = 0; r < BOARD_WIDTH; r++) {
-      square_t sq = square_of(f, r);
-      if (p->board[sq] && color_of(p->board[sq]) == color)
-        key |= (1ULL << (f << 3) << r);
-    }
-  }
-  return key;
-}
-
 void init_zob() {
-  for (int i = 0; i < ARR_SIZE; i++) {
+  for (int i = 0; i < NUM_SQUARES; i++) {
     for (int j = 0; j < (1 << PIECE_SIZE); j++) {
       zob[i][j] = myrand();
     }
@@ -105,6 +131,19 @@ void init_zob() {
   zob_color = myrand();
 }
 
+// Copies the Zobrist table out to / in from ZOB_NUM_KEYS keys.  The keys are
+// random for every run of the engine, so anything keyed by them that is kept
+// across runs (a saved transposition table) has to carry them along.
+void zob_export(uint64_t *keys) {
+  memcpy(keys, zob, sizeof(zob));
+  keys[ZOB_NUM_KEYS - 1] = zob_color;
+}
+
+void zob_import(const uint64_t *keys) {
+  memcpy(zob, keys, sizeof(zob));
+  zob_color = keys[ZOB_NUM_KEYS - 1];
+}
+
 // -----------------------------------------------------------------------------
 // Squares
 // -----------------------------------------------------------------------------
@@ -167,65 +206,46 @@ void move_to_str(move_t mv, char *buf, size_t bufsize) {
 
 int generate_all(position_t *p, sortable_move_t *sortable_move_list,
                  bool strict) {
-  tbassert(p->mask[0] == compute_mask(p, 0),
-           "p->mask: %"PRIu64", mask: %"PRIu64"\n",
-           p->mask[0], compute_mask(p, 0));
-  tbassert(p->mask[1] == compute_mask(p, 1),
-           "p->mask: %"PRIu64", mask: %"PRIu64"\n",
-           p->mask[1], compute_mask(p, 1));
+  tbassert(board_is_consistent(p), "inconsistent board\n");
   color_t color_to_move = color_to_move_of(p);
-  // Make sure that the enemy_laser map is marked
-  // char laser_map[ARR_SIZE];
-  
-  // memcpy(laser_map, laser_map_s, sizeof laser_map);
-  
-  // 1 = path of laser with no moves
-  // mark_laser_path(p, opp_color(color_to_move), laser_map, 1);
-  // uint64_t laser_map = mark_laser_path_bit(p, opp_color(color_to_move));
+  // Pieces on the enemy laser path cannot move.
   int move_count = 0;
   uint64_t mask = p -> mask[color_to_move] & ~p -> laser[opp_color(color_to_move)];
   while (mask) {
     uint64_t y = mask & (-mask);
     mask ^= y;
-    int i = LOG2(y);
-    fil_t f = (i >> 3);
-    rnk_t r = i & 7;
-
-    square_t sq = (f + FIL_ORIGIN) * ARR_WIDTH + r + RNK_ORIGIN;
-    piece_t x = p->board[sq];
-
-    ptype_t typ = ptype_of(x);
-    // color_t color = color_of(x);
-
-    if (typ == PAWN || typ == KING) {
-      for (int d = 0; d < 8; d++) {
-        int dest = sq + dir_of(d);
-        // Skip moves into invalid squares
-        if (ptype_of(p->board[dest]) == INVALID) {
-          continue;    // illegal square
-        }
-        WHEN_DEBUG_VERBOSE(char buf[MAX_CHARS_IN_MOVE]);
-        WHEN_DEBUG_VERBOSE({
-          move_to_str(move_of(typ, (rot_t) 0, sq, dest), buf, MAX_CHARS_IN_MOVE);
-          DEBUG_LOG(1, "Before: %s ", buf);
-        });
-        tbassert(move_count < MAX_NUM_MOVES, "move_count: %d\n", move_count);
-        sortable_move_list[move_count++] = move_of(typ, (rot_t) 0, sq, dest);
-        WHEN_DEBUG_VERBOSE({
-          move_to_str(get_move(sortable_move_list[move_count-1]), buf, MAX_CHARS_IN_MOVE);
-          DEBUG_LOG(1, "After: %s\n", buf);
-        });
-      }
+    square_t sq = LOG2(y);
+
+    ptype_t typ = (sq == p->kloc[color_to_move]) ? KING : PAWN;
+
+    // Destinations come out in increasing square order, which is the order
+    // the old direction table produced them in.
+    uint64_t dests = neighbors_of(sq);
+    while (dests) {
+      uint64_t z = dests & (-dests);
+      dests ^= z;
+      square_t dest = LOG2(z);
+      WHEN_DEBUG_VERBOSE(char buf[MAX_CHARS_IN_MOVE]);
+      WHEN_DEBUG_VERBOSE({
+        move_to_str(move_of(typ, (rot_t) 0, sq, dest), buf, MAX_CHARS_IN_MOVE);
+        DEBUG_LOG(1, "Before: %s ", buf);
+      });
+      tbassert(move_count < MAX_NUM_MOVES, "move_count: %d\n", move_count);
+      sortable_move_list[move_count++] = move_of(typ, (rot_t) 0, sq, dest);
+      WHEN_DEBUG_VERBOSE({
+        move_to_str(get_move(sortable_move_list[move_count-1]), buf, MAX_CHARS_IN_MOVE);
+        DEBUG_LOG(1, "After: %s\n", buf);
+      });
+    }
 
-      // rotations - three directions possible
-      for (int rot = 1; rot < 4; ++rot) {
-        tbassert(move_count < MAX_NUM_MOVES, "move_count: %d\n", move_count);
-        sortable_move_list[move_count++] = move_of(typ, (rot_t) rot, sq, sq);
-      }
-      if (typ == KING) {  // Also generate null move
-        tbassert(move_count < MAX_NUM_MOVES, "move_count: %d\n", move_count);
-        sortable_move_list[move_count++] = move_of(typ, (rot_t) 0, sq, sq);
-      }
+    // rotations - three directions possible
+    for (int rot = 1; rot < 4; ++rot) {
+      tbassert(move_count < MAX_NUM_MOVES, "move_count: %d\n", move_count);
+      sortable_move_list[move_count++] = move_of(typ, (rot_t) rot, sq, sq);
+    }
+    if (typ == KING) {  // Also generate null move
+      tbassert(move_count < MAX_NUM_MOVES, "move_count: %d\n", move_count);
+      sortable_move_list[move_count++] = move_of(typ, (rot_t) 0, sq, sq);
     }
   }
 
@@ -242,50 +262,97 @@ int generate_all(position_t *p, sortable_move_t *sortable_move_list,
   return move_count;
 }
 
+// Generates only the moves that can change what the laser of the side to move
+// hits: every move of a piece standing in the beam, and every move onto a
+// beam square.  Any other move leaves the beam where it is, so it zaps
+// nothing unless the beam already ends on a piece (kill_d), in which case all
+// moves are generated.  Used by quiescence search, which only looks at zaps.
+int generate_zaps(position_t *p, sortable_move_t *sortable_move_list,
+                  bool strict) {
+  tbassert(board_is_consistent(p), "inconsistent board\n");
+  color_t color_to_move = color_to_move_of(p);
+  if (p->kill_d[color_to_move]) {
+    return generate_all(p, sortable_move_list, strict);
+  }
+
+  uint64_t beam = p->laser[color_to_move];
+  int move_count = 0;
+  // Pieces on the enemy laser path cannot move.
+  uint64_t mask = p->mask[color_to_move] & ~p->laser[opp_color(color_to_move)];
+  while (mask) {
+    uint64_t y = mask & (-mask);
+    mask ^= y;
+    square_t sq = LOG2(y);
+
+    ptype_t typ = (sq == p->kloc[color_to_move]) ? KING : PAWN;
+    bool in_beam = (beam & y) != 0;
+
+    uint64_t dests = neighbors_of(sq);
+    if (!in_beam) {
+      dests &= beam;
+    }
+    while (dests) {
+      uint64_t z = dests & (-dests);
+      dests ^= z;
+      tbassert(move_count < MAX_NUM_MOVES, "move_count: %d\n", move_count);
+      sortable_move_list[move_count++] = move_of(typ, (rot_t) 0, sq, LOG2(z));
+    }
+
+    if (in_beam) {
+      // rotations - three directions possible
+      for (int rot = 1; rot < 4; ++rot) {
+        tbassert(move_count < MAX_NUM_MOVES, "move_count: %d\n", move_count);
+        sortable_move_list[move_count++] = move_of(typ, (rot_t) rot, sq, sq);
+      }
+      if (typ == KING) {  // Also generate null move
+        tbassert(move_count < MAX_NUM_MOVES, "move_count: %d\n", move_count);
+        sortable_move_list[move_count++] = move_of(typ, (rot_t) 0, sq, sq);
+      }
+    }
+  }
+
+  return move_count;
+}
+
 // -----------------------------------------------------------------------------
 // Move execution
 // -----------------------------------------------------------------------------
 
+// Returns the first occupied square a beam leaving sq in direction bdir runs
+// into, or NO_SQUARE if the beam leaves the board first.  The beam jumps
+// straight there instead of stepping over the empty squares in between.
+square_t laser_hit(square_t sq, int bdir, uint64_t occupied) {
+  uint64_t hits = laser_ray_of(sq, bdir) & occupied;
+  if (!hits) {
+    return NO_SQUARE;
+  }
+  return (bdir == NN || bdir == EE) ? LOG2(hits) : MSB(hits);
+}
+
 // Returns the square of piece that would be zapped by the laser if fired once,
-// or 0 if no such piece exists.
+// or NO_SQUARE if no such piece exists.
 //
 // p : Current board state.
 // c : Color of king shooting laser.
 static inline square_t fire_laser(position_t *p, color_t c) {
-  tbassert(p->mask[0] == compute_mask(p, 0),
-           "p->mask: %"PRIu64", mask: %"PRIu64"\n",
-           p->mask[0], compute_mask(p, 0));
-  tbassert(p->mask[1] == compute_mask(p, 1),
-           "p->mask: %"PRIu64", mask: %"PRIu64"\n",
-           p->mask[1], compute_mask(p, 1));
-  // color_t fake_color_to_move = (color_to_move_of(p) == WHITE) ? BLACK : WHITE;0
+  tbassert(board_is_consistent(p), "inconsistent board\n");
   square_t sq = p->kloc[c];
-  int bdir = ori_of(p->board[sq]);
+  int bdir = p->kori[c];
+  uint64_t occupied = p->mask[WHITE] | p->mask[BLACK];
 
-  tbassert(ptype_of(p->board[sq]) == KING,
-           "ptype: %d\n", ptype_of(p->board[sq]));
+  tbassert(occupied & square_bit(sq), "sq: %d\n", sq);
 
   while (true) {
-    sq += beam_of(bdir);
-    tbassert(sq < ARR_SIZE && sq >= 0, "sq: %d\n", sq);
-    switch (ptype_of(p->board[sq])) {
-      case EMPTY:  // empty square
-        break;
-      case PAWN:  // Pawn
-        bdir = reflect_of(bdir, ori_of(p->board[sq]));
-        if (bdir < 0) {  // Hit back of Pawn
-          return sq;
-        }
-        break;
-      case KING:  // King
-        return sq;  // sorry, game over my friend!
-        break;
-      case INVALID:  // Ran off edge of board
-        return 0;
-        break;
-      // default:  // Shouldna happen, man!
-      //   // tbassert(false, "Like porkchops and whipped cream.\n");
-      //   break;
+    sq = laser_hit(sq, bdir, occupied);
+    if (sq == NO_SQUARE) {  // Ran off edge of board
+      return NO_SQUARE;
+    }
+    if (sq == p->kloc[WHITE] || sq == p->kloc[BLACK]) {  // King
+      return sq;  // sorry, game over my friend!
+    }
+    bdir = reflect_of(bdir, pawn_ori_at(p, sq));  // Pawn
+    if (bdir < 0) {  // Hit back of Pawn
+      return sq;
     }
   }
 }
@@ -298,6 +365,66 @@ static inline square_t fire_laser(position_t *p, color_t c) {
 //   return false;
 // }
 
+// Moves (or rotates) the piece of mv on p itself and updates the hash key.
+// A translation swaps the contents of the two squares, so applying a move
+// from to_sq back to from_sq takes it back; likewise for the opposite
+// rotation.
+static inline void apply_move(position_t *p, move_t mv) {
+  square_t from_sq = from_square(mv);
+  square_t to_sq = to_square(mv);
+  rot_t rot = rot_of(mv);
+
+  tbassert(from_sq < NUM_SQUARES, "from_sq: %d\n", from_sq);
+  tbassert(to_sq < NUM_SQUARES, "to_sq: %d\n", to_sq);
+  tbassert(board_is_consistent(p), "inconsistent board\n");
+
+  p->key ^= zob_color;   // swap color to move
+
+  piece_t from_piece = piece_at(p, from_sq);
+  piece_t to_piece = piece_at(p, to_sq);
+
+  if (to_sq != from_sq) {  // move, not rotation
+    // Hash key updates
+    p->key ^= zob[from_sq][from_piece];  // remove from_piece from from_sq
+    p->key ^= zob[to_sq][to_piece];  // remove to_piece from to_sq
+
+    p->key ^= zob[to_sq][from_piece];  // place from_piece in to_sq
+    p->key ^= zob[from_sq][to_piece];  // place to_piece in from_sq
+
+    // swap from_piece and to_piece on board: every set that holds exactly one
+    // of the two pieces gets both squares flipped.
+    uint64_t tmp = square_bit(from_sq) ^ square_bit(to_sq);
+    p->mask[color_of(from_piece)] ^= tmp;
+    if (to_piece)
+      p->mask[color_of(to_piece)] ^= tmp;
+
+    // Update King locations and Pawn sets
+    if (ptype_of(from_piece) == KING) {
+      p->kloc[color_of(from_piece)] = to_sq;
+    } else {
+      p->pawn[ori_of(from_piece)] ^= tmp;
+    }
+    if (ptype_of(to_piece) == KING) {
+      p->kloc[color_of(to_piece)] = from_sq;
+    } else if (to_piece) {
+      p->pawn[ori_of(to_piece)] ^= tmp;
+    }
+
+  } else {  // rotation
+    // remove from_piece from from_sq in hash
+    p->key ^= zob[from_sq][from_piece];
+    int ori = ORI_MASK & (rot + ori_of(from_piece));
+    if (ptype_of(from_piece) == KING) {
+      p->kori[color_of(from_piece)] = ori;
+    } else {
+      p->pawn[ori_of(from_piece)] ^= square_bit(from_sq);
+      p->pawn[ori] ^= square_bit(from_sq);
+    }
+    set_ori(&from_piece, ori);  // rotate from_piece
+    p->key ^= zob[from_sq][from_piece];              // ... and in hash
+  }
+}
+
 void low_level_make_move(position_t *old, position_t *p, move_t mv) {
   tbassert(mv != 0, "mv was zero.\n");
 
@@ -310,12 +437,7 @@ void low_level_make_move(position_t *old, position_t *p, move_t mv) {
   tbassert(old->key == compute_zob_key(old),
            "old->key: %"PRIu64", zob-key: %"PRIu64"\n",
            old->key, compute_zob_key(old));
-  tbassert(old->mask[0] == compute_mask(old, 0),
-           "old->key: %"PRIu64", zob-key: %"PRIu64"\n",
-           old->mask[0], compute_mask(old, 0));
-  tbassert(old->mask[1] == compute_mask(old, 1),
-           "old->key: %"PRIu64", zob-key: %"PRIu64"\n",
-           old->mask[1], compute_mask(old, 1));
+  tbassert(board_is_consistent(old), "inconsistent board\n");
 
 
   WHEN_DEBUG_VERBOSE({
@@ -323,11 +445,10 @@ void low_level_make_move(position_t *old, position_t *p, move_t mv) {
       display(old);
     });
 
-  square_t from_sq = from_square(mv);
-  square_t to_sq = to_square(mv);
-  rot_t rot = rot_of(mv);
-
   WHEN_DEBUG_VERBOSE({
+      square_t from_sq = from_square(mv);
+      square_t to_sq = to_square(mv);
+      rot_t rot = rot_of(mv);
       DEBUG_LOG(1, "low_level_make_move 2:\n");
       square_to_str(from_sq, buf, MAX_CHARS_IN_MOVE);
       DEBUG_LOG(1, "from_sq: %s\n", buf);
@@ -357,64 +478,7 @@ void low_level_make_move(position_t *old, position_t *p, move_t mv) {
   p->history = old;
   p->last_move = mv;
 
-  tbassert(from_sq < ARR_SIZE && from_sq > 0, "from_sq: %d\n", from_sq);
-  tbassert(p->board[from_sq] < (1 << PIECE_SIZE) && p->board[from_sq] >= 0,
-           "p->board[from_sq]: %d\n", p->board[from_sq]);
-  tbassert(to_sq < ARR_SIZE && to_sq > 0, "to_sq: %d\n", to_sq);
-  tbassert(p->board[to_sq] < (1 << PIECE_SIZE) && p->board[to_sq] >= 0,
-           "p->board[to_sq]: %d\n", p->board[to_sq]);
-  tbassert(p->mask[0] == compute_mask(p, 0),
-           "p->mask: %"PRIu64", mask: %"PRIu64"\n",
-           p->mask[0], compute_mask(p, 0));
-  tbassert(p->mask[1] == compute_mask(p, 1),
-           "p->mask: %"PRIu64", mask: %"PRIu64"\n",
-           p->mask[1], compute_mask(p, 1));
-
-  p->key ^= zob_color;   // swap color to move
-
-  piece_t from_piece = p->board[from_sq];
-  piece_t to_piece = p->board[to_sq];
-
-    
-  // printf("?? %d %d\n", from_sq, to_sq);
-
-  if (to_sq != from_sq) {  // move, not rotation
-    // Hash key updates
-    p->key ^= zob[from_sq][from_piece];  // remove from_piece from from_sq
-    p->key ^= zob[to_sq][to_piece];  // remove to_piece from to_sq
-
-    p->board[to_sq] = from_piece;  // swap from_piece and to_piece on board
-    p->board[from_sq] = to_piece;
-
-    p->key ^= zob[to_sq][from_piece];  // place from_piece in to_sq
-    p->key ^= zob[from_sq][to_piece];  // place to_piece in from_sq
-
-    // if (!to_piece) {
-
-    uint64_t tmp = sq_to_board_bit[from_sq] ^ sq_to_board_bit[to_sq];
-    p->mask[color_of(from_piece)] ^= tmp;
-    if (to_piece)
-      p->mask[color_of(to_piece)] ^= tmp;
-    // }
-    // if ()
-    // Update King locations if necessary
-    if (ptype_of(from_piece) == KING) {
-      p->kloc[color_of(from_piece)] = to_sq;
-    }
-    if (ptype_of(to_piece) == KING) {
-      p->kloc[color_of(to_piece)] = from_sq;
-    }
-
-  } else {  // rotation
-    // remove from_piece from from_sq in hash
-    p->key ^= zob[from_sq][from_piece];
-    set_ori(&from_piece, rot + ori_of(from_piece));  // rotate from_piece
-    p->board[from_sq] = from_piece;  // place rotated piece on board
-    p->key ^= zob[from_sq][from_piece];              // ... and in hash
-  }
-
-  // p->laser[0] = mark_laser_path_bit(p, 0);
-  // p->laser[1] = mark_laser_path_bit(p, 1);
+  apply_move(p, mv);
 
   // Increment ply
   p->ply++;
@@ -423,12 +487,7 @@ void low_level_make_move(position_t *old, position_t *p, move_t mv) {
            "p->key: %"PRIu64", zob-key: %"PRIu64"\n",
            p->key, compute_zob_key(p));
 
-  tbassert(p->mask[0] == compute_mask(p, 0),
-           "p->mask: %"PRIu64", mask: %"PRIu64"\n",
-           p->mask[0], compute_mask(p, 0));
-  tbassert(p->mask[1] == compute_mask(p, 1),
-           "p->mask: %"PRIu64", mask: %"PRIu64"\n",
-           p->mask[1], compute_mask(p, 1));
+  tbassert(board_is_consistent(p), "inconsistent board\n");
 
   WHEN_DEBUG_VERBOSE({
       fprintf(stderr, "After:\n");
@@ -436,6 +495,20 @@ void low_level_make_move(position_t *old, position_t *p, move_t mv) {
     });
 }
 
+// Whether two positions have the same pieces on the same squares.  The board
+// is a handful of words, so this ORs together their differences instead of
+// branching on each one; the compiler turns it into a few vector compares.
+// Callers test the hash keys first, which almost always differ.
+static inline bool same_board(position_t *a, position_t *b) {
+  uint64_t diff = (a->mask[WHITE] ^ b->mask[WHITE]) |
+                  (a->mask[BLACK] ^ b->mask[BLACK]) |
+                  (a->pawn[NW] ^ b->pawn[NW]) | (a->pawn[NE] ^ b->pawn[NE]) |
+                  (a->pawn[SE] ^ b->pawn[SE]) | (a->pawn[SW] ^ b->pawn[SW]);
+  diff |= (a->kloc[WHITE] ^ b->kloc[WHITE]) | (a->kloc[BLACK] ^ b->kloc[BLACK]) |
+          (a->kori[WHITE] ^ b->kori[WHITE]) | (a->kori[BLACK] ^ b->kori[BLACK]);
+  return diff == 0;
+}
+
 // return victim pieces or KO
 victims_t make_move(position_t *old, position_t *p, move_t mv) {
 
@@ -447,37 +520,34 @@ victims_t make_move(position_t *old, position_t *p, move_t mv) {
   low_level_make_move(old, p, mv);
 
   // move phase 2 - shooting the laser
-  square_t victim_sq = 0;
+  square_t victim_sq = NO_SQUARE;
   p->victims = 0;
   
   // static int count = 0, cnt = 0;
   // count += 1;
 
   
-  while ((victim_sq = fire_laser(p, color_to_move_of(old)))) {
+  while ((victim_sq = fire_laser(p, color_to_move_of(old))) != NO_SQUARE) {
     WHEN_DEBUG_VERBOSE({
         square_to_str(victim_sq, buf, MAX_CHARS_IN_MOVE);
         DEBUG_LOG(1, "Zapping piece on %s\n", buf);
       });
 
     // we definitely hit something with laser, remove it from board
-    piece_t victim_piece = p->board[victim_sq];
+    piece_t victim_piece = piece_at(p, victim_sq);
     p->victims ++;
     p->victims |= 16 << color_of(victim_piece);
     p->key ^= zob[victim_sq][victim_piece];
-    p->board[victim_sq] = 0;
     p->key ^= zob[victim_sq][0];
-    p->mask[color_of(victim_piece)] ^= sq_to_board_bit[victim_sq];
+    p->mask[color_of(victim_piece)] ^= square_bit(victim_sq);
+    if (ptype_of(victim_piece) == PAWN) {
+      p->pawn[ori_of(victim_piece)] ^= square_bit(victim_sq);
+    }
     
     tbassert(p->key == compute_zob_key(p),
              "p->key: %"PRIu64", zob-key: %"PRIu64"\n",
              p->key, compute_zob_key(p));
-    tbassert(p->mask[0] == compute_mask(p, 0),
-           "p->mask: %"PRIu64", mask: %"PRIu64"\n",
-           p->mask[0], compute_mask(p, 0));
-    tbassert(p->mask[1] == compute_mask(p, 1),
-           "p->mask: %"PRIu64", mask: %"PRIu64"\n",
-           p->mask[1], compute_mask(p, 1));
+    tbassert(board_is_consistent(p), "inconsistent board\n");
 
     WHEN_DEBUG_VERBOSE({
         square_to_str(victim_sq, buf, MAX_CHARS_IN_MOVE);
@@ -498,31 +568,12 @@ victims_t make_move(position_t *old, position_t *p, move_t mv) {
   // square_t to_sq = to_square(mv);
 
   if (USE_KO) {  // Ko rule
-    if (p->key == (old->key ^ zob_color) && p->mask[0] == old->mask[0] && p->mask[1] == old->mask[1]) {
-      bool match = true;
-
-
-      for (fil_t f = FIL_ORIGIN * ARR_WIDTH; f < FIL_ORIGIN * ARR_WIDTH + BOARD_WIDTH * ARR_WIDTH; f += ARR_WIDTH) {
-        for (rnk_t r = f + RNK_ORIGIN; r < f + RNK_ORIGIN + BOARD_WIDTH; ++r) {
-          if (p -> board[r] != old -> board[r])
-            match = false;
-        }
-      }
-
-      if (match) return KO();
+    if (p->key == (old->key ^ zob_color) && same_board(p, old)) {
+      return KO();
     }
 
-    if (p->key == old->history->key && p->mask[0] == old->history->mask[0] && p->mask[1] == old->history->mask[1]) {
-      bool match = true;
-
-      for (fil_t f = FIL_ORIGIN * ARR_WIDTH; f < FIL_ORIGIN * ARR_WIDTH + BOARD_WIDTH * ARR_WIDTH; f += ARR_WIDTH) {
-        for (rnk_t r = f + RNK_ORIGIN; r < f + RNK_ORIGIN + BOARD_WIDTH; ++r) {
-          if (p -> board[r] != old -> history -> board[r])
-            match = false;
-        }
-      }
-
-      if (match) return KO();
+    if (p->key == old->history->key && same_board(p, old->history)) {
+      return KO();
     }
   }
   // printf("in\n");
@@ -534,6 +585,49 @@ victims_t make_move(position_t *old, position_t *p, move_t mv) {
   return p->victims;
 }
 
+// How many laser paths update_laser_paths() was asked for, and how many of
+// those it could copy from the parent position instead of recomputing.  Reset
+// when a search starts.  Only kept in STATS builds (see util.h).
+static struct {
+  uint64_t updates, skipped;
+} laser_stats;
+
+#define LASER_COUNT(field, n) \
+  WHEN_STATS(__atomic_fetch_add(&laser_stats.field, (n), __ATOMIC_RELAXED))
+
+void laser_reset_stats() {
+  memset(&laser_stats, 0, sizeof(laser_stats));
+}
+
+void laser_print_stats(FILE *OUT) {
+  if (!STATS) {
+    return;
+  }
+  double skip_rate = laser_stats.updates ?
+      100.0 * laser_stats.skipped / laser_stats.updates : 0.0;
+  fprintf(OUT, "info string laser paths %" PRIu64 " recomputations skipped %"
+          PRIu64 " (%.1f%%)\n", laser_stats.updates, laser_stats.skipped,
+          skip_rate);
+}
+
+// Brings p->laser[] (and p->kill_d[]), which still hold the paths of the
+// parent position, up to date.  A laser path only depends on what stands on
+// its own squares, so a color keeps its old path unless the move touched one
+// of them: the from/to squares (which also covers a King moving or rotating,
+// and a piece stepping into the beam) and the squares of the zapped pieces.
+static inline void update_laser_paths(position_t *p, uint64_t touched) {
+  for (int c = WHITE; c <= BLACK; c++) {
+    if (p->laser[c] & touched) {
+      p->laser[c] = mark_laser_path_bit(p, c);
+    } else {
+      LASER_COUNT(skipped, 1);
+    }
+    tbassert(p->laser[c] == mark_laser_path_bit(p, c),
+             "stale laser path for color %d\n", c);
+  }
+  LASER_COUNT(updates, 2);
+}
+
 victims_t make_move2(position_t *old, position_t *p, move_t mv) {
 
   tbassert(mv != 0, "mv was zero.\n");
@@ -542,40 +636,43 @@ victims_t make_move2(position_t *old, position_t *p, move_t mv) {
 
   // move phase 1 - moving a piece
   low_level_make_move(old, p, mv);
+
+  // The search probes the table for the child next, and then evaluates it.
+  // Unless the laser zaps something, the key is final now; fetch its set and
+  // its eval cache entry while the laser is fired.
+  tt_prefetch(p->key);
+  eval_cache_prefetch(p->key);
   
   //================================================
 
   // move phase 2 - shooting the laser
-  square_t victim_sq = 0;
+  square_t victim_sq = NO_SQUARE;
   p->victims = 0;
   
   // static int count = 0, cnt = 0;
   // count += 1;
 
-  while ((victim_sq = fire_laser(p, color_to_move_of(old)))) {
+  while ((victim_sq = fire_laser(p, color_to_move_of(old))) != NO_SQUARE) {
     WHEN_DEBUG_VERBOSE({
         square_to_str(victim_sq, buf, MAX_CHARS_IN_MOVE);
         DEBUG_LOG(1, "Zapping piece on %s\n", buf);
       });
 
     // we definitely hit something with laser, remove it from board
-    piece_t victim_piece = p->board[victim_sq];
+    piece_t victim_piece = piece_at(p, victim_sq);
     p->victims ++;
     p->victims |= 16 << color_of(victim_piece);
     p->key ^= zob[victim_sq][victim_piece];
-    p->board[victim_sq] = 0;
     p->key ^= zob[victim_sq][0];
-    p->mask[color_of(victim_piece)] ^= sq_to_board_bit[victim_sq];
+    p->mask[color_of(victim_piece)] ^= square_bit(victim_sq);
+    if (ptype_of(victim_piece) == PAWN) {
+      p->pawn[ori_of(victim_piece)] ^= square_bit(victim_sq);
+    }
     
     tbassert(p->key == compute_zob_key(p),
              "p->key: %"PRIu64", zob-key: %"PRIu64"\n",
              p->key, compute_zob_key(p));
-    tbassert(p->mask[0] == compute_mask(p, 0),
-           "p->mask: %"PRIu64", mask: %"PRIu64"\n",
-           p->mask[0], compute_mask(p, 0));
-    tbassert(p->mask[1] == compute_mask(p, 1),
-           "p->mask: %"PRIu64", mask: %"PRIu64"\n",
-           p->mask[1], compute_mask(p, 1));
+    tbassert(board_is_consistent(p), "inconsistent board\n");
 
     WHEN_DEBUG_VERBOSE({
         square_to_str(victim_sq, buf, MAX_CHARS_IN_MOVE);
@@ -595,46 +692,163 @@ victims_t make_move2(position_t *old, position_t *p, move_t mv) {
   // square_t to_sq = to_square(mv);
 
   if (USE_KO) {  // Ko rule
-    if (p->key == (old->key ^ zob_color) && p->mask[0] == old->mask[0] && p->mask[1] == old->mask[1]) {
-      bool match = true;
+    if (p->key == (old->key ^ zob_color) && same_board(p, old)) {
+      return KO();
+    }
 
+    if (p->key == old->history->key && same_board(p, old->history)) {
+      return KO();
+    }
+  }
 
-      for (fil_t f = FIL_ORIGIN * ARR_WIDTH; f < FIL_ORIGIN * ARR_WIDTH + BOARD_WIDTH * ARR_WIDTH; f += ARR_WIDTH) {
-        for (rnk_t r = f + RNK_ORIGIN; r < f + RNK_ORIGIN + BOARD_WIDTH; ++r) {
-          if (p -> board[r] != old -> board[r])
-            match = false;
-        }
-      }
+  // the laser paths are stale only if the move touched them
+  if (!(p->victims & 128)) {
+    uint64_t touched = square_bit(from_square(mv)) | square_bit(to_square(mv)) |
+        ((old->mask[WHITE] | old->mask[BLACK]) ^ (p->mask[WHITE] | p->mask[BLACK]));
+    update_laser_paths(p, touched);
+  }
+  return p->victims;
+}
 
-      if (match) return KO();
-    }
+// -----------------------------------------------------------------------------
+// In-place move execution
+// -----------------------------------------------------------------------------
 
-    if (p->key == old->history->key && p->mask[0] == old->history->mask[0] && p->mask[1] == old->history->mask[1]) {
-      bool match = true;
+// make_move() and make_move2() build the child in a second position_t and
+// chain it through history, which the search needs: every spawned child owns
+// its board, and the Ko rule compares against the earlier boards.  Perft
+// needs neither, so it makes the move on the board itself and takes it back
+// with unmake_move().
+//
+// Moves and rotations are their own undo (see apply_move), so the undo record
+// only has to remember what the laser destroyed and the state derived from
+// the board.
+
+// Moves the piece and fires the laser on p itself, remembering in undo
+// everything that unmake_move() needs.  Lasers and Ko are left alone.
+static inline victims_t do_move_in_place(position_t *p, move_t mv,
+                                         undo_t *undo) {
+  tbassert(mv != 0, "mv was zero.\n");
+  color_t c = color_to_move_of(p);
+
+  undo->key = p->key;
+  undo->last_move = p->last_move;
+  undo->victims = p->victims;
+  undo->laser[WHITE] = p->laser[WHITE];
+  undo->laser[BLACK] = p->laser[BLACK];
+  undo->kill_d[WHITE] = p->kill_d[WHITE];
+  undo->kill_d[BLACK] = p->kill_d[BLACK];
+  undo->num_zapped = 0;
+
+  apply_move(p, mv);
+  p->last_move = mv;
+  p->ply++;
 
-      for (fil_t f = FIL_ORIGIN * ARR_WIDTH; f < FIL_ORIGIN * ARR_WIDTH + BOARD_WIDTH * ARR_WIDTH; f += ARR_WIDTH) {
-        for (rnk_t r = f + RNK_ORIGIN; r < f + RNK_ORIGIN + BOARD_WIDTH; ++r) {
-          if (p -> board[r] != old -> history -> board[r])
-            match = false;
-        }
-      }
+  square_t victim_sq = NO_SQUARE;
+  p->victims = 0;
 
-      if (match) return KO();
+  while ((victim_sq = fire_laser(p, c)) != NO_SQUARE) {
+    piece_t victim_piece = piece_at(p, victim_sq);
+    tbassert(undo->num_zapped < MAX_ZAPS, "num_zapped: %d\n", undo->num_zapped);
+    undo->zapped_sq[undo->num_zapped] = victim_sq;
+    undo->zapped_piece[undo->num_zapped++] = victim_piece;
+
+    p->victims++;
+    p->victims |= 16 << color_of(victim_piece);
+    p->key ^= zob[victim_sq][victim_piece];   // remove from board
+    p->key ^= zob[victim_sq][0];
+    p->mask[color_of(victim_piece)] ^= square_bit(victim_sq);
+    if (ptype_of(victim_piece) == PAWN) {
+      p->pawn[ori_of(victim_piece)] ^= square_bit(victim_sq);
+    }
+
+    if (ptype_of(victim_piece) == KING) {
+      p->victims |= 128;
+      if (color_of(victim_piece))
+        p->victims |= 64;
+      break;
     }
   }
+
+  tbassert(p->key == compute_zob_key(p),
+           "p->key: %"PRIu64", zob-key: %"PRIu64"\n",
+           p->key, compute_zob_key(p));
+  tbassert(board_is_consistent(p), "inconsistent board\n");
   return p->victims;
 }
 
+#ifndef NDEBUG
+// Whether unmake_move() brought a back to b: the board and every field
+// do_move_in_place() touches.
+static inline bool same_position(position_t *a, position_t *b) {
+  return same_board(a, b) && a->key == b->key && a->ply == b->ply &&
+      a->last_move == b->last_move && a->victims == b->victims &&
+      a->laser[WHITE] == b->laser[WHITE] && a->laser[BLACK] == b->laser[BLACK] &&
+      a->kill_d[WHITE] == b->kill_d[WHITE] && a->kill_d[BLACK] == b->kill_d[BLACK];
+}
+#endif
+
+// Takes back the move recorded in undo.
+void unmake_move(position_t *p, undo_t *undo) {
+  // put the zapped pieces back
+  for (int i = undo->num_zapped - 1; i >= 0; i--) {
+    square_t sq = undo->zapped_sq[i];
+    piece_t x = undo->zapped_piece[i];
+    p->mask[color_of(x)] ^= square_bit(sq);
+    if (ptype_of(x) == PAWN) {
+      p->pawn[ori_of(x)] ^= square_bit(sq);
+    }
+  }
+
+  // a move from to_sq back to from_sq, with the opposite rotation
+  move_t mv = p->last_move;
+  apply_move(p, move_of(ptype_mv_of(mv), (rot_t) (ROT_MASK & -rot_of(mv)),
+                        to_square(mv), from_square(mv)));
+
+  p->key = undo->key;
+  p->last_move = undo->last_move;
+  p->victims = undo->victims;
+  p->laser[WHITE] = undo->laser[WHITE];
+  p->laser[BLACK] = undo->laser[BLACK];
+  p->kill_d[WHITE] = undo->kill_d[WHITE];
+  p->kill_d[BLACK] = undo->kill_d[BLACK];
+  p->ply--;
+
+  tbassert(p->key == compute_zob_key(p),
+           "p->key: %"PRIu64", zob-key: %"PRIu64"\n",
+           p->key, compute_zob_key(p));
+  tbassert(board_is_consistent(p), "inconsistent board\n");
+}
+
 // -----------------------------------------------------------------------------
 // Move path enumeration (perft)
 // -----------------------------------------------------------------------------
 
-// Helper function for do_perft() (ply starting with 0).
+// Perft transposition table.  A subtree count only depends on the position
+// and the remaining depth (the laser paths stay those of the root for the
+// whole run), so counts are cached by hash key and depth.  Each entry keeps
+// the count next to check = key ^ salt(depth) ^ count: an entry torn by two
+// parallel writers fails the check and reads as a miss.
+typedef struct perft_entry {
+  uint64_t check;
+  uint64_t count;
+} perft_entry_t;
+
+typedef struct perft_table {
+  perft_entry_t *entries;
+  uint64_t mask;  // number of entries - 1
+} perft_table_t;
+
+#define perft_lock_of(key, depth) \
+  ((key) ^ ((uint64_t) (depth) * 0x9e3779b97f4a7c15ULL))
+
+// Helper function for do_perft() (ply starting with 0).  tt may be NULL.
 //
 // NOTE: This function reimplements some of the logic for make_move().
-static uint64_t perft_search(position_t *p, int depth, int ply) {
+static uint64_t perft_search(position_t *p, int depth, int ply,
+                             perft_table_t *tt) {
   uint64_t node_count = 0;
-  position_t np;
+  undo_t undo;
   sortable_move_t lst[MAX_NUM_MOVES];
   int num_moves;
   int i;
@@ -649,62 +863,111 @@ static uint64_t perft_search(position_t *p, int depth, int ply) {
     return num_moves;
   }
 
+  perft_entry_t *entry = NULL;
+  uint64_t lock = perft_lock_of(p->key, depth);
+  if (tt) {
+    entry = &tt->entries[p->key & tt->mask];
+    perft_entry_t cached = *entry;
+    if ((cached.check ^ cached.count) == lock) {
+      return cached.count;
+    }
+  }
+
   for (i = 0; i < num_moves; i++) {
     move_t mv = get_move(lst[i]);
+#ifndef NDEBUG
+    position_t before = *p;
+#endif
 
-    low_level_make_move(p, &np, mv);  // make the move baby!
+    // make the move baby!  Lasers are not updated, just as before.
+    victims_t victims = do_move_in_place(p, mv, &undo);
 
-    square_t victim_sq = 0;  // the guys to disappear
-    np.victims = 0;
-    
-    while ((victim_sq = fire_laser(&np, color_to_move_of(p)))) {  // hit a piece
-      piece_t victim_piece = np.board[victim_sq];
-      tbassert((ptype_of(victim_piece) != EMPTY) &&
-               (ptype_of(victim_piece) != INVALID),
-               "type: %d\n", ptype_of(victim_piece));
-
-      np.victims++;
-      np.victims |= 16 << color_of(victim_piece);
-      np.key ^= zob[victim_sq][victim_piece];   // remove from board
-      np.board[victim_sq] = 0;
-      np.key ^= zob[victim_sq][0];
-      np.mask[color_of(victim_piece)] ^= sq_to_board_bit[victim_sq];
-
-      if (ptype_of(victim_piece) == KING) {
-        np.victims |= 128;
-        if (color_of(victim_piece))
-          np.victims |= 64;
-        break;
-      }
-    }
-
-    if (np.victims & 128) {
+    if (victims & 128) {
       // do not expand further: hit a King
       node_count++;
-      continue;
+    } else {
+      node_count += perft_search(p, depth-1, ply+1, tt);
     }
 
-    uint64_t partialcount = perft_search(&np, depth-1, ply+1);
-    node_count += partialcount;
+    unmake_move(p, &undo);
+    tbassert(same_position(p, &before), "unmake_move did not restore the "
+             "position before move %d\n", i);
   }
 
-  np.laser[0] = mark_laser_path_bit(&np, 0);
-  np.laser[1] = mark_laser_path_bit(&np, 1);
+  if (entry) {
+    entry->count = node_count;
+    entry->check = lock ^ node_count;
+  }
   return node_count;
 }
 
+// Counts the paths of the given depth that start with the root move mv.
+static uint64_t perft_root_move(position_t *p, move_t mv, int depth,
+                                perft_table_t *tt) {
+  if (depth == 1) {
+    return 1;
+  }
+  position_t np = *p;  // every parallel subtree gets its own board
+  undo_t undo;
+  if (do_move_in_place(&np, mv, &undo) & 128) {
+    return 1;  // hit a King
+  }
+  return perft_search(&np, depth-1, 1, tt);
+}
+
 // Debugging function to help verify that the move generator is working
-// correctly.
+// correctly.  Counts the move paths of length 1..depth from p, searching the
+// subtrees of the root moves in parallel.  With divide set, also prints the
+// count of every root move at the last depth.  hash_mb > 0 caches subtree
+// counts in a table of that many megabytes.
 //
 // https://chessprogramming.wikispaces.com/Perft
-void do_perft(position_t *gme, int depth, int ply) {
-  fen_to_pos(gme, "");
+void do_perft(position_t *p, int depth, bool divide, int hash_mb) {
+  perft_table_t table;
+  perft_table_t *tt = NULL;
+  if (hash_mb > 0) {
+    uint64_t num_entries = 1;
+    while (num_entries * 2 * sizeof(perft_entry_t) <= ((uint64_t) hash_mb << 20)) {
+      num_entries *= 2;
+    }
+    table.entries = (perft_entry_t *) calloc(num_entries, sizeof(perft_entry_t));
+    table.mask = num_entries - 1;
+    if (table.entries == NULL) {
+      printf("info string Could not allocate %d MB for the perft table\n",
+             hash_mb);
+    } else {
+      tt = &table;
+    }
+  }
+
+  sortable_move_t lst[MAX_NUM_MOVES];
+  uint64_t counts[MAX_NUM_MOVES];
+  int num_moves = generate_all(p, lst, true);
 
   for (int d = 1; d <= depth; d++) {
     printf("perft %2d ", d);
-    uint64_t j = perft_search(gme, d, 0);
+    fflush(stdout);
+    cilk_for (int i = 0; i < num_moves; i++) {
+      counts[i] = perft_root_move(p, get_move(lst[i]), d, tt);
+    }
+    uint64_t j = 0;
+    for (int i = 0; i < num_moves; i++) {
+      j += counts[i];
+    }
     printf("%" PRIu64 "\n", j);
   }
+
+  if (divide && depth >= 1) {
+    for (int i = 0; i < num_moves; i++) {
+      char buf[MAX_CHARS_IN_MOVE];
+      move_to_str(get_move(lst[i]), buf, MAX_CHARS_IN_MOVE);
+      printf("  %s %" PRIu64 "\n", buf, counts[i]);
+    }
+  }
+
+  if (tt) {
+    free(table.entries);
+  }
 }
 
 // -----------------------------------------------------------------------------
@@ -729,31 +992,25 @@ void display(position_t *p) {
     printf("info Last move: NULL\n");
   }
 
-  for (rnk_t r = BOARD_WIDTH - 1; r >=0 ; --r) {
+  for (int r = BOARD_WIDTH - 1; r >= 0; --r) {
     printf("\ninfo %1d  ", r);
     for (fil_t f = 0; f < BOARD_WIDTH; ++f) {
-      square_t sq = square_of(f, r);
+      piece_t x = piece_at(p, square_of(f, r));
 
-      tbassert(ptype_of(p->board[sq]) != INVALID,
-               "ptype_of(p->board[sq]): %d\n", ptype_of(p->board[sq]));
-      /*if (p->blocked[sq]) {
-        printf(" xx");
-        continue;
-      }*/
-      if (ptype_of(p->board[sq]) == EMPTY) {       // empty square
+      if (ptype_of(x) == EMPTY) {       // empty square
         printf(" --");
         continue;
       }
 
-      int ori = ori_of(p->board[sq]);  // orientation
-      color_t c = color_of(p->board[sq]);
+      int ori = ori_of(x);  // orientation
+      color_t c = color_of(x);
 
-      if (ptype_of(p->board[sq]) == KING) {
+      if (ptype_of(x) == KING) {
         printf(" %2s", king_ori_to_rep[c][ori]);
         continue;
       }
 
-      if (ptype_of(p->board[sq]) == PAWN) {
+      if (ptype_of(x) == PAWN) {
         printf(" %2s", pawn_ori_to_rep[c][ori]);
         continue;
       }
@@ -6,6 +6,7 @@
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdio.h>
 
 #define MAX_NUM_MOVES 128      // real number = 7 x (8 + 3) + 1 x (8 + 4) = 89
 #define MAX_PLY_IN_SEARCH 100  // up to 100 ply
@@ -19,50 +20,43 @@
 // Board
 // -----------------------------------------------------------------------------
 
-// The board (which is 8x8 or 10x10) is centered in a 16x16 array, with the
-// excess height and width being used for sentinels.
-#define ARR_WIDTH 10
-#define ARR_SIZE (ARR_WIDTH * ARR_WIDTH)
+// The board is 8x8 and every square is a bit index: square (f, r) is bit
+// 8 * f + r of a uint64_t.  There are no sentinels; the edges of the board are
+// checked with bitboard masks instead.
+//
+// https://chessprogramming.wikispaces.com/Square+Mapping+Considerations
 
-// Board is 8 x 8 or 10 x 10
+// Board is 8 x 8
 #define BOARD_WIDTH 8
+#define NUM_SQUARES (BOARD_WIDTH * BOARD_WIDTH)
 #define LOG2(X) ((unsigned) (__builtin_ctzll((X))))
-
-static const char laser_map_s[ARR_SIZE] = {
-4,4,4,4,4,4,4,4,4,4,
-4,0,0,0,0,0,0,0,0,4,
-4,0,0,0,0,0,0,0,0,4,
-4,0,0,0,0,0,0,0,0,4,
-4,0,0,0,0,0,0,0,0,4,
-4,0,0,0,0,0,0,0,0,4,
-4,0,0,0,0,0,0,0,0,4,
-4,0,0,0,0,0,0,0,0,4,
-4,0,0,0,0,0,0,0,0,4,
-4,4,4,4,4,4,4,4,4,4};
-
-static const uint64_t sq_to_board_bit[100] = {
-0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL,
-0ULL, 1ULL<<0, 1ULL<<1, 1ULL<<2, 1ULL<<3, 1ULL<<4, 1ULL<<5, 1ULL<<6, 1ULL<<7, 0ULL,
-0ULL, 1ULL<<8, 1ULL<<9, 1ULL<<10, 1ULL<<11, 1ULL<<12, 1ULL<<13, 1ULL<<14, 1ULL<<15, 0ULL,
-0ULL, 1ULL<<16, 1ULL<<17, 1ULL<<18, 1ULL<<19, 1ULL<<20, 1ULL<<21, 1ULL<<22, 1ULL<<23, 0ULL,
-0ULL, 1ULL<<24, 1ULL<<25, 1ULL<<26, 1ULL<<27, 1ULL<<28, 1ULL<<29, 1ULL<<30, 1ULL<<31, 0ULL,
-0ULL, 1ULL<<32, 1ULL<<33, 1ULL<<34, 1ULL<<35, 1ULL<<36, 1ULL<<37, 1ULL<<38, 1ULL<<39, 0ULL,
-0ULL, 1ULL<<40, 1ULL<<41, 1ULL<<42, 1ULL<<43, 1ULL<<44, 1ULL<<45, 1ULL<<46, 1ULL<<47, 0ULL,
-0ULL, 1ULL<<48, 1ULL<<49, 1ULL<<50, 1ULL<<51, 1ULL<<52, 1ULL<<53, 1ULL<<54, 1ULL<<55, 0ULL,
-0ULL, 1ULL<<56, 1ULL<<57, 1ULL<<58, 1ULL<<59, 1ULL<<60, 1ULL<<61, 1ULL<<62, 1ULL<<63, 0ULL,
-0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL};
+#define MSB(X) ((unsigned) (63 - __builtin_clzll((X))))
+
+#define square_bit(sq) (1ULL << (sq))
+
+// three_by_three_mask[sq] is the 3x3 block of squares centered at sq,
+// clipped at the edges of the board.
+static const uint64_t three_by_three_mask[NUM_SQUARES] = {
+771ULL, 1799ULL, 3598ULL, 7196ULL, 14392ULL, 28784ULL, 57568ULL, 49344ULL,
+197379ULL, 460551ULL, 921102ULL, 1842204ULL, 3684408ULL, 7368816ULL, 14737632ULL, 12632256ULL,
+50529024ULL, 117901056ULL, 235802112ULL, 471604224ULL, 943208448ULL, 1886416896ULL, 3772833792ULL, 3233857536ULL,
+12935430144ULL, 30182670336ULL, 60365340672ULL, 120730681344ULL, 241461362688ULL, 482922725376ULL, 965845450752ULL, 827867529216ULL,
+3311470116864ULL, 7726763606016ULL, 15453527212032ULL, 30907054424064ULL, 61814108848128ULL, 123628217696256ULL, 247256435392512ULL, 211934087479296ULL,
+847736349917184ULL, 1978051483140096ULL, 3956102966280192ULL, 7912205932560384ULL, 15824411865120768ULL, 31648823730241536ULL, 63297647460483072ULL, 54255126394699776ULL,
+217020505578799104ULL, 506381179683864576ULL, 1012762359367729152ULL, 2025524718735458304ULL, 4051049437470916608ULL, 8102098874941833216ULL, 16204197749883666432ULL, 13889312357043142656ULL,
+217017207043915776ULL, 506373483102470144ULL, 1012746966204940288ULL, 2025493932409880576ULL, 4050987864819761152ULL, 8101975729639522304ULL, 16203951459279044608ULL, 13889101250810609664ULL};
 
 typedef uint8_t square_t;
 typedef uint8_t rnk_t;
 typedef uint8_t fil_t;
 
-#define FIL_ORIGIN ((ARR_WIDTH - BOARD_WIDTH) / 2)
-#define RNK_ORIGIN ((ARR_WIDTH - BOARD_WIDTH) / 2)
-
-#define FIL_SHIFT 4
-#define FIL_MASK 15
+#define FIL_SHIFT 3
+#define FIL_MASK 7
 #define RNK_SHIFT 0
-#define RNK_MASK 15
+#define RNK_MASK 7
+
+// returned by laser_hit and fire_laser when the laser runs off the board
+#define NO_SQUARE NUM_SQUARES
 
 // -----------------------------------------------------------------------------
 // Pieces
@@ -124,21 +118,25 @@ typedef enum {
 // Moves
 // -----------------------------------------------------------------------------
 
-// MOVE_MASK is 20 bits
-#define MOVE_MASK 0xfffff
+// A move fits in 16 bits: 6 bits each for the from and to squares (the
+// board is indexed 0..63), 2 bits of rotation and 2 bits of piece type.
+//
+//   15 14 | 13 12 | 11 ... 6 | 5 ... 0
+//   ptype |  rot  |   from   |   to
+#define MOVE_MASK 0xffff
 
 
-#define PTYPE_MV_SHIFT 18
+#define PTYPE_MV_SHIFT 14
 #define PTYPE_MV_MASK 3
-#define FROM_SHIFT 8
-#define FROM_MASK 0xFF
+#define FROM_SHIFT 6
+#define FROM_MASK 0x3F
 #define TO_SHIFT 0
-#define TO_MASK 0xFF
-#define ROT_SHIFT 16
+#define TO_MASK 0x3F
+#define ROT_SHIFT 12
 #define ROT_MASK 3
 
-typedef uint32_t move_t;
-typedef uint64_t sortable_move_t;  // extra bits used to store sort key
+typedef uint16_t move_t;
+typedef uint32_t sortable_move_t;  // sort key in the upper 16 bits
 
 // Rotations
 typedef enum {
@@ -160,25 +158,43 @@ typedef int16_t victims_t;
 // Position
 // -----------------------------------------------------------------------------
 
-// Board representation is square-centric with sentinels.
+// Board representation is piece-centric (bitboards).  mask[c] holds every
+// piece of color c (King included), pawn[ori] holds the Pawns of both colors
+// facing ori, and each King is a square in kloc plus an orientation in kori.
+// The board fields come first so that they are contiguous.
 //
 // https://chessprogramming.wikispaces.com/Board+Representation
-// https://chessprogramming.wikispaces.com/Mailbox
-// https://chessprogramming.wikispaces.com/10x12+Board
+// https://chessprogramming.wikispaces.com/Bitboards
 
 typedef struct position {
-  piece_t      board[ARR_SIZE];
+  uint64_t     mask[2];          // pieces of each color
+  uint64_t     pawn[NUM_ORI];    // pawns of either color, by orientation
+  square_t     kloc[2];          // location of kings
+  uint8_t      kori[2];          // orientation of kings
+  uint64_t     laser[2];         // laser path of each king
   struct position  *history;     // history of position
   uint64_t     key;              // hash key
   int          ply;              // Even ply are White, odd are Black
   move_t       last_move;        // move that led to this position
   victims_t    victims;          // pieces destroyed by shooter
-  square_t     kloc[2];          // location of kings
-  uint64_t mask[2];
-  uint64_t laser[2];
   bool kill_d[2];
 } position_t;
 
+// Most pieces one laser shot can zap: victims_t counts them in 4 bits.
+#define MAX_ZAPS 16
+
+// Undo record for do_move_in_place(); see move_gen.c.
+typedef struct undo {
+  uint64_t     key;              // hash key before the move
+  move_t       last_move;        // fields of the position before the move
+  victims_t    victims;
+  uint64_t     laser[2];
+  bool         kill_d[2];
+  int          num_zapped;       // pieces zapped by the move, in order
+  square_t     zapped_sq[MAX_ZAPS];
+  piece_t      zapped_piece[MAX_ZAPS];
+} undo_t;
+
 // -----------------------------------------------------------------------------
 // Function prototypes
 // -----------------------------------------------------------------------------
@@ -203,11 +219,15 @@ const char *color_to_str(color_t c);
 
 static inline void init_zob();
 static inline uint64_t compute_zob_key(position_t *p);
-static inline uint64_t compute_mask(position_t *p, color_t color);
+static inline bool board_is_consistent(position_t *p);
+
+static inline piece_t piece_at(position_t *p, square_t sq);
+static inline int ori_at(position_t *p, square_t sq);
+static inline int pawn_ori_at(position_t *p, square_t sq);
 
-#define square_of(f,r) (ARR_WIDTH * (FIL_ORIGIN + (f)) + RNK_ORIGIN + (r))
-#define fil_of(sq) ((sq) / ARR_WIDTH - FIL_ORIGIN)
-#define rnk_of(sq) ((sq) % ARR_WIDTH - RNK_ORIGIN)
+#define square_of(f,r) (((f) << FIL_SHIFT) | ((r) << RNK_SHIFT))
+#define fil_of(sq) (((sq) >> FIL_SHIFT) & FIL_MASK)
+#define rnk_of(sq) (((sq) >> RNK_SHIFT) & RNK_MASK)
 /*
 square_t square_of(fil_t f, rnk_t r);
 fil_t fil_of(square_t sq);
@@ -215,14 +235,8 @@ rnk_t rnk_of(square_t sq);
 */
 static inline int square_to_str(square_t sq, char *buf, size_t bufsize);
 
-// direction map
-static const int dir[8] = { -ARR_WIDTH - 1, -ARR_WIDTH, -ARR_WIDTH + 1, -1, 1,
-                      ARR_WIDTH - 1, ARR_WIDTH, ARR_WIDTH + 1 };
-#define dir_of(i) dir[i]
-
-// directions for laser: NN, EE, SS, WW
-static const int beam[NUM_ORI] = {1, ARR_WIDTH, -1, -ARR_WIDTH};
-#define beam_of(direction) beam[direction]
+// neighbors of a square (the squares a piece on it can move to)
+#define neighbors_of(sq) (three_by_three_mask[sq] ^ square_bit(sq))
 
 // reflect[beam_dir][pawn_orientation]
 // -1 indicates back of Pawn
@@ -235,6 +249,78 @@ static const int reflect[NUM_ORI][NUM_ORI] = {
 };
 #define reflect_of(beam_dir, pawn_ori) reflect[beam_dir][pawn_ori]
 
+// laser_ray[sq][dir] holds the squares a beam leaving sq in direction dir
+// crosses before it runs off the board (sq itself excluded).  A beam stops
+// at the first occupied square of its ray: the lowest one for NN and EE, the
+// highest one for SS and WW.
+static const uint64_t laser_ray[NUM_SQUARES][NUM_ORI] = {
+  {0x00000000000000feULL, 0x0101010101010100ULL, 0x0000000000000000ULL, 0x0000000000000000ULL},
+  {0x00000000000000fcULL, 0x0202020202020200ULL, 0x0000000000000001ULL, 0x0000000000000000ULL},
+  {0x00000000000000f8ULL, 0x0404040404040400ULL, 0x0000000000000003ULL, 0x0000000000000000ULL},
+  {0x00000000000000f0ULL, 0x0808080808080800ULL, 0x0000000000000007ULL, 0x0000000000000000ULL},
+  {0x00000000000000e0ULL, 0x1010101010101000ULL, 0x000000000000000fULL, 0x0000000000000000ULL},
+  {0x00000000000000c0ULL, 0x2020202020202000ULL, 0x000000000000001fULL, 0x0000000000000000ULL},
+  {0x0000000000000080ULL, 0x4040404040404000ULL, 0x000000000000003fULL, 0x0000000000000000ULL},
+  {0x0000000000000000ULL, 0x8080808080808000ULL, 0x000000000000007fULL, 0x0000000000000000ULL},
+  {0x000000000000fe00ULL, 0x0101010101010000ULL, 0x0000000000000000ULL, 0x0000000000000001ULL},
+  {0x000000000000fc00ULL, 0x0202020202020000ULL, 0x0000000000000100ULL, 0x0000000000000002ULL},
+  {0x000000000000f800ULL, 0x0404040404040000ULL, 0x0000000000000300ULL, 0x0000000000000004ULL},
+  {0x000000000000f000ULL, 0x0808080808080000ULL, 0x0000000000000700ULL, 0x0000000000000008ULL},
+  {0x000000000000e000ULL, 0x1010101010100000ULL, 0x0000000000000f00ULL, 0x0000000000000010ULL},
+  {0x000000000000c000ULL, 0x2020202020200000ULL, 0x0000000000001f00ULL, 0x0000000000000020ULL},
+  {0x0000000000008000ULL, 0x4040404040400000ULL, 0x0000000000003f00ULL, 0x0000000000000040ULL},
+  {0x0000000000000000ULL, 0x8080808080800000ULL, 0x0000000000007f00ULL, 0x0000000000000080ULL},
+  {0x0000000000fe0000ULL, 0x0101010101000000ULL, 0x0000000000000000ULL, 0x0000000000000101ULL},
+  {0x0000000000fc0000ULL, 0x0202020202000000ULL, 0x0000000000010000ULL, 0x0000000000000202ULL},
+  {0x0000000000f80000ULL, 0x0404040404000000ULL, 0x0000000000030000ULL, 0x0000000000000404ULL},
+  {0x0000000000f00000ULL, 0x0808080808000000ULL, 0x0000000000070000ULL, 0x0000000000000808ULL},
+  {0x0000000000e00000ULL, 0x1010101010000000ULL, 0x00000000000f0000ULL, 0x0000000000001010ULL},
+  {0x0000000000c00000ULL, 0x2020202020000000ULL, 0x00000000001f0000ULL, 0x0000000000002020ULL},
+  {0x0000000000800000ULL, 0x4040404040000000ULL, 0x00000000003f0000ULL, 0x0000000000004040ULL},
+  {0x0000000000000000ULL, 0x8080808080000000ULL, 0x00000000007f0000ULL, 0x0000000000008080ULL},
+  {0x00000000fe000000ULL, 0x0101010100000000ULL, 0x0000000000000000ULL, 0x0000000000010101ULL},
+  {0x00000000fc000000ULL, 0x0202020200000000ULL, 0x0000000001000000ULL, 0x0000000000020202ULL},
+  {0x00000000f8000000ULL, 0x0404040400000000ULL, 0x0000000003000000ULL, 0x0000000000040404ULL},
+  {0x00000000f0000000ULL, 0x0808080800000000ULL, 0x0000000007000000ULL, 0x0000000000080808ULL},
+  {0x00000000e0000000ULL, 0x1010101000000000ULL, 0x000000000f000000ULL, 0x0000000000101010ULL},
+  {0x00000000c0000000ULL, 0x2020202000000000ULL, 0x000000001f000000ULL, 0x0000000000202020ULL},
+  {0x0000000080000000ULL, 0x4040404000000000ULL, 0x000000003f000000ULL, 0x0000000000404040ULL},
+  {0x0000000000000000ULL, 0x8080808000000000ULL, 0x000000007f000000ULL, 0x0000000000808080ULL},
+  {0x000000fe00000000ULL, 0x0101010000000000ULL, 0x0000000000000000ULL, 0x0000000001010101ULL},
+  {0x000000fc00000000ULL, 0x0202020000000000ULL, 0x0000000100000000ULL, 0x0000000002020202ULL},
+  {0x000000f800000000ULL, 0x0404040000000000ULL, 0x0000000300000000ULL, 0x0000000004040404ULL},
+  {0x000000f000000000ULL, 0x0808080000000000ULL, 0x0000000700000000ULL, 0x0000000008080808ULL},
+  {0x000000e000000000ULL, 0x1010100000000000ULL, 0x0000000f00000000ULL, 0x0000000010101010ULL},
+  {0x000000c000000000ULL, 0x2020200000000000ULL, 0x0000001f00000000ULL, 0x0000000020202020ULL},
+  {0x0000008000000000ULL, 0x4040400000000000ULL, 0x0000003f00000000ULL, 0x0000000040404040ULL},
+  {0x0000000000000000ULL, 0x8080800000000000ULL, 0x0000007f00000000ULL, 0x0000000080808080ULL},
+  {0x0000fe0000000000ULL, 0x0101000000000000ULL, 0x0000000000000000ULL, 0x0000000101010101ULL},
+  {0x0000fc0000000000ULL, 0x0202000000000000ULL, 0x0000010000000000ULL, 0x0000000202020202ULL},
+  {0x0000f80000000000ULL, 0x0404000000000000ULL, 0x0000030000000000ULL, 0x0000000404040404ULL},
+  {0x0000f00000000000ULL, 0x0808000000000000ULL, 0x0000070000000000ULL, 0x0000000808080808ULL},
+  {0x0000e00000000000ULL, 0x1010000000000000ULL, 0x00000f0000000000ULL, 0x0000001010101010ULL},
+  {0x0000c00000000000ULL, 0x2020000000000000ULL, 0x00001f0000000000ULL, 0x0000002020202020ULL},
+  {0x0000800000000000ULL, 0x4040000000000000ULL, 0x00003f0000000000ULL, 0x0000004040404040ULL},
+  {0x0000000000000000ULL, 0x8080000000000000ULL, 0x00007f0000000000ULL, 0x0000008080808080ULL},
+  {0x00fe000000000000ULL, 0x0100000000000000ULL, 0x0000000000000000ULL, 0x0000010101010101ULL},
+  {0x00fc000000000000ULL, 0x0200000000000000ULL, 0x0001000000000000ULL, 0x0000020202020202ULL},
+  {0x00f8000000000000ULL, 0x0400000000000000ULL, 0x0003000000000000ULL, 0x0000040404040404ULL},
+  {0x00f0000000000000ULL, 0x0800000000000000ULL, 0x0007000000000000ULL, 0x0000080808080808ULL},
+  {0x00e0000000000000ULL, 0x1000000000000000ULL, 0x000f000000000000ULL, 0x0000101010101010ULL},
+  {0x00c0000000000000ULL, 0x2000000000000000ULL, 0x001f000000000000ULL, 0x0000202020202020ULL},
+  {0x0080000000000000ULL, 0x4000000000000000ULL, 0x003f000000000000ULL, 0x0000404040404040ULL},
+  {0x0000000000000000ULL, 0x8000000000000000ULL, 0x007f000000000000ULL, 0x0000808080808080ULL},
+  {0xfe00000000000000ULL, 0x0000000000000000ULL, 0x0000000000000000ULL, 0x0001010101010101ULL},
+  {0xfc00000000000000ULL, 0x0000000000000000ULL, 0x0100000000000000ULL, 0x0002020202020202ULL},
+  {0xf800000000000000ULL, 0x0000000000000000ULL, 0x0300000000000000ULL, 0x0004040404040404ULL},
+  {0xf000000000000000ULL, 0x0000000000000000ULL, 0x0700000000000000ULL, 0x0008080808080808ULL},
+  {0xe000000000000000ULL, 0x0000000000000000ULL, 0x0f00000000000000ULL, 0x0010101010101010ULL},
+  {0xc000000000000000ULL, 0x0000000000000000ULL, 0x1f00000000000000ULL, 0x0020202020202020ULL},
+  {0x8000000000000000ULL, 0x0000000000000000ULL, 0x3f00000000000000ULL, 0x0040404040404040ULL},
+  {0x0000000000000000ULL, 0x0000000000000000ULL, 0x7f00000000000000ULL, 0x0080808080808080ULL}
+};
+#define laser_ray_of(sq, direction) laser_ray[sq][direction]
+
 #define ptype_mv_of(mv) ( (ptype_t) (((mv) >> PTYPE_MV_SHIFT) & PTYPE_MV_MASK))
 //ptype_t ptype_mv_of(move_t mv);
 #define from_square(mv) (((mv) >> FROM_SHIFT) & FROM_MASK)
@@ -253,12 +339,24 @@ void move_to_str(move_t mv, char *buf, size_t bufsize);
 
 static inline int generate_all(position_t *p, sortable_move_t *sortable_move_list,
                  bool strict);
-void do_perft(position_t *gme, int depth, int ply);
+static inline int generate_zaps(position_t *p, sortable_move_t *sortable_move_list,
+                  bool strict);
+void do_perft(position_t *p, int depth, bool divide, int hash_mb);
+
+// number of keys in the Zobrist table, including the side-to-move key
+#define ZOB_NUM_KEYS (NUM_SQUARES * (1 << PIECE_SIZE) + 1)
+void zob_export(uint64_t *keys);
+void zob_import(const uint64_t *keys);
+static inline square_t laser_hit(square_t sq, int bdir, uint64_t occupied);
+static inline square_t fire_laser(position_t *p, color_t c);
 static inline void low_level_make_move(position_t *old, position_t *p, move_t mv);
 static inline victims_t make_move(position_t *old, position_t *p, move_t mv);
 static inline victims_t make_move2(position_t *old, position_t *p, move_t mv);
+static inline void unmake_move(position_t *p, undo_t *undo);
 
 void display(position_t *p);
+static inline void laser_reset_stats();
+void laser_print_stats(FILE *OUT);
 
 #define KO() ((victims_t) -1)
 //victims_t KO();
@@ -0,0 +1,14 @@
+// Copyright (c) 2015 MIT License by 6.172 Staff
+
+// Stand-in for <cilk/cilk.h> in builds with a stock compiler (make NOCILK=1).
+// The keywords turn into their serial elision, so every cilk_for runs as a
+// plain loop.
+
+#ifndef NOCILK_CILK_H
+#define NOCILK_CILK_H
+
+#define cilk_spawn
+#define cilk_sync
+#define cilk_for for
+
+#endif  // NOCILK_CILK_H
@@ -0,0 +1,9 @@
+// Copyright (c) 2015 MIT License by 6.172 Staff
+
+// Stand-in for <cilk/reducer.h> in builds with a stock compiler (make
+// NOCILK=1).  Nothing in the player uses reducers.
+
+#ifndef NOCILK_REDUCER_H
+#define NOCILK_REDUCER_H
+
+#endif  // NOCILK_REDUCER_H
@@ -15,6 +15,7 @@ implementation has been provided for you.
 
 #include "./search.h"
 
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -62,6 +63,9 @@ int DETECT_DRAWS;  // Detect draws by repetition
 // do not set more than 5 ply
 int FUT_DEPTH;     // set to zero for no futilty
 
+int PARALLEL_ROOT;  // Search the root moves after the first in parallel
+int PARALLEL_PV;    // Search the moves of a PV node after the first in parallel
+
 
 // Declare the two main search functions.
 static score_t searchPV(searchNode *node, int depth,
@@ -92,6 +96,127 @@ static void initialize_pv_node(searchNode* node, int depth) {
   node->best_move_index = 0;
   node->best_score = -INF;
   node->abort = false;
+  node->abort_epoch = node->parent->abort_epoch;
+  node->clock = node->parent->clock;
+}
+
+// Young brothers wait: once the first move of a PV node has been searched,
+// its younger brothers, moves[first .. num_of_moves), are searched in
+// parallel.  Like the root moves (see search_root_move()), each one is
+// searched below a snapshot of the node that has the best score its finished
+// brothers found so far as alpha, and a move that fails high is scouted again
+// if alpha has risen since, then re-searched with the full window by the
+// same task.  A move that reaches beta aborts the brothers still searching.
+//
+// Once all tasks are done, the scores are taken in move order, as the serial
+// loop would have taken them.  With one worker every move is searched
+// against the alpha the serial loop would have used, so the result is the
+// same.
+//
+// Returns true on a cutoff.  *num_moves_tried is set as the serial loop would
+// have left it.
+//
+// https://chessprogramming.wikispaces.com/Young+Brothers+Wait+Concept
+static bool search_pv_siblings(searchNode *node, sortable_move_t *move_list,
+                               int first, int num_of_moves, move_t killer_a,
+                               move_t killer_b, int *num_moves_tried,
+                               uint64_t *node_count_serial) {
+  simple_mutex_t mutex;
+  init_simple_mutex(&mutex);
+  score_t shared_alpha = node->alpha;  // raised under the lock
+
+  score_t scores[MAX_NUM_MOVES];
+  score_t alphas[MAX_NUM_MOVES];  // the alpha each move was searched against
+  moveEvaluationResult_t types[MAX_NUM_MOVES];
+  bool searched[MAX_NUM_MOVES];  // false if aborted by a brother's cutoff
+
+  cilk_for (int mv_index = first; mv_index < num_of_moves; mv_index++) {
+    searched[mv_index] = false;
+
+    // The node stays the snapshot's parent, so that parallel_abort(node)
+    // reaches the search below the snapshot.
+    searchNode snapshot;
+    simple_acquire(&mutex);
+    bool aborted = node->abort;
+    snapshot = *node;
+    snapshot.alpha = shared_alpha;
+    simple_release(&mutex);
+    if (aborted) {
+      continue;
+    }
+    snapshot.parent = node;
+
+    __sync_fetch_and_add(node_count_serial, 1);
+    moveEvaluationResult result = evaluateMove(&snapshot,
+                                               get_move(move_list[mv_index]),
+                                               killer_a, killer_b, SEARCH_PV,
+                                               node_count_serial);
+    while (result.needs_research) {
+      simple_acquire(&mutex);
+      score_t alpha = shared_alpha;
+      simple_release(&mutex);
+      if (alpha <= snapshot.alpha) {
+        break;
+      }
+      snapshot.alpha = alpha;
+      result.score = -scout_search(&(result.next_node), result.search_depth,
+                                   node_count_serial);
+      result.needs_research = (result.score > snapshot.alpha);
+    }
+    if (result.needs_research) {
+      result.score = -searchPV(&(result.next_node), result.search_depth,
+                               node_count_serial);
+    }
+
+    simple_acquire(&mutex);
+    if (!node->abort && !search_aborted(node)) {
+      searched[mv_index] = true;
+      scores[mv_index] = result.score;
+      alphas[mv_index] = snapshot.alpha;
+      types[mv_index] = result.type;
+      if (result.type == MOVE_EVALUATED || result.type == MOVE_GAMEOVER) {
+        if (result.score > shared_alpha) {
+          shared_alpha = result.score;
+        }
+        if (result.score >= node->beta) {
+          // the other brothers are still searching
+          parallel_abort(node);
+        }
+      }
+    }
+    simple_release(&mutex);
+  }
+
+  if (search_aborted(node)) {
+    return false;
+  }
+
+  for (int mv_index = first; mv_index < num_of_moves; mv_index++) {
+    (*num_moves_tried)++;
+
+    if (!searched[mv_index] || types[mv_index] == MOVE_ILLEGAL ||
+        types[mv_index] == MOVE_IGNORE) {
+      continue;
+    }
+    if (types[mv_index] == MOVE_EVALUATED) {
+      node->legal_move_count++;
+    }
+
+    // A score that did not beat the alpha its move was searched against only
+    // bounds the move from above.  If that alpha is above the node's, the
+    // move that raised it comes later in the list and beats this one.
+    if (scores[mv_index] <= alphas[mv_index] && alphas[mv_index] > node->alpha) {
+      continue;
+    }
+
+    moveEvaluationResult result;
+    result.score = scores[mv_index];
+    if (search_process_score(node, get_move(move_list[mv_index]), mv_index,
+                             &result, SEARCH_PV)) {
+      return true;
+    }
+  }
+  return false;
 }
 
 // Perform a Principle Variation Search
@@ -119,6 +244,7 @@ static score_t searchPV(searchNode *node, int depth, uint64_t *node_count_serial
   }
 
   // Get the killer moves at this node.
+  move_t *killer = killer_table();
   move_t killer_a = killer[KMT(node->ply, 0)];
   move_t killer_b = killer[KMT(node->ply, 1)];
 
@@ -148,12 +274,22 @@ static score_t searchPV(searchNode *node, int depth, uint64_t *node_count_serial
   // Start searching moves.
 
   for (int mv_index = 0; mv_index < num_of_moves; mv_index++) {
-    // Incrementally sort the move list.
+    // The younger brothers are searched in parallel, once the eldest has
+    // set alpha.
+    if (PARALLEL_PV && node->legal_move_count > 0 && node->depth > 1) {
+      search_pv_siblings(node, move_list, mv_index, num_of_moves, killer_a,
+                         killer_b, &num_moves_tried, node_count_serial);
+      // Check if we should abort due to time control.
+      if (search_aborted(node)) {
+        return 0;
+      }
+      break;
+    }
 
     move_t mv = get_move(move_list[mv_index]);
 
     num_moves_tried++;
-    (*node_count_serial)++;
+    __sync_fetch_and_add(node_count_serial, 1);
 
     
     moveEvaluationResult result = evaluateMove(node, mv, killer_a, killer_b,
@@ -170,8 +306,13 @@ static score_t searchPV(searchNode *node, int depth, uint64_t *node_count_serial
       node->legal_move_count++;
     }
 
+    if (result.needs_research) {
+      result.score = -searchPV(&(result.next_node), result.search_depth,
+                               node_count_serial);
+    }
+
     // Check if we should abort due to time control.
-    if (abortf) {
+    if (search_aborted(node)) {
       return 0;
     }
 
@@ -218,14 +359,220 @@ static void initialize_root_node(searchNode *node, score_t alpha, score_t beta,
   node->best_score = -INF;
   node->pov = 1 - node->fake_color_to_move * 2;  // pov = 1 for White, -1 for Black
   node->abort = false;
+  node->abort_epoch = current_abort_epoch();
+  node->clock = thread_clock;
+}
+
+// Searches one root move and returns its score from the root's point of view.
+// Sets *illegal instead for a move that breaks the Ko rule.
+static score_t search_root_move(searchNode *rootNode, searchNode *next_node,
+                                move_t mv, int mv_index, bool *illegal,
+                                uint64_t *node_count_serial,
+                                simple_mutex_t *mutex) {
+  *illegal = false;
+  next_node->subpv = 0;
+  next_node->parent = rootNode;
+
+  // In the parallel loop (mutex set) other tasks raise the root's alpha
+  // under the lock.  The move is searched below a snapshot of the root
+  // instead, so that its window and its fail-high test use the same alpha.
+  searchNode root_snapshot;
+  if (mutex != NULL) {
+    simple_acquire(mutex);
+    root_snapshot = *rootNode;
+    simple_release(mutex);
+    next_node->parent = &root_snapshot;
+  }
+
+  if (TRACE_MOVES) {
+    print_move_info(mv, rootNode->ply);
+  }
+
+  __sync_fetch_and_add(node_count_serial, 1);
+
+  // make the move.
+  victims_t x = make_move(&(rootNode->position), &(next_node->position), mv);
+
+  if (is_KO(x)) {
+    *illegal = true;  // not a legal move
+    return 0;
+  }
+
+  if (is_game_over(x, rootNode->pov, rootNode->ply)) {
+    return get_game_over_score(x, rootNode->pov, rootNode->ply);
+  }
+
+  if (is_repeated(&(next_node->position), rootNode->ply)) {
+    return get_draw_score(&(next_node->position), rootNode->ply);
+  }
+
+  if (mv_index == 0 || rootNode->depth == 1) {
+    // We guess that the first move is the principle variation
+    return -searchPV(next_node, rootNode->depth-1, node_count_serial);
+  }
+
+  searchNode *parent = next_node->parent;
+  score_t score;
+  while (true) {
+    score = -scout_search(next_node, rootNode->depth-1, node_count_serial);
+    if (search_aborted(rootNode)) {
+      return 0;
+    }
+    if (score <= parent->alpha || mutex == NULL) {
+      break;
+    }
+    // The move failed high against the snapshot.  If alpha has risen past
+    // the snapshot since, scout the move again against the new alpha before
+    // deciding on the PV search.
+    simple_acquire(mutex);
+    score_t alpha = rootNode->alpha;
+    simple_release(mutex);
+    if (alpha <= parent->alpha) {
+      break;
+    }
+    parent->alpha = alpha;
+  }
+
+  // If its score exceeds the current best score,
+  if (score > parent->alpha) {
+    score = -searchPV(next_node, rootNode->depth-1, node_count_serial);
+  }
+  return score;
+}
+
+// Takes the score of a root move into account.  Returns true if the move is
+// the new best move, in which case it has also been reported.
+static bool root_process_score(searchNode *rootNode, move_t mv, int mv_index,
+                               score_t score, move_t *pv,
+                               uint64_t *node_count_serial, FILE *OUT) {
+  bool improved = false;
+
+  // only valid for the root node:
+  tbassert((score > rootNode->best_score) == (score > rootNode->alpha),
+           "score = %d, best = %d, alpha = %d\n", score, rootNode->best_score,
+           rootNode->alpha);
+
+  if (score > rootNode->best_score) {
+    tbassert(score > rootNode->alpha, "score: %d, alpha: %d\n", score, rootNode->alpha);
+
+    rootNode->best_score = score;
+    *pv = mv;
+    improved = true;
+    // memcpy(pv+1, next_node.subpv, sizeof(move_t) * (MAX_PLY_IN_SEARCH - 1));
+    // pv[MAX_PLY_IN_SEARCH - 1] = 0;
+
+    // Print out based on UCI (universal chess interface)
+    double et = milliseconds() - rootNode->clock->sstart;
+    char   pvbuf[MAX_CHARS_IN_MOVE];
+    getPV(*pv, pvbuf, MAX_CHARS_IN_MOVE);
+    if (et < 0.00001) {
+      et = 0.00001;  // hack so that we don't divide by 0
+    }
+
+    uint64_t nps = 1000 * *node_count_serial / et;
+    fprintf(OUT, "info depth %d move_no %d time (microsec) %d nodes %" PRIu64
+            " nps %" PRIu64 "\n",
+            rootNode->depth, mv_index + 1, (int) (et * 1000), *node_count_serial,
+            nps);
+    fprintf(OUT, "info score cp %d pv %s\n", score, pvbuf);
+  }
+
+  // Normal alpha-beta logic: if the current score is better than what the
+  // maximizer has been able to get so far, take that new value.  Likewise,
+  // score >= beta is the beta cutoff condition
+  if (score > rootNode->alpha) {
+    rootNode->alpha = score;
+  }
+  tbassert(score < rootNode->beta, "score: %d, beta: %d\n", score, rootNode->beta);
+  return improved;
+}
+
+// The searches of a thread start the root moves after the first at this one
+// of them (see set_root_rotation()).
+static __thread int root_rotation = 0;
+
+// Lazy SMP helpers each search the root moves in an order of their own, so
+// that they do not all refute the same moves first: every iteration of the
+// calling thread's search turns the root moves after the first by rotation
+// places.  The first move, the best one so far, stays in front.
+void set_root_rotation(int rotation) {
+  root_rotation = rotation;
+}
+
+static inline void rotate_root_moves(sortable_move_t *move_list,
+                                     int num_of_moves) {
+  int n = num_of_moves - 1;
+  if (root_rotation == 0 || n < 2) {
+    return;
+  }
+  int r = root_rotation % n;
+  sortable_move_t rest[MAX_NUM_MOVES];
+  for (int i = 0; i < n; i++) {
+    rest[i] = move_list[1 + (i + r) % n];
+  }
+  memcpy(move_list + 1, rest, n * sizeof(sortable_move_t));
+}
+
+// Slides the move at mv_index to the front of the move list
+static inline void root_move_to_front(sortable_move_t *move_list, int mv_index) {
+  move_t mv = get_move(move_list[mv_index]);
+  for (int j = mv_index; j > 0; j--) {
+    move_list[j] = move_list[j - 1];
+  }
+  move_list[0] = mv;
+}
+
+// The root moves after the first, searched in parallel.  Each scout search
+// starts from the best score found so far, which the tasks raise under a
+// lock as they finish, and a move that fails high is re-searched by the same
+// task (see search_root_move()).  The moves that became the best move are put in front of the list
+// once all tasks are done, in the order they became the best, which leaves
+// the list as the serial loop would have.
+static void search_root_parallel(searchNode *rootNode, sortable_move_t *move_list,
+                                 int num_of_moves, move_t *pv,
+                                 uint64_t *node_count_serial, FILE *OUT) {
+  simple_mutex_t mutex;
+  init_simple_mutex(&mutex);
+
+  move_t moves[MAX_NUM_MOVES];
+  int improved[MAX_NUM_MOVES];  // indices of the moves that became the best
+  int num_improved = 0;
+  for (int mv_index = 0; mv_index < num_of_moves; mv_index++) {
+    moves[mv_index] = get_move(move_list[mv_index]);
+  }
+
+  cilk_for (int mv_index = 1; mv_index < num_of_moves; mv_index++) {
+    searchNode next_node;
+    bool illegal;
+    score_t score = search_root_move(rootNode, &next_node, moves[mv_index],
+                                     mv_index, &illegal, node_count_serial,
+                                     &mutex);
+    if (!illegal && !search_aborted(rootNode)) {
+      simple_acquire(&mutex);
+      if (root_process_score(rootNode, moves[mv_index], mv_index, score, pv,
+                             node_count_serial, OUT)) {
+        improved[num_improved++] = mv_index;
+      }
+      simple_release(&mutex);
+    }
+  }
+
+  for (int i = 0; i < num_improved; i++) {
+    int mv_index = 0;
+    while (get_move(move_list[mv_index]) != moves[improved[i]]) {
+      mv_index++;
+    }
+    root_move_to_front(move_list, mv_index);
+  }
 }
 
 score_t searchRoot(position_t *p, score_t alpha, score_t beta, int depth,
                    int ply, move_t *pv, uint64_t *node_count_serial,
                    FILE *OUT) {
-  static int num_of_moves = 0;  // number of moves in list
+  // one list per thread, for the lazy SMP helpers (see leiserchess.c)
+  static __thread int num_of_moves = 0;  // number of moves in list
   // hopefully, more than we will need
-  static sortable_move_t move_list[MAX_NUM_MOVES];
+  static __thread sortable_move_t move_list[MAX_NUM_MOVES];
 
   if (depth == 1) {
     // we are at depth 1; generate all possible moves
@@ -239,6 +586,7 @@ score_t searchRoot(position_t *p, score_t alpha, score_t beta, int depth,
     // }
     sort_incremental(move_list, num_of_moves);
   }
+  rotate_root_moves(move_list, num_of_moves);
 
   // printf("?? %d %d\n", depth, num_of_moves);
   searchNode rootNode;
@@ -248,107 +596,39 @@ score_t searchRoot(position_t *p, score_t alpha, score_t beta, int depth,
 
   assert(rootNode.best_score == alpha);  // initial conditions
 
-  searchNode next_node;
-  next_node.subpv = 0;
-  next_node.parent = &rootNode;
+  // Once the first move has set alpha, the others only have to be refuted,
+  // which they can be independently of each other.  At depth 1 every move
+  // gets a full search, so there is nothing to gain.
+  bool parallel = PARALLEL_ROOT && depth > 1;
 
-  score_t score;
+  searchNode next_node;
   for (int mv_index = 0; mv_index < num_of_moves; mv_index++) {
-    move_t mv = get_move(move_list[mv_index]);
-
-    if (TRACE_MOVES) {
-      print_move_info(mv, ply);
-    }
-
-    (*node_count_serial)++;
-
-    // make the move.
-    
-    victims_t x = make_move(&(rootNode.position), &(next_node.position), mv);
-    
-    if (is_KO(x)) {
-      continue;  // not a legal move
-    }
-
-    if (is_game_over(x, rootNode.pov, rootNode.ply)) {
-      score = get_game_over_score(x, rootNode.pov, rootNode.ply);
-      next_node.subpv = 0;
-      goto scored;
-    }
-
-    if (is_repeated(&(next_node.position), rootNode.ply)) {
-      score = get_draw_score(&(next_node.position), rootNode.ply);
-      next_node.subpv = 0;
-      goto scored;
-    }
-    if (mv_index == 0 || rootNode.depth == 1) {
-      // We guess that the first move is the principle variation
-      score = -searchPV(&next_node, rootNode.depth-1, node_count_serial);
-      
+    if (parallel && mv_index == 1) {
+      search_root_parallel(&rootNode, move_list, num_of_moves, pv,
+                           node_count_serial, OUT);
       // Check if we should abort due to time control.
-      if (abortf) {
+      if (search_aborted(&rootNode)) {
         return 0;
       }
-    } else {
-      score = -scout_search(&next_node, rootNode.depth-1, node_count_serial);
-      // Check if we should abort due to time control.
-      if (abortf) {
-        return 0;
-      }
-
-      // If its score exceeds the current best score,
-      if (score > rootNode.alpha) {
-        score = -searchPV(&next_node, rootNode.depth-1, node_count_serial);
-        // Check if we should abort due to time control.
-        if (abortf) {
-          return 0;
-        }
-      }
+      break;
     }
 
-  scored:
-    // only valid for the root node:
-    tbassert((score > rootNode.best_score) == (score > rootNode.alpha),
-             "score = %d, best = %d, alpha = %d\n", score, rootNode.best_score, rootNode.alpha);
-
-    if (score > rootNode.best_score) {
-      tbassert(score > rootNode.alpha, "score: %d, alpha: %d\n", score, rootNode.alpha);
-
-      rootNode.best_score = score;
-      *pv = mv;
-      // memcpy(pv+1, next_node.subpv, sizeof(move_t) * (MAX_PLY_IN_SEARCH - 1));
-      // pv[MAX_PLY_IN_SEARCH - 1] = 0;
-
-      // Print out based on UCI (universal chess interface)
-      double et = elapsed_time();
-      char   pvbuf[MAX_CHARS_IN_MOVE];
-      getPV(*pv, pvbuf, MAX_CHARS_IN_MOVE);
-      if (et < 0.00001) {
-        et = 0.00001;  // hack so that we don't divide by 0
-      }
-
-      uint64_t nps = 1000 * *node_count_serial / et;
-      fprintf(OUT, "info depth %d move_no %d time (microsec) %d nodes %" PRIu64
-              " nps %" PRIu64 "\n",
-              depth, mv_index + 1, (int) (et * 1000), *node_count_serial, nps);
-      fprintf(OUT, "info score cp %d pv %s\n", score, pvbuf);
-
-      // Slide this move to the front of the move list
-      for (int j = mv_index; j > 0; j--) {
-        move_list[j] = move_list[j - 1];
-      }
-      move_list[0] = mv;
+    move_t mv = get_move(move_list[mv_index]);
+    bool illegal;
+    score_t score = search_root_move(&rootNode, &next_node, mv, mv_index,
+                                     &illegal, node_count_serial, NULL);
+    if (illegal) {
+      continue;
     }
 
-    // Normal alpha-beta logic: if the current score is better than what the
-    // maximizer has been able to get so far, take that new value.  Likewise,
-    // score >= beta is the beta cutoff condition
-    if (score > rootNode.alpha) {
-      rootNode.alpha = score;
+    // Check if we should abort due to time control.
+    if (search_aborted(&rootNode)) {
+      return 0;
     }
-    if (score >= rootNode.beta) {
-      tbassert(0, "score: %d, beta: %d\n", score, rootNode.beta);
-      break;
+
+    if (root_process_score(&rootNode, mv, mv_index, score, pv,
+                           node_count_serial, OUT)) {
+      root_move_to_front(move_list, mv_index);
     }
   }
 
@@ -26,9 +26,9 @@ static move_t killer_reference __KMT_dim__;  // up to 4 killers
 
 // Best move history table and lookup function
 // Format: best_move_history[color_t][piece_t][square_t][orientation]
-#define __BMH_dim__ [2][6][ARR_SIZE][NUM_ORI]  // NOLINT(whitespace/braces)
+#define __BMH_dim__ [2][6][NUM_SQUARES][NUM_ORI]  // NOLINT(whitespace/braces)
 #define BMH(color, piece, square, ori)                             \
-    (color * 6 * ARR_SIZE * NUM_ORI + piece * ARR_SIZE * NUM_ORI + \
+    (color * 6 * NUM_SQUARES * NUM_ORI + piece * NUM_SQUARES * NUM_ORI + \
      square * NUM_ORI + ori)
 
 static int best_move_history_reference __BMH_dim__;
@@ -43,6 +43,15 @@ typedef enum searchType {  // different types of search
   SEARCH_SCOUT
 } searchType_t;
 
+// Abort and timing state of a search.  The main search runs on one clock;
+// every lazy SMP helper has its own (see use_search_clock()).
+typedef struct searchClock {
+  int tics;        // counter for how often we should check for abort
+  double sstart;   // start time of a search in milliseconds
+  double timeout;  // time elapsed before abort
+  bool abortf;     // abort flag for search
+} searchClock;
+
 typedef struct searchNode {
   struct searchNode* parent;
   searchType_t type;
@@ -56,6 +65,8 @@ typedef struct searchNode {
   int8_t pov;
   int8_t legal_move_count;
   bool abort;
+  uint32_t abort_epoch;  // no ancestor had aborted as of this abort epoch
+  searchClock *clock;    // clock of the search this node belongs to
   score_t best_score;
   int8_t best_move_index;
   position_t position;
@@ -68,7 +79,12 @@ static inline void init_abort_timer(double goal_time);
 static inline double elapsed_time();
 static inline bool should_abort();
 static inline void reset_abort();
+static inline void abort_search(searchClock *clock);
+static inline void use_search_clock(searchClock *clock);
 static inline void init_best_move_history();
+static inline void merge_best_move_history();
+static inline void release_thread_tables();
+void set_root_rotation(int rotation);
 #define get_move(mv) ((mv) & MOVE_MASK)
 
 score_t searchRoot(position_t *p, score_t alpha, score_t beta, int depth,
@@ -1,10 +1,9 @@
 // Copyright (c) 2015 MIT License by 6.172 Staff
 
-// tic counter for how often we should check for abort
-static int     tics = 0;
-static double  sstart;    // start time of a search in milliseconds
-static double  timeout;   // time elapsed before abort
-static bool    abortf = false;  // abort flag for search
+// The clock of the main search, and the one the searches started by this
+// thread run on.  The functions below that take no clock work on the latter.
+static searchClock main_clock;
+static __thread searchClock *thread_clock = &main_clock;
 
 static const score_t fmarg[10] = {
   0, PAWN_VALUE / 2, PAWN_VALUE, (PAWN_VALUE * 5) / 2, (PAWN_VALUE * 9) / 2,
@@ -22,6 +21,8 @@ typedef enum {
 typedef struct moveEvaluationResult {
   score_t score;
   moveEvaluationResult_t type;
+  bool needs_research;  // a PV node's null window search failed high
+  int search_depth;     // depth the move was searched to
   searchNode next_node;
 } moveEvaluationResult;
 
@@ -33,9 +34,9 @@ typedef struct leafEvalResult {
 } leafEvalResult;
 
 
-typedef uint32_t sort_key_t;
-static const uint64_t SORT_MASK = (1ULL << 32) - 1;
-static const int SORT_SHIFT = 32;
+typedef uint16_t sort_key_t;
+static const uint32_t SORT_MASK = (1U << 16) - 1;
+static const int SORT_SHIFT = 16;
 
 /*
 static sort_key_t sort_key(sortable_move_t mv) {
@@ -47,30 +48,48 @@ inline static void set_sort_key(sortable_move_t *mv, sort_key_t key) {
   // sort keys must not exceed SORT_MASK
   assert ((0 <= key) && (key <= SORT_MASK));
   assert ((0 <= *mv) && (*mv <= SORT_MASK));
-  *mv |= (uint64_t) key << SORT_SHIFT;
+  *mv |= (sortable_move_t) key << SORT_SHIFT;
   return;
 }
 
+// Makes the searches this thread starts from now on run on clock, or on the
+// main search's clock if clock is NULL.  A lazy SMP helper uses this to get
+// a clock of its own, so that only the main search's time limit decides
+// when the search stops.
+static inline void use_search_clock(searchClock *clock) {
+  thread_clock = (clock != NULL) ? clock : &main_clock;
+}
+
 static inline void init_abort_timer(double goal_time) {
-  sstart = milliseconds();
+  thread_clock->sstart = milliseconds();
   // don't go over any more than 3 times the goal
-  timeout = sstart + goal_time * 3.0;
+  thread_clock->timeout = thread_clock->sstart + goal_time * 3.0;
 }
 
 static inline double elapsed_time() {
-  return milliseconds() - sstart;
+  return milliseconds() - thread_clock->sstart;
 }
 
 static inline bool should_abort() {
-  return abortf;
+  return thread_clock->abortf;
 }
 
 static inline void reset_abort() {
-  abortf = false;
+  thread_clock->abortf = false;
+}
+
+// Makes the search running on clock return as soon as it notices.
+static inline void abort_search(searchClock *clock) {
+  clock->abortf = true;
 }
 
 static inline void init_tics() {
-  tics = 0;
+  thread_clock->tics = 0;
+}
+
+// Whether the search node belongs to has been aborted.
+static inline bool search_aborted(searchNode *node) {
+  return node->clock->abortf;
 }
 
 // move_t get_move(sortable_move_t sortable_mv) {
@@ -193,14 +212,14 @@ static inline leafEvalResult evaluate_as_leaf(searchNode *node, searchType_t typ
   // get transposition table record if available.
   //
   // https://chessprogramming.wikispaces.com/Transposition+Table
-  ttRec_t *rec = tt_hashtable_get(node->position.key);
-  if (rec) {
-    if (type == SEARCH_SCOUT && tt_is_usable(rec, node->depth, node->beta)) {
+  ttRec_t rec;
+  if (tt_hashtable_get(node->position.key, &rec)) {
+    if (type == SEARCH_SCOUT && tt_is_usable(&rec, node->depth, node->beta)) {
       result.type = MOVE_EVALUATED;
-      result.score = tt_adjust_score_from_hashtable(rec, node->ply);
+      result.score = tt_adjust_score_from_hashtable(&rec, node->ply);
       return result;
     }
-    result.hash_table_move = tt_move_of(rec);
+    result.hash_table_move = tt_move_of(&rec);
   }
 
   // stand pat (having-the-move) bonus
@@ -255,8 +274,8 @@ static inline bool check_zero_victims(position_t *old, move_t mv) {
   square_t to_sq = to_square(mv);
 
   if (old -> kill_d[color_to_move_of(old)]
-    || (sq_to_board_bit[from_sq] & old -> laser[color_to_move_of(old)])
-    || (sq_to_board_bit[to_sq] & old -> laser[color_to_move_of(old)]))
+    || (square_bit(from_sq) & old -> laser[color_to_move_of(old)])
+    || (square_bit(to_sq) & old -> laser[color_to_move_of(old)]))
   return false;
     else
   return true;
@@ -277,6 +296,7 @@ static inline moveEvaluationResult evaluateMove(searchNode *node, move_t mv, mov
   int ext = 0;  // extensions
   bool blunder = false;  // shoot our own piece
   moveEvaluationResult result;
+  result.needs_research = false;
   result.next_node.subpv = 0;
   result.next_node.parent = node;
 
@@ -325,10 +345,7 @@ static inline moveEvaluationResult evaluateMove(searchNode *node, move_t mv, mov
     return result;
   }
 
-  
-  result.next_node.position.laser[0] = mark_laser_path_bit(&(result.next_node.position), 0);
-  result.next_node.position.laser[1] = mark_laser_path_bit(&(result.next_node.position), 1);
-  
+
   // Extend the search-depth by 1 if we captured a piece, since that means the
   // move was interesting.
   //
@@ -355,6 +372,7 @@ static inline moveEvaluationResult evaluateMove(searchNode *node, move_t mv, mov
 
   result.type = MOVE_EVALUATED;
   int search_depth = ext + node->depth - 1;
+  result.search_depth = search_depth;
 
   // Check if we need to perform a reduced-depth search.
   //
@@ -372,7 +390,7 @@ static inline moveEvaluationResult evaluateMove(searchNode *node, move_t mv, mov
   }
 
   // Check if we should abort due to time control.
-  if (abortf) {
+  if (search_aborted(node)) {
     result.score = 0;
     result.type = MOVE_IGNORE;
     return result;
@@ -386,11 +404,11 @@ static inline moveEvaluationResult evaluateMove(searchNode *node, move_t mv, mov
     if (node->legal_move_count == 0 || node->quiescence) {
       result.score = -searchPV(&(result.next_node), search_depth, node_count_serial);
     } else {
+      // searchPV() re-searches the move with the full window if this fails
+      // high
       result.score = -scout_search(&(result.next_node), search_depth,
                             node_count_serial);
-      if (result.score > node->alpha) {
-        result.score = -searchPV(&(result.next_node), node->depth + ext - 1, node_count_serial);
-      }
+      result.needs_research = (result.score > node->alpha);
     }
   }
 
@@ -428,6 +446,7 @@ static inline bool search_process_score(searchNode *node, move_t mv, int mv_inde
     }
 
     if (result->score >= node->beta) {
+      move_t *killer = killer_table();
       if (mv != killer[KMT(node->ply, 0)] && ENABLE_TABLES) {
         killer[KMT(node->ply, 1)] = killer[KMT(node->ply, 0)];
         killer[KMT(node->ply, 0)] = mv;
@@ -439,11 +458,12 @@ static inline bool search_process_score(searchNode *node, move_t mv, int mv_inde
 }
 
 // Check if we should abort.
-static inline bool should_abort_check() {
-  tics++;
-  if ((tics & ABORT_CHECK_PERIOD) == 0) {
-    if (milliseconds() >= timeout) {
-      abortf = true;
+static inline bool should_abort_check(searchNode *node) {
+  searchClock *clock = node->clock;
+  clock->tics++;
+  if ((clock->tics & ABORT_CHECK_PERIOD) == 0) {
+    if (milliseconds() >= clock->timeout) {
+      clock->abortf = true;
       return true;
     }
   }
@@ -459,7 +479,9 @@ static inline  int get_sortable_move_list(searchNode *node, sortable_move_t * mo
   int num_of_moves = generate_all(&(node->position), move_list, false);
 
   color_t fake_color_to_move = color_to_move_of(&(node->position));
+  int32_t *best_move_history = best_move_history_table();
 
+  move_t *killer = killer_table();
   move_t killer_a = killer[KMT(node->ply, 0)];
   move_t killer_b = killer[KMT(node->ply, 1)];
 
@@ -476,7 +498,7 @@ static inline  int get_sortable_move_list(searchNode *node, sortable_move_t * mo
       ptype_t  pce = ptype_mv_of(mv);
       rot_t    ro  = rot_of(mv);   // rotation
       square_t fs  = from_square(mv);
-      int      ot  = ORI_MASK & (ori_of(node->position.board[fs]) + ro);
+      int      ot  = ORI_MASK & (ori_at(&(node->position), fs) + ro);
       square_t ts  = to_square(mv);
       set_sort_key(&move_list[mv_index],
                    best_move_history[BMH(fake_color_to_move, pce, ts, ot)]);
@@ -486,41 +508,3 @@ static inline  int get_sortable_move_list(searchNode *node, sortable_move_t * mo
 }
 
 
-static inline int get_sortable_move_list2(searchNode *node, sortable_move_t * move_list,
-                         int hash_table_move, int killer_a, int killer_b) {
-  // number of moves in list
-  int num_of_moves = generate_all(&(node->position), move_list, false);
-
-  color_t fake_color_to_move = color_to_move_of(&(node->position));
-
-  // move_t killer_a = killer[KMT(node->ply, 0)];
-  // move_t killer_b = killer[KMT(node->ply, 1)];
-
-  // sort special moves to the front
-  for (int mv_index = 0; mv_index < num_of_moves; mv_index++) {
-    move_t mv = get_move(move_list[mv_index]);
-    if (mv == hash_table_move) {
-      set_sort_key(&move_list[mv_index], SORT_MASK);
-    } else if (mv == killer_a) {
-      set_sort_key(&move_list[mv_index], SORT_MASK - 1);
-    } else if (mv == killer_b) {
-      set_sort_key(&move_list[mv_index], SORT_MASK - 2);
-    } else {
-      if (node -> quiescence && check_zero_victims(&(node -> position), mv)) {
-        move_list[mv_index] = move_list[num_of_moves - 1];
-        num_of_moves -= 1;
-        mv_index -= 1;
-        continue;
-      }
-      ptype_t  pce = ptype_mv_of(mv);
-      rot_t    ro  = rot_of(mv);   // rotation
-      square_t fs  = from_square(mv);
-      int      ot  = ORI_MASK & (ori_of(node->position.board[fs]) + ro);
-      square_t ts  = to_square(mv);
-      set_sort_key(&move_list[mv_index],
-                   best_move_history[BMH(fake_color_to_move, pce, ts, ot)]);
-    }
-  }
-  return num_of_moves;
-}
-
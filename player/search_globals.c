@@ -8,46 +8,210 @@
 // FORMAT: killer[ply][id]
 #define __KMT_dim__ [MAX_PLY_IN_SEARCH*4]  // NOLINT(whitespace/braces)
 #define KMT(ply, id) (4 * ply + id)
-static move_t killer __KMT_dim__;  // up to 4 killers
 
 // Best move history table and lookup function
 //
 // https://chessprogramming.wikispaces.com/History+Heuristic
 //
 // FORMAT: best_move_history[color_t][piece_t][square_t][orientation]
-#define __BMH_dim__ [2*6*ARR_SIZE*NUM_ORI]  // NOLINT(whitespace/braces)
+#define __BMH_dim__ [2*6*NUM_SQUARES*NUM_ORI]  // NOLINT(whitespace/braces)
 #define BMH(color, piece, square, ori)                             \
-    (color * 6 * ARR_SIZE * NUM_ORI + piece * ARR_SIZE * NUM_ORI + \
+    (color * 6 * NUM_SQUARES * NUM_ORI + piece * NUM_SQUARES * NUM_ORI + \
      square * NUM_ORI + ori)
 
-static int32_t best_move_history __BMH_dim__;
+// Every thread that searches (Cilk worker, lazy SMP helper, the UCI thread
+// running entry_point and bench) writes its own killer and history tables,
+// so that these writes, which happen at nearly every node, never bounce a
+// cache line between cores.  The tables are looked up where they are used:
+// a task that resumes on another Cilk worker after a steal reads and writes
+// that worker's tables from then on.  A thread claims a slot the first time
+// it touches the tables and keeps it until release_thread_tables(); the UCI
+// thread and the Cilk workers keep theirs for good, so that their killers
+// carry over from one search to the next.
+//
+// The tables are merged at the end of each iteration
+// (merge_best_move_history()), weighted by the history updates each thread
+// made since the last merge, and handed back to every thread.  A newly
+// claimed slot starts from the last merged history and without killers.
+#define MAX_ORDERING_TABLES 256
+
+typedef struct {
+  move_t killer __KMT_dim__;  // up to 4 killers
+  int32_t best_move_history __BMH_dim__;
+  uint64_t updates;  // history updates since the last merge
+  bool in_use;
+} __attribute__((aligned(64))) orderingTables_t;
+
+static orderingTables_t ordering_tables[MAX_ORDERING_TABLES];
+static int32_t merged_best_move_history __BMH_dim__;
+static __thread orderingTables_t *thread_ordering_tables = NULL;
+
+static orderingTables_t *claim_ordering_tables() {
+  for (int i = 0; i < MAX_ORDERING_TABLES; i++) {
+    orderingTables_t *tables = &ordering_tables[i];
+    if (!tables->in_use &&
+        __sync_bool_compare_and_swap(&tables->in_use, false, true)) {
+      memset(tables->killer, 0, sizeof(tables->killer));
+      memcpy(tables->best_move_history, merged_best_move_history,
+             sizeof(merged_best_move_history));
+      tables->updates = 0;
+      return tables;
+    }
+  }
+  fprintf(stderr, "Out of move ordering tables: too many search threads\n");
+  exit(1);
+}
+
+static inline orderingTables_t *get_ordering_tables() {
+  if (thread_ordering_tables == NULL) {
+    thread_ordering_tables = claim_ordering_tables();
+  }
+  return thread_ordering_tables;
+}
+
+// this thread's killer table
+static inline move_t *killer_table() {
+  return get_ordering_tables()->killer;
+}
+
+// this thread's history table
+static inline int32_t *best_move_history_table() {
+  return get_ordering_tables()->best_move_history;
+}
 
+// Gives up the calling thread's tables.  Must be called before a thread that
+// searched exits.
+void release_thread_tables() {
+  if (thread_ordering_tables != NULL) {
+    __atomic_store_n(&thread_ordering_tables->in_use, false, __ATOMIC_RELEASE);
+    thread_ordering_tables = NULL;
+  }
+}
+
+// Forgets the move history at the start of a search.  The killers are kept.
 void init_best_move_history() {
-  memset(best_move_history, 0, sizeof(best_move_history));
+  memset(merged_best_move_history, 0, sizeof(merged_best_move_history));
+  for (int i = 0; i < MAX_ORDERING_TABLES; i++) {
+    if (__atomic_load_n(&ordering_tables[i].in_use, __ATOMIC_ACQUIRE)) {
+      memset(ordering_tables[i].best_move_history, 0,
+             sizeof(ordering_tables[i].best_move_history));
+      __atomic_store_n(&ordering_tables[i].updates, 0, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// Picks the two killers of every ply by a vote of the threads, each voting
+// with its weight for its first killer and with half of it for its second.
+static void merge_killers(orderingTables_t **in_use, uint64_t *weight,
+                          int count, move_t *killer) {
+  move_t candidates[2 * MAX_ORDERING_TABLES];
+  uint64_t votes[2 * MAX_ORDERING_TABLES];
+  for (int ply = 0; ply < MAX_PLY_IN_SEARCH; ply++) {
+    int num_candidates = 0;
+    for (int i = 0; i < count; i++) {
+      for (int id = 0; id < 2; id++) {
+        move_t mv = in_use[i]->killer[KMT(ply, id)];
+        if (mv == 0 || weight[i] == 0) {
+          continue;
+        }
+        int c = 0;
+        while (c < num_candidates && candidates[c] != mv) {
+          c++;
+        }
+        if (c == num_candidates) {
+          candidates[num_candidates] = mv;
+          votes[num_candidates++] = 0;
+        }
+        votes[c] += (id == 0) ? 2 * weight[i] : weight[i];
+      }
+    }
+    for (int id = 0; id < 2; id++) {
+      int best = -1;
+      for (int c = 0; c < num_candidates; c++) {
+        if (best < 0 || votes[c] > votes[best]) {
+          best = c;
+        }
+      }
+      killer[KMT(ply, id)] = (best < 0) ? 0 : candidates[best];
+      if (best >= 0) {
+        candidates[best] = candidates[--num_candidates];
+        votes[best] = votes[num_candidates];
+      }
+    }
+  }
+}
+
+// Merges the tables of the threads that searched since the last merge,
+// weighted by their history updates, and hands the result back to every
+// thread.  Meant to be called between iterations; lazy SMP helpers may still
+// be searching, in which case an update of theirs can get lost, which only
+// costs a little move ordering.
+void merge_best_move_history() {
+  orderingTables_t *in_use[MAX_ORDERING_TABLES];
+  uint64_t weight[MAX_ORDERING_TABLES];
+  int count = 0;
+  int searched = 0;  // how many of them made any updates
+  uint64_t total_weight = 0;
+  for (int i = 0; i < MAX_ORDERING_TABLES; i++) {
+    if (__atomic_load_n(&ordering_tables[i].in_use, __ATOMIC_ACQUIRE)) {
+      weight[count] = __atomic_exchange_n(&ordering_tables[i].updates, 0,
+                                          __ATOMIC_RELAXED);
+      total_weight += weight[count];
+      searched += weight[count] > 0;
+      in_use[count++] = &ordering_tables[i];
+    }
+  }
+  if (total_weight == 0) {
+    return;
+  }
+
+  for (int j = 0; j < 2 * 6 * NUM_SQUARES * NUM_ORI; j++) {
+    int64_t sum = 0;
+    for (int i = 0; i < count; i++) {
+      sum += (int64_t) weight[i] * in_use[i]->best_move_history[j];
+    }
+    merged_best_move_history[j] = sum / (int64_t) total_weight;
+  }
+  if (count == 1 && searched == 1) {
+    return;  // the merge is the tables themselves
+  }
+
+  move_t merged_killer __KMT_dim__;
+  merge_killers(in_use, weight, count, merged_killer);
+  for (int i = 0; i < count; i++) {
+    memcpy(in_use[i]->best_move_history, merged_best_move_history,
+           sizeof(merged_best_move_history));
+    memcpy(in_use[i]->killer, merged_killer, sizeof(merged_killer));
+  }
 }
 
 static void update_best_move_history(position_t *p, int index_of_best,
                                      sortable_move_t* lst, int count) {
   tbassert(ENABLE_TABLES, "Tables weren't enabled.\n");
 
+  orderingTables_t *tables = get_ordering_tables();
   int color_to_move = color_to_move_of(p);
+  int32_t *best_move_history = tables->best_move_history;
+  tables->updates++;
 
   for (int i = 0; i < count; i++) {
     move_t   mv  = get_move(lst[i]);
     ptype_t  pce = ptype_mv_of(mv);
     rot_t    ro  = rot_of(mv);  // rotation
     square_t fs  = from_square(mv);
-    int      ot  = ORI_MASK & (ori_of(p->board[fs]) + ro);
+    int      ot  = ORI_MASK & (ori_at(p, fs) + ro);
     square_t ts  = to_square(mv);
 
     int  s = best_move_history[BMH(color_to_move, pce, ts, ot)];
 
     if (index_of_best == i) {
-      s = s + 11200;  // number will never exceed 1017
+      s = s + 5600;  // converges to at most 5600 * 0.9 / 0.1 = 50400
     }
     s = s * 0.90;  // decay score over time
 
-    tbassert(s < 102000, "s = %d\n", s);  // or else sorting will fail
+    // or else sorting will fail: the score is used as a 16-bit sort key, and
+    // the keys just below SORT_MASK are reserved for the hash move and killers
+    tbassert(s < 51000, "s = %d\n", s);
 
     best_move_history[BMH(color_to_move, pce, ts, ot)] = s;
   }
@@ -30,9 +30,29 @@ static inline void simple_release(simple_mutex_t* mutex) {
 
 #include <cilk/cilk.h>
 
+// Bumped whenever a node aborts while it has children searching in
+// parallel.  Nodes remember the epoch as of which none of their ancestors had
+// aborted (a new node starts from its parent's), so the chain of ancestors
+// only has to be walked after some node somewhere has aborted since.
+static uint32_t abort_epoch = 0;
+
+static inline uint32_t current_abort_epoch() {
+  return __atomic_load_n(&abort_epoch, __ATOMIC_ACQUIRE);
+}
+
+// Aborts a node that has children searching in parallel.
+static inline void parallel_abort(searchNode *node) {
+  node->abort = true;
+  __atomic_add_fetch(&abort_epoch, 1, __ATOMIC_RELEASE);
+}
+
 // Checks whether a node's parent has aborted.
 //   If this occurs, we should just stop and return 0 immediately.
 static inline bool parallel_parent_aborted(searchNode* node) {
+  uint32_t epoch = current_abort_epoch();
+  if (epoch == node->abort_epoch) {
+    return false;
+  }
   searchNode* pred = node->parent;
   while (pred != NULL) {
     if (pred->abort) {
@@ -40,6 +60,7 @@ static inline bool parallel_parent_aborted(searchNode* node) {
     }
     pred = pred->parent;
   }
+  node->abort_epoch = epoch;
   return false;
 }
 
@@ -68,6 +89,8 @@ static inline void initialize_scout_node(searchNode *node, int depth) {
   node->pov = 1 - node->fake_color_to_move * 2;
   node->best_move_index = 0;  // index of best move found
   node->abort = false;
+  node->abort_epoch = node->parent->abort_epoch;
+  node->clock = node->parent->clock;
 }
 
 static inline bool search_process_score_local(searchNode *node, move_t mv, int mv_index,
@@ -87,6 +110,7 @@ static inline bool search_process_score_local(searchNode *node, move_t mv, int m
     // }
 
     if (result->score >= node->beta) {
+      move_t *killer = killer_table();
       if (mv != killer[KMT(node->ply, 0)] && ENABLE_TABLES) {
         killer[KMT(node->ply, 1)] = killer[KMT(node->ply, 0)];
         killer[KMT(node->ply, 0)] = mv;
@@ -126,7 +150,7 @@ static inline void perform_scout_search_expand_serial(int *break_flag,
                                              SEARCH_SCOUT,
                                              node_count_serial);
   if (!(result.type == MOVE_ILLEGAL || result.type == MOVE_IGNORE
-      || abortf || parallel_parent_aborted(node)))
+      || search_aborted(node) || parallel_parent_aborted(node)))
   {
 
     // A legal move is a move that's not KO, but when we are in quiescence
@@ -175,7 +199,7 @@ void perform_scout_search_expand(int *break_flag,
                                              SEARCH_SCOUT,
                                              node_count_serial);
   if (!(result.type == MOVE_ILLEGAL || result.type == MOVE_IGNORE
-      || abortf || parallel_parent_aborted(node)))
+      || search_aborted(node) || parallel_parent_aborted(node)))
   {
 
     // A legal move is a move that's not KO, but when we are in quiescence
@@ -190,24 +214,13 @@ void perform_scout_search_expand(int *break_flag,
     simple_release(mutex);
 
     if (cutoff) {
-      node->abort = true;
+      // the other children are still searching
+      parallel_abort(node);
       *break_flag = 1;
     }
   }
 }
 
-// static const uint64_t sq_to_board_bit[100] = {
-// 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL,
-// 0ULL, 1ULL<<0, 1ULL<<1, 1ULL<<2, 1ULL<<3, 1ULL<<4, 1ULL<<5, 1ULL<<6, 1ULL<<7, 0ULL,
-// 0ULL, 1ULL<<8, 1ULL<<9, 1ULL<<10, 1ULL<<11, 1ULL<<12, 1ULL<<13, 1ULL<<14, 1ULL<<15, 0ULL,
-// 0ULL, 1ULL<<16, 1ULL<<17, 1ULL<<18, 1ULL<<19, 1ULL<<20, 1ULL<<21, 1ULL<<22, 1ULL<<23, 0ULL,
-// 0ULL, 1ULL<<24, 1ULL<<25, 1ULL<<26, 1ULL<<27, 1ULL<<28, 1ULL<<29, 1ULL<<30, 1ULL<<31, 0ULL,
-// 0ULL, 1ULL<<32, 1ULL<<33, 1ULL<<34, 1ULL<<35, 1ULL<<36, 1ULL<<37, 1ULL<<38, 1ULL<<39, 0ULL,
-// 0ULL, 1ULL<<40, 1ULL<<41, 1ULL<<42, 1ULL<<43, 1ULL<<44, 1ULL<<45, 1ULL<<46, 1ULL<<47, 0ULL,
-// 0ULL, 1ULL<<48, 1ULL<<49, 1ULL<<50, 1ULL<<51, 1ULL<<52, 1ULL<<53, 1ULL<<54, 1ULL<<55, 0ULL,
-// 0ULL, 1ULL<<56, 1ULL<<57, 1ULL<<58, 1ULL<<59, 1ULL<<60, 1ULL<<61, 1ULL<<62, 1ULL<<63, 0ULL,
-// 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL, 0ULL};
-
 static inline bool valid_move(searchNode *node, move_t mv) {
   if (!mv)
     return false;
@@ -215,14 +228,19 @@ static inline bool valid_move(searchNode *node, move_t mv) {
   rot_t    ro  = rot_of(mv);   // rotation
   square_t fs  = from_square(mv);
   square_t ts  = to_square(mv);
-  if (ptype_of(node -> position.board[fs]) != pce)
+  piece_t x = piece_at(&node -> position, fs);
+  if (ptype_of(x) != pce)
     return false;
-  if (color_of(node -> position.board[fs]) != (node -> position.ply & 1))
+  if (color_of(x) != (node -> position.ply & 1))
     return false;
   if (fs == ts && !ro && pce != KING)
     return false;
+  // the transposition table only keeps part of the key, so a hash move may
+  // come from another position: it has to be a one-square step or a rotation
+  if (fs != ts && (ro || !(neighbors_of(fs) & square_bit(ts))))
+    return false;
   // uint64_t laser_map = mark_laser_path_bit(&node -> position, opp_color(node -> position.ply & 1));
-  if (node -> position.laser[opp_color(node -> position.ply & 1)] & sq_to_board_bit[fs])
+  if (node -> position.laser[opp_color(node -> position.ply & 1)] & square_bit(fs))
     return false;
   return true;
 }
@@ -261,28 +279,194 @@ static inline void my_sort_incremental(sortable_move_t *move_list, int num_of_mo
   }
 }
 
-static inline void my_sort_incremental2(sortable_move_t *move_list, int num_of_moves) {
-  num_of_moves -= 1;
-  
-  for (int j = 0; j <= num_of_moves; j++)
-    if (move_list[j] < (1LL << 32)) {
-      sortable_move_t temp = move_list[num_of_moves];
-      move_list[num_of_moves] = move_list[j];
-      move_list[j] = temp;
-      j -= 1;
-      num_of_moves -= 1;
+// -----------------------------------------------------------------------------
+// Staged move picker
+// -----------------------------------------------------------------------------
+
+// Most scout nodes cut off on one of their first few moves, so scout_search
+// hands its moves out in stages instead of generating and sorting all of them
+// up front:
+//
+//   PICK_HASH, PICK_KILLER_A, PICK_KILLER_B
+//                the transposition-table move and the killers, checked with
+//                valid_move() and tried before anything is generated
+//   PICK_HISTORY the generated moves that have a history score, best first
+//   PICK_REST    moves the history table knows nothing about
+//
+// In quiescence only the moves that can change what our laser hits are
+// generated (see generate_zaps).
+//
+// Each stage picks its next move with a selection scan, so a node that cuts
+// off early never pays for sorting the moves it did not look at.  The moves
+// handed out so far are kept in moves[0 .. next) in the order they were
+// tried, which is the layout update_best_move_history() expects.
+typedef enum {
+  PICK_HASH,
+  PICK_KILLER_A,
+  PICK_KILLER_B,
+  PICK_GENERATE,
+  PICK_HISTORY,
+  PICK_REST,
+  PICK_DONE
+} pickStage_t;
+
+typedef struct movePicker {
+  searchNode *node;
+  pickStage_t stage;
+  move_t hash_table_move;
+  move_t killer_a;
+  move_t killer_b;
+  int next;          // number of moves handed out so far
+  int num_of_moves;  // number of moves in moves[]
+  int num_of_scored;  // moves[next .. num_of_scored) have a history score
+  sortable_move_t moves[MAX_NUM_MOVES];
+} movePicker;
+
+static inline void init_move_picker(movePicker *picker, searchNode *node,
+                                    move_t hash_table_move, move_t killer_a,
+                                    move_t killer_b) {
+  picker->node = node;
+  picker->stage = PICK_HASH;
+  picker->hash_table_move = hash_table_move;
+  picker->killer_a = killer_a;
+  picker->killer_b = killer_b;
+  picker->next = 0;
+  picker->num_of_moves = 0;
+}
+
+// Generates the moves that were not handed out by the hash and killer stages,
+// scores them with the move history and moves the ones with a score to the
+// front.
+static inline void generate_picker_moves(movePicker *picker) {
+  searchNode *node = picker->node;
+  position_t *p = &(node->position);
+  color_t fake_color_to_move = color_to_move_of(p);
+  int32_t *best_move_history = best_move_history_table();
+  sortable_move_t *moves = picker->moves + picker->next;
+  // In quiescence only the moves that may zap something are of interest.
+  int num_of_moves = node->quiescence ? generate_zaps(p, moves, false)
+                                      : generate_all(p, moves, false);
+
+  // Score the moves.  The hash move and the killers get the top key for now,
+  // so that they land in the scored part of the list.
+  for (int mv_index = 0; mv_index < num_of_moves; mv_index++) {
+    move_t mv = get_move(moves[mv_index]);
+    if (mv == picker->hash_table_move || mv == picker->killer_a ||
+        mv == picker->killer_b) {
+      set_sort_key(&moves[mv_index], SORT_MASK);
+      continue;
     }
+    ptype_t  pce = ptype_mv_of(mv);
+    rot_t    ro  = rot_of(mv);   // rotation
+    square_t fs  = from_square(mv);
+    int      ot  = ORI_MASK & (ori_at(p, fs) + ro);
+    square_t ts  = to_square(mv);
+    set_sort_key(&moves[mv_index],
+                 best_move_history[BMH(fake_color_to_move, pce, ts, ot)]);
+  }
 
-  for (int j = 0; j <= num_of_moves; j++) {
-    sortable_move_t insert = move_list[j];
-    int hole = j;
-    while (hole > 0 && insert > move_list[hole-1]) {
-      move_list[hole] = move_list[hole-1];
-      hole--;
+  // Move the unscored moves to the back.
+  int num_of_scored = num_of_moves;
+  for (int mv_index = 0; mv_index < num_of_scored; mv_index++) {
+    if (moves[mv_index] <= SORT_MASK) {
+      sortable_move_t temp = moves[--num_of_scored];
+      moves[num_of_scored] = moves[mv_index];
+      moves[mv_index--] = temp;
+    }
+  }
+
+  // Drop the hash move and the killers; the first stages already took care
+  // of them.
+  for (int mv_index = 0; mv_index < num_of_scored; mv_index++) {
+    if ((moves[mv_index] >> SORT_SHIFT) == SORT_MASK) {
+      moves[mv_index--] = moves[--num_of_scored];
+      num_of_moves--;
+      memmove(moves + num_of_scored, moves + num_of_scored + 1,
+              (num_of_moves - num_of_scored) * sizeof(sortable_move_t));
     }
-    // memmove(move_list + hole + 1, move_list + hole, (j - hole) * sizeof(sortable_move_t));
-    move_list[hole] = insert;
   }
+
+  picker->num_of_moves = picker->next + num_of_moves;
+  picker->num_of_scored = picker->next + num_of_scored;
+}
+
+// Puts the next move to try in moves[next] and returns true, or returns false
+// once every move has been handed out.
+static inline bool pick_next_move(movePicker *picker) {
+  searchNode *node = picker->node;
+  while (true) {
+    switch (picker->stage) {
+      case PICK_HASH:
+        picker->stage = PICK_KILLER_A;
+        if (valid_move(node, picker->hash_table_move)) {
+          picker->moves[picker->next++] = picker->hash_table_move;
+          return true;
+        }
+        break;
+      case PICK_KILLER_A:
+        picker->stage = PICK_KILLER_B;
+        if (picker->killer_a != picker->hash_table_move &&
+            valid_move(node, picker->killer_a)) {
+          picker->moves[picker->next++] = picker->killer_a;
+          return true;
+        }
+        break;
+      case PICK_KILLER_B:
+        picker->stage = PICK_GENERATE;
+        if (picker->killer_b != picker->hash_table_move &&
+            picker->killer_b != picker->killer_a &&
+            valid_move(node, picker->killer_b)) {
+          picker->moves[picker->next++] = picker->killer_b;
+          return true;
+        }
+        break;
+      case PICK_GENERATE:
+        generate_picker_moves(picker);
+        picker->stage = PICK_HISTORY;
+        break;
+      case PICK_HISTORY: {
+        int end = picker->num_of_scored;
+        if (picker->next == end) {
+          picker->stage = PICK_REST;
+          break;
+        }
+        // selection scan for the best remaining move
+        sortable_move_t *moves = picker->moves;
+        int best = picker->next;
+        for (int i = best + 1; i < end; i++) {
+          if (moves[i] > moves[best]) {
+            best = i;
+          }
+        }
+        sortable_move_t temp = moves[picker->next];
+        moves[picker->next++] = moves[best];
+        moves[best] = temp;
+        return true;
+      }
+      case PICK_REST:
+        if (picker->next == picker->num_of_moves) {
+          picker->stage = PICK_DONE;
+          break;
+        }
+        picker->next++;
+        return true;
+      case PICK_DONE:
+        return false;
+    }
+  }
+}
+
+// Orders all the moves that have not been handed out yet, so that they can be
+// searched in parallel straight out of moves[next .. num_of_moves).  Returns
+// the total number of moves.
+static inline int pick_remaining_moves(movePicker *picker) {
+  tbassert(picker->stage >= PICK_HISTORY, "stage: %d\n", picker->stage);
+  if (picker->stage == PICK_HISTORY) {
+    sort_incremental(picker->moves + picker->next,
+                     picker->num_of_scored - picker->next);
+  }
+  picker->stage = PICK_DONE;
+  return picker->num_of_moves;
 }
 
 static score_t scout_search(searchNode *node, int depth,
@@ -291,7 +475,7 @@ static score_t scout_search(searchNode *node, int depth,
   initialize_scout_node(node, depth);
 
   // check whether we should abort
-  if (should_abort_check() || parallel_parent_aborted(node)) {
+  if (should_abort_check(node) || parallel_parent_aborted(node)) {
     return 0;
   }
 
@@ -310,94 +494,48 @@ static score_t scout_search(searchNode *node, int depth,
   node->quiescence = pre_evaluation_result.should_enter_quiescence;
 
   // Grab the killer-moves for later use.
+  move_t *killer = killer_table();
   move_t killer_a = killer[KMT(node->ply, 0)];
   move_t killer_b = killer[KMT(node->ply, 1)];
-  // Store the sorted move list on the stack.
-  //   MAX_NUM_MOVES is all that we need.
-  
-  
+
   int number_of_moves_evaluated = 0;
   int break_flag = 0;
-  
 
-    
-  // A simple mutex. See simple_mutex.h for implementation details.
-  
-
-  // Sort the move list.
-
-  // sort_incremental(move_list, num_of_moves);
-  // if (valid_move(node, hash_table_move))
-  //   move_list[0] = hash_table_move;
-  // use this after testing
-  sortable_move_t move_list2[3];
+  // The moves are handed out lazily; the first few are searched serially, in
+  // the hope of an early cutoff.
+  movePicker picker;
+  init_move_picker(&picker, node, hash_table_move, killer_a, killer_b);
 
-  if (valid_move(node, hash_table_move)) {
-    move_list2[number_of_moves_evaluated] = hash_table_move;
-    perform_scout_search_expand_serial(&break_flag, node, move_list2, node_count_serial, killer_a, killer_b, &number_of_moves_evaluated);
-  }
-  
-  
-  if (!break_flag && killer_a != hash_table_move && valid_move(node, killer_a)) {
-    move_list2[number_of_moves_evaluated] = killer_a;
-    perform_scout_search_expand_serial(&break_flag, node, move_list2, node_count_serial, killer_a, killer_b, &number_of_moves_evaluated);
+  while (!break_flag && number_of_moves_evaluated < 5 &&
+         pick_next_move(&picker)) {
+    perform_scout_search_expand_serial(&break_flag, node, picker.moves, node_count_serial, killer_a, killer_b, &number_of_moves_evaluated);
   }
-  
-  if (!break_flag && killer_b != hash_table_move && killer_b != killer_a && valid_move(node, killer_b)) {
-    move_list2[number_of_moves_evaluated] = killer_b;
-    perform_scout_search_expand_serial(&break_flag, node, move_list2, node_count_serial, killer_a, killer_b, &number_of_moves_evaluated);
-  }
-  // static long long count = 0, cnt = 0, count1 = 0, cnt1 = 0;
-  // count += 1;
-  if (!break_flag) {
-    sortable_move_t move_list[MAX_NUM_MOVES];
-    int num_of_moves = get_sortable_move_list2(node, move_list, hash_table_move, killer_a, killer_b);
-    // cnt += 1;
-    // count1 += num_of_moves;
-    // for (int i = 0; i < num_of_moves; i++)
-    //   if (move_list[i] < (1LL << 32))
-    //     cnt1 += 1;
-    // printf("%.5lf %.5lf %.5lf\n", 1.0 * cnt / count, 1.0 * cnt1 / count1, 1.0 * count1 / cnt);
-    my_sort_incremental2(move_list, num_of_moves);
+
+  if (!break_flag && node -> depth > 1) {
+    // A simple mutex. See simple_mutex.h for implementation details.
     simple_mutex_t mutex;
     init_simple_mutex(&mutex);
 
-    int lim = num_of_moves; 
-    if (lim>5) lim = 5;
-
-    for (int mv_index = number_of_moves_evaluated; mv_index < lim && !break_flag; mv_index++) {
-      // Get the next move from the move list.
-      perform_scout_search_expand_serial(&break_flag, node, move_list, node_count_serial, killer_a, killer_b, &number_of_moves_evaluated);
+    int num_of_moves = pick_remaining_moves(&picker);
+    cilk_for (int mv_index = number_of_moves_evaluated; mv_index < num_of_moves; mv_index++) {
+      perform_scout_search_expand(&break_flag, &mutex, node, picker.moves, node_count_serial, killer_a, killer_b, &number_of_moves_evaluated);
+      if (break_flag)
+        break;
     }
-    
-    if (node -> depth > 1 && !break_flag) {
-      cilk_for (int mv_index = lim; mv_index < num_of_moves; mv_index++) {
-        perform_scout_search_expand(&break_flag, &mutex, node, move_list, node_count_serial, killer_a, killer_b, &number_of_moves_evaluated);
-        if (break_flag)
-          break;
-      }
-    }else {
-      for (int mv_index = lim; mv_index < num_of_moves && !break_flag; mv_index++) {
-        perform_scout_search_expand_serial(&break_flag, node, move_list, node_count_serial, killer_a, killer_b, &number_of_moves_evaluated);
-      }
-    }
-    if (parallel_parent_aborted(node)) {
-      return 0;
+  } else {
+    while (!break_flag && pick_next_move(&picker)) {
+      perform_scout_search_expand_serial(&break_flag, node, picker.moves, node_count_serial, killer_a, killer_b, &number_of_moves_evaluated);
     }
+  }
 
-    if (node->quiescence == false) {
-      update_best_move_history(&(node->position), node->best_move_index,
-                               move_list, number_of_moves_evaluated);
-    }
-  }else {
-    if (parallel_parent_aborted(node)) {
-      return 0;
-    }
+  // A search cut short must not leave its partial score in the table.
+  if (search_aborted(node) || parallel_parent_aborted(node)) {
+    return 0;
+  }
 
-    if (node->quiescence == false) {
-      update_best_move_history(&(node->position), node->best_move_index,
-                               move_list2, number_of_moves_evaluated);
-    }
+  if (node->quiescence == false) {
+    update_best_move_history(&(node->position), node->best_move_index,
+                             picker.moves, number_of_moves_evaluated);
   }
 
   tbassert(abs(node->best_score) != -INF, "best_score = %d\n",
@@ -6,41 +6,144 @@
 
 #include "./tt.h"
 
+#include <cilk/cilk.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "./tbassert.h"
+#include "./util.h"
 
 int HASH;     // hash table size in MBytes
 int USE_TT;   // Use the transposition table.
 // Turn off for deterministic behavior of the search.
+int LAZY_CLEAR;  // Clear the table by starting a new age instead of zeroing it.
+int TT_DEPTH_SLOTS;  // Records per set that prefer deeper searches.
+int TT_SHARED;  // If not 0, the shared memory segment that holds the table.
+
+// A record is packed into a single 64-bit word, so it is always read and
+// written whole: workers share the table without locks and can never see half
+// of one store and half of another.  The set index already fixes the low bits
+// of the key, so only the top 16 bits are kept to tell records apart.
+//
+//   63 ... 58 | 57 56 | 55 ... 48 | 47 ... 32 | 31 ... 16 | 15 ... 0
+//      age    | bound |  quality  |   score   |   move    |   key
+//
+// https://chessprogramming.wikispaces.com/Shared+Hash+Table#Lockless
+typedef uint64_t ttEntry_t;
+
+#define ENTRY_KEY_SHIFT 0
+#define ENTRY_MOVE_SHIFT 16
+#define ENTRY_SCORE_SHIFT 32
+#define ENTRY_QUALITY_SHIFT 48
+#define ENTRY_BOUND_SHIFT 56
+#define ENTRY_BOUND_MASK 3
+#define ENTRY_AGE_SHIFT 58
+#define ENTRY_AGE_MASK 0x3F
+
+// the bits of the key that are kept in the entry
+#define key_check_of(key) ((uint16_t) ((key) >> 48))
+
+static inline ttEntry_t pack_record(uint64_t key, move_t move, score_t score,
+                                    int quality, ttBound_t bound,
+                                    unsigned age) {
+  return ((uint64_t) key_check_of(key) << ENTRY_KEY_SHIFT) |
+      ((uint64_t) move << ENTRY_MOVE_SHIFT) |
+      ((uint64_t) (uint16_t) score << ENTRY_SCORE_SHIFT) |
+      ((uint64_t) (uint8_t) quality << ENTRY_QUALITY_SHIFT) |
+      ((uint64_t) (bound & ENTRY_BOUND_MASK) << ENTRY_BOUND_SHIFT) |
+      ((uint64_t) (age & ENTRY_AGE_MASK) << ENTRY_AGE_SHIFT);
+}
 
-// the actual record that holds the data for the transposition
-// typedef to be ttRec_t in tt.h
-struct ttRec {
-  uint64_t  key;
-  move_t    move;
-  score_t   score;
-  int       quality;
-  ttBound_t bound;
-  int       age;
-};
+static inline void unpack_record(uint64_t key, ttEntry_t entry, ttRec_t *rec) {
+  rec->key = key;
+  rec->move = (move_t) (entry >> ENTRY_MOVE_SHIFT);
+  rec->score = (score_t) (uint16_t) (entry >> ENTRY_SCORE_SHIFT);
+  rec->quality = (int8_t) (entry >> ENTRY_QUALITY_SHIFT);
+  rec->bound = (ttBound_t) ((entry >> ENTRY_BOUND_SHIFT) & ENTRY_BOUND_MASK);
+  rec->age = (entry >> ENTRY_AGE_SHIFT) & ENTRY_AGE_MASK;
+}
+
+#define entry_matches(entry, key) \
+  ((uint16_t) ((entry) >> ENTRY_KEY_SHIFT) == key_check_of(key))
 
+static inline ttEntry_t load_entry(ttEntry_t *entry) {
+  return __atomic_load_n(entry, __ATOMIC_RELAXED);
+}
 
-// each set is a 4-way set-associative cache and contains 4 records
-#define RECORDS_PER_SET 4
+static inline void store_entry(ttEntry_t *entry, ttEntry_t value) {
+  __atomic_store_n(entry, value, __ATOMIC_RELAXED);
+}
+
+
+// each set is an 8-way set-associative cache that fills one cache line
+#define RECORDS_PER_SET 8
+#define SET_ALIGNMENT 64
 typedef struct {
-  ttRec_t records[RECORDS_PER_SET];
-} ttSet_t;
+  ttEntry_t records[RECORDS_PER_SET];
+} __attribute__((aligned(SET_ALIGNMENT))) ttSet_t;
 
 
+// A saved or shared table is a header followed by the sets exactly as they are
+// laid out in memory.  Records only mean something under the Zobrist keys that
+// made them, so the header carries those along.
+#define TT_FILE_MAGIC 0x3130545443534c4cULL  // "LLSCTT01"
+
+typedef struct {
+  uint64_t magic;
+  uint64_t num_of_sets;
+  uint64_t age;
+  uint64_t clear_age;
+  uint64_t zob[ZOB_NUM_KEYS];
+} ttFileHeader_t;
+
+// sets start on a cache line boundary within the file
+#define TT_FILE_SETS_OFFSET \
+  ((sizeof(ttFileHeader_t) + SET_ALIGNMENT - 1) & ~(SET_ALIGNMENT - 1))
+
+
+// where the memory of the table came from
+typedef enum {
+  PAGES_NONE,         // no table allocated
+  PAGES_NORMAL,       // posix_memalign
+  PAGES_TRANSPARENT,  // anonymous mapping advised to use transparent huge pages
+  PAGES_HUGETLB,      // anonymous mapping of reserved huge pages
+  PAGES_SHARED        // POSIX shared memory segment, see tt_attach_shared()
+} ttPages_t;
+
+static const char *pages_strs[] = {"none", "normal", "transparent huge",
+                                   "hugetlb", "shared"};
+
 // struct def for the global transposition table
 struct ttHashtable {
   uint64_t num_of_sets;    // how many sets in the hashtable
   uint64_t mask;           // a mask to map from key to set index
   unsigned age;
+  unsigned clear_age;      // age started by the last lazy clear
   ttSet_t *tt_set;         // array of sets that contains the transposition
+  size_t num_of_bytes;     // size of the allocation behind tt_set
+  ttPages_t pages;
+  ttFileHeader_t *shared;  // header of the shared segment, if any
 } hashtable;  // name of the global transposition table
 
+#define HUGE_PAGE_SIZE (2ULL << 20)
+
+
+// Counts of table events, for tuning the table size (see COUNT() in util.h).
+void tt_print_stats(FILE *OUT) {
+  uint64_t probes = counter_total(COUNT_TT_PROBES);
+  uint64_t hits = counter_total(COUNT_TT_HITS);
+  double hit_rate = probes ? 100.0 * hits / probes : 0.0;
+  fprintf(OUT, "info string tt probes %" PRIu64 " hits %" PRIu64 " (%.1f%%)"
+          " stores %" PRIu64 " updates %" PRIu64 " overwrites %" PRIu64
+          " collisions %" PRIu64 "\n", probes, hits, hit_rate,
+          counter_total(COUNT_TT_STORES), counter_total(COUNT_TT_UPDATES),
+          counter_total(COUNT_TT_OVERWRITES),
+          counter_total(COUNT_TT_COLLISIONS));
+}
+
 
 // getting the move out of the record
 move_t tt_move_of(ttRec_t *rec) {
@@ -53,13 +156,115 @@ score_t tt_score_of(ttRec_t *rec) {
 }
 
 size_t tt_get_bytes_per_record() {
-  return sizeof(struct ttRec);
+  return sizeof(ttEntry_t);
 }
 
 uint32_t tt_get_num_of_records() {
   return hashtable.num_of_sets * RECORDS_PER_SET;
 }
 
+// Every probe lands on a random set, so with 4 KB pages nearly every probe
+// also misses the TLB.  Try reserved huge pages first, then an anonymous
+// mapping advised to use transparent huge pages, then plain aligned memory.
+static void tt_alloc_sets(size_t num_of_bytes) {
+  hashtable.tt_set = NULL;
+  hashtable.num_of_bytes = num_of_bytes;
+  hashtable.pages = PAGES_NONE;
+
+#if defined(MAP_ANONYMOUS) && (defined(MAP_HUGETLB) || defined(MADV_HUGEPAGE))
+  size_t len = (num_of_bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+#endif
+
+#if defined(MAP_ANONYMOUS) && defined(MAP_HUGETLB)
+  void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (mem != MAP_FAILED) {
+    hashtable.tt_set = (ttSet_t *) mem;
+    hashtable.num_of_bytes = len;
+    hashtable.pages = PAGES_HUGETLB;
+    return;
+  }
+#endif
+
+#if defined(MAP_ANONYMOUS) && defined(MADV_HUGEPAGE)
+  // Map one huge page extra and trim the ends, so that the table starts on a
+  // huge page boundary.
+  size_t mapped = len + HUGE_PAGE_SIZE;
+  char *base = (char *) mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base != MAP_FAILED) {
+    char *start = (char *) (((uintptr_t) base + HUGE_PAGE_SIZE - 1) &
+                            ~(HUGE_PAGE_SIZE - 1));
+    if (start > base) {
+      munmap(base, start - base);
+    }
+    if (base + mapped > start + len) {
+      munmap(start + len, base + mapped - (start + len));
+    }
+    if (madvise(start, len, MADV_HUGEPAGE) == 0) {
+      hashtable.tt_set = (ttSet_t *) start;
+      hashtable.num_of_bytes = len;
+      hashtable.pages = PAGES_TRANSPARENT;
+      return;
+    }
+    munmap(start, len);
+  }
+#endif
+
+  // one set per cache line, so that a probe touches only one line
+  if (posix_memalign((void **) &hashtable.tt_set, SET_ALIGNMENT,
+                     num_of_bytes) != 0) {
+    hashtable.tt_set = NULL;
+    return;
+  }
+  hashtable.pages = PAGES_NORMAL;
+}
+
+static void tt_release_sets() {
+  switch (hashtable.pages) {
+    case PAGES_NORMAL:
+      free(hashtable.tt_set);
+      break;
+    case PAGES_TRANSPARENT:
+    case PAGES_HUGETLB:
+      munmap(hashtable.tt_set, hashtable.num_of_bytes);
+      break;
+    case PAGES_SHARED:
+      munmap(hashtable.shared, hashtable.num_of_bytes);
+      hashtable.shared = NULL;
+      break;
+    case PAGES_NONE:
+      break;
+  }
+  hashtable.tt_set = NULL;
+  hashtable.pages = PAGES_NONE;
+}
+
+// Zeroes the sets one huge page at a time, spread over the workers.  For a
+// fresh table this is also where its pages are first touched, so the page
+// faults are taken in parallel rather than during the search.
+static void tt_zero_sets(ttSet_t *sets, uint64_t num_of_sets) {
+  const uint64_t chunk = HUGE_PAGE_SIZE / sizeof(ttSet_t);
+  uint64_t num_of_chunks = (num_of_sets + chunk - 1) / chunk;
+
+  cilk_for (uint64_t i = 0; i < num_of_chunks; i++) {
+    uint64_t first = i * chunk;
+    uint64_t count = (num_of_sets - first < chunk) ? num_of_sets - first : chunk;
+    memset(sets + first, 0, sizeof(ttSet_t) * count);
+  }
+}
+
+const char *tt_get_page_type() {
+  return pages_strs[hashtable.pages];
+}
+
+bool tt_is_shared() {
+  return hashtable.pages == PAGES_SHARED;
+}
+
+static void tt_resize_sets(uint64_t num_of_sets);
+static bool tt_attach_shared(uint64_t num_of_sets);
+
 void tt_resize_hashtable(int size_in_meg) {
   uint64_t size_in_bytes = (uint64_t) size_in_meg * (1ULL << 20);
   // total number of sets we could have in the hashtable
@@ -68,14 +273,23 @@ void tt_resize_hashtable(int size_in_meg) {
   uint64_t pow = 1;
   num_of_sets--;
   while (pow <= num_of_sets) pow *= 2;
-  num_of_sets = pow;
+  tt_resize_sets(pow);
+}
 
+// Replaces the table with an empty one of num_of_sets sets, a power of 2.
+// With TT_SHARED set, attaches to that segment instead; if other processes
+// already made it, its size wins and its records are kept.
+static void tt_resize_sets(uint64_t num_of_sets) {
   hashtable.num_of_sets = num_of_sets;
   hashtable.mask = num_of_sets - 1;
   hashtable.age = 0;
+  hashtable.clear_age = 0;
 
-  free(hashtable.tt_set);  // free the old ones
-  hashtable.tt_set = (ttSet_t *) malloc(sizeof(ttSet_t) * num_of_sets);
+  tt_release_sets();  // free the old ones
+  if (TT_SHARED && tt_attach_shared(num_of_sets)) {
+    return;
+  }
+  tt_alloc_sets(sizeof(ttSet_t) * num_of_sets);
 
   if (hashtable.tt_set == NULL) {
     fprintf(stderr,  "Hash table too big\n");
@@ -83,104 +297,203 @@ void tt_resize_hashtable(int size_in_meg) {
   }
 
   // might as well clear the table while we are at it
-  memset(hashtable.tt_set, 0, sizeof(ttSet_t) * hashtable.num_of_sets);
+  tt_zero_sets(hashtable.tt_set, hashtable.num_of_sets);
 }
 
 void tt_make_hashtable(int size_in_meg) {
   hashtable.tt_set = NULL;
+  hashtable.pages = PAGES_NONE;
+  hashtable.shared = NULL;
   tt_resize_hashtable(size_in_meg);
 }
 
 void tt_free_hashtable() {
-  free(hashtable.tt_set);
-  hashtable.tt_set = NULL;
+  tt_release_sets();
+}
+
+// all processes on a shared table count ages together
+static inline unsigned next_age() {
+  if (hashtable.shared) {
+    return __atomic_add_fetch(&hashtable.shared->age, 1, __ATOMIC_RELAXED);
+  }
+  return hashtable.age + 1;
 }
 
 // age the hash table by incrementing global age
 void tt_age_hashtable() {
-  hashtable.age++;
+  hashtable.age = next_age();
 }
 
+// With LAZY_CLEAR the table is not touched: a new age starts, and records
+// from before it count as empty (see is_stale()).  Otherwise the table is
+// zeroed by all workers.  A shared table is always cleared lazily, so that
+// the other processes keep their records.
 void tt_clear_hashtable() {
-  memset(hashtable.tt_set, 0, sizeof(ttSet_t) * hashtable.num_of_sets);
+  if (LAZY_CLEAR || hashtable.shared) {
+    hashtable.age = next_age();
+    hashtable.clear_age = hashtable.age;
+    return;
+  }
+  tt_zero_sets(hashtable.tt_set, hashtable.num_of_sets);
   hashtable.age = 0;
+  hashtable.clear_age = 0;
+}
+
+
+// Whether a record was stored before the last lazy clear.  Records only keep
+// the age modulo 64, so this can only be told for the first 63 ages after the
+// clear; after that, records older than the clear count as ordinary records
+// again.  They still describe their positions correctly, they are just not
+// wiped.
+static inline bool is_stale(unsigned rec_age) {
+  unsigned since_clear = hashtable.age - hashtable.clear_age;
+  if (since_clear >= ENTRY_AGE_MASK) {
+    return false;
+  }
+  return ((rec_age - hashtable.clear_age) & ENTRY_AGE_MASK) > since_clear;
+}
+
+// How much a record of another position is worth keeping when a store has
+// to evict something: records of the current search first, then exact
+// scores, then deeper ones.
+static inline int keep_value(ttRec_t *rec, unsigned age) {
+  return (rec->age == age ? 256 : 0) + (rec->bound == EXACT ? 128 : 0) +
+      rec->quality;
+}
+
+// Whether a new record of depth and bound_type may take a depth-preferred
+// slot that holds rec, a live record of another position.
+static inline bool takes_depth_slot(ttRec_t *rec, unsigned age, int depth,
+                                    int bound_type) {
+  if (rec->age != age || depth > rec->quality) {
+    return true;
+  }
+  return depth == rec->quality && (bound_type == EXACT || rec->bound != EXACT);
+}
+
+// The first empty slot from first on, or else the one least worth keeping.
+static inline int weakest_slot(ttRec_t *recs, bool *empty, int first,
+                               unsigned age) {
+  int weakest = first;
+  for (int i = first; i < RECORDS_PER_SET; i++) {
+    if (empty[i]) {
+      return i;
+    }
+    if (keep_value(&recs[i], age) < keep_value(&recs[weakest], age)) {
+      weakest = i;
+    }
+  }
+  return weakest;
 }
 
+static inline void count_eviction(bool empty, ttRec_t *rec, unsigned age) {
+  if (!empty) {
+    COUNT(COUNT_TT_OVERWRITES);
+    if (rec->age == age) {
+      COUNT(COUNT_TT_COLLISIONS);
+    }
+  }
+}
 
+// Two-tier replacement.  The first TT_DEPTH_SLOTS records of a set only give
+// way to searches at least as deep, or to anything once they are from an
+// older search; a record pushed out of them moves down if it is worth more
+// than what it would replace.  The remaining records take whatever comes and
+// evict the one least worth keeping.  A record of the same position is
+// always updated, unless that would swap a deeper exact score of the current
+// search for a bound.
 void tt_hashtable_put(uint64_t key, int depth, score_t score,
                       int bound_type, move_t move) {
   tbassert(abs(score) != INF, "Score was infinite.\n");
 
   uint64_t set_index = key & hashtable.mask;
-  // current record that we are looking into
-  ttRec_t *curr_rec = hashtable.tt_set[set_index].records;
-  // best record to replace that we found so far
-  ttRec_t *rec_to_replace = curr_rec;
-  int replacemt_val = -99;            // value of doing the replacement
+  ttEntry_t *set = hashtable.tt_set[set_index].records;
+  ttEntry_t entries[RECORDS_PER_SET];
+  ttRec_t recs[RECORDS_PER_SET];
+  bool empty[RECORDS_PER_SET];
+  unsigned age = hashtable.age & ENTRY_AGE_MASK;
 
   move = move & MOVE_MASK;
+  COUNT(COUNT_TT_STORES);
 
-  for (int i = 0; i < RECORDS_PER_SET; i++, curr_rec++) {
-    int value = 0;  // points for sorting
+  for (int i = 0; i < RECORDS_PER_SET; i++) {
+    entries[i] = load_entry(&set[i]);
+    unpack_record(key, entries[i], &recs[i]);
+    empty[i] = !entries[i] || is_stale(recs[i].age);
 
-    // always use entry if it's not used or has same key
-    if (!curr_rec->key || key == curr_rec->key) {
+    if (!empty[i] && entry_matches(entries[i], key)) {
+      if (recs[i].bound == EXACT && bound_type != EXACT &&
+          recs[i].quality > depth && recs[i].age == age) {
+        return;
+      }
       if (move == 0) {
-        move = curr_rec->move;
+        move = recs[i].move;
       }
-      curr_rec->key = key;
-      curr_rec->quality = depth;
-      curr_rec->move = move;
-      curr_rec->age = hashtable.age;
-      curr_rec->score = score;
-      curr_rec->bound = (ttBound_t) bound_type;
-
+      COUNT(COUNT_TT_UPDATES);
+      store_entry(&set[i], pack_record(key, move, score, depth,
+                                       (ttBound_t) bound_type, age));
       return;
     }
+  }
 
-    // otherwise, potential candidate for replacement
-    if (curr_rec->age == hashtable.age) {
-      value -= 6;   // prefer not to replace if same age
+  int depth_slots = TT_DEPTH_SLOTS;
+  tbassert(depth_slots < RECORDS_PER_SET, "depth_slots: %d\n", depth_slots);
+  int slot = -1;
+  for (int i = 0; i < depth_slots; i++) {
+    if (empty[i] || takes_depth_slot(&recs[i], age, depth, bound_type)) {
+      slot = i;
+      break;
     }
-    if (curr_rec->quality < rec_to_replace->quality) {
-      value += 1;   // prefer to replace if worse quality
-    }
-    if (value > replacemt_val) {
-      replacemt_val = value;
-      rec_to_replace = curr_rec;
+  }
+
+  if (slot >= 0 && !empty[slot]) {
+    int down = weakest_slot(recs, empty, depth_slots, age);
+    if (empty[down] ||
+        keep_value(&recs[down], age) < keep_value(&recs[slot], age)) {
+      count_eviction(empty[down], &recs[down], age);
+      store_entry(&set[down], entries[slot]);
+    } else {
+      count_eviction(false, &recs[slot], age);
     }
+  } else if (slot < 0) {
+    slot = weakest_slot(recs, empty, depth_slots, age);
+    count_eviction(empty[slot], &recs[slot], age);
   }
-  // update the record that we are replacing with this record
-  rec_to_replace->key = key;
-  rec_to_replace->quality = depth;
-  rec_to_replace->move = move;
-  rec_to_replace->age = hashtable.age;
-  rec_to_replace->score = score;
-  rec_to_replace->bound = (ttBound_t) bound_type;
+
+  store_entry(&set[slot], pack_record(key, move, score, depth,
+                                      (ttBound_t) bound_type, age));
 }
 
 
-inline ttRec_t *tt_hashtable_get(uint64_t key) {
+// Starts loading the set for key into the cache, so that a tt_hashtable_get()
+// for key shortly after does not have to wait on memory.
+void tt_prefetch(uint64_t key) {
+  __builtin_prefetch(&hashtable.tt_set[key & hashtable.mask]);
+}
+
+
+// Copies the record for key into *rec.  Returns false if there is none.
+bool tt_hashtable_get(uint64_t key, ttRec_t *rec) {
   if (!USE_TT) {
-    return NULL;  // done if we are not using the transposition table
+    return false;  // done if we are not using the transposition table
   }
 
   uint64_t set_index = key & hashtable.mask;
-  ttRec_t *rec = hashtable.tt_set[set_index].records;
-
-  //Assume RECORDS_PER_SET= 1
-  // if (rec -> key == key)
-  //   return rec;
-  // else
-  //   return NULL;
-  ttRec_t *found = NULL;
-  for (int i = 0; i < RECORDS_PER_SET; i++, rec++) {
-    if (rec->key == key) {  // found the record that we are looking for
-      found = rec;
-      return rec;
+  ttEntry_t *slot = hashtable.tt_set[set_index].records;
+
+  COUNT(COUNT_TT_PROBES);
+  for (int i = 0; i < RECORDS_PER_SET; i++, slot++) {
+    ttEntry_t entry = load_entry(slot);
+    if (entry && entry_matches(entry, key)) {  // found the record
+      unpack_record(key, entry, rec);
+      if (is_stale(rec->age)) {
+        return false;
+      }
+      COUNT(COUNT_TT_HITS);
+      return true;
     }
   }
-  return found;
+  return false;
 }
 
 
@@ -237,3 +550,343 @@ bool tt_is_usable(ttRec_t *tt, int depth, score_t beta) {
   return false;
 }
 
+
+
+// -----------------------------------------------------------------------------
+// Saving and loading
+// -----------------------------------------------------------------------------
+
+// Writes the table to filename through a shared mapping, leaving out records
+// of depth less than min_depth.
+bool tt_save_hashtable(const char *filename, int min_depth, FILE *OUT) {
+  size_t num_of_bytes = TT_FILE_SETS_OFFSET +
+      sizeof(ttSet_t) * hashtable.num_of_sets;
+
+  int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, num_of_bytes) != 0) {
+    fprintf(OUT, "info string cannot write %s\n", filename);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return false;
+  }
+  char *file = (char *) mmap(NULL, num_of_bytes, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, fd, 0);
+  close(fd);
+  if (file == MAP_FAILED) {
+    fprintf(OUT, "info string cannot map %s\n", filename);
+    return false;
+  }
+
+  ttFileHeader_t *header = (ttFileHeader_t *) file;
+  header->magic = TT_FILE_MAGIC;
+  header->num_of_sets = hashtable.num_of_sets;
+  header->age = hashtable.age;
+  header->clear_age = hashtable.clear_age;
+  zob_export(header->zob);
+
+  ttSet_t *sets = (ttSet_t *) (file + TT_FILE_SETS_OFFSET);
+  const uint64_t chunk = HUGE_PAGE_SIZE / sizeof(ttSet_t);
+  uint64_t num_of_chunks = (hashtable.num_of_sets + chunk - 1) / chunk;
+  uint64_t saved = 0;
+
+  cilk_for (uint64_t c = 0; c < num_of_chunks; c++) {
+    uint64_t first = c * chunk;
+    uint64_t last = (first + chunk < hashtable.num_of_sets) ?
+        first + chunk : hashtable.num_of_sets;
+    uint64_t my_saved = 0;
+    for (uint64_t i = first; i < last; i++) {
+      for (int j = 0; j < RECORDS_PER_SET; j++) {
+        ttEntry_t entry = load_entry(&hashtable.tt_set[i].records[j]);
+        ttRec_t rec;
+        unpack_record(0, entry, &rec);
+        if (!entry || is_stale(rec.age) || rec.quality < min_depth) {
+          entry = 0;
+        } else {
+          my_saved++;
+        }
+        sets[i].records[j] = entry;
+      }
+    }
+    __sync_fetch_and_add(&saved, my_saved);
+  }
+
+  munmap(file, num_of_bytes);
+  fprintf(OUT, "info string saved %" PRIu64 " records to %s\n", saved,
+          filename);
+  return true;
+}
+
+// Replaces the table, and the Zobrist keys, with the ones saved in filename.
+// The caller has to recompute the keys of any positions it holds.
+bool tt_load_hashtable(const char *filename, FILE *OUT) {
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(OUT, "info string cannot read %s\n", filename);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return false;
+  }
+  if (hashtable.shared) {
+    fprintf(OUT, "info string cannot load into a shared hash table\n");
+    close(fd);
+    return false;
+  }
+  size_t num_of_bytes = st.st_size;
+  char *file = NULL;
+  if (num_of_bytes >= TT_FILE_SETS_OFFSET) {
+    file = (char *) mmap(NULL, num_of_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (file == NULL || file == MAP_FAILED) {
+    fprintf(OUT, "info string %s is not a saved hash table\n", filename);
+    return false;
+  }
+
+  ttFileHeader_t *header = (ttFileHeader_t *) file;
+  uint64_t num_of_sets = header->num_of_sets;
+  if (header->magic != TT_FILE_MAGIC || num_of_sets == 0 ||
+      (num_of_sets & (num_of_sets - 1)) != 0 ||
+      num_of_bytes != TT_FILE_SETS_OFFSET + sizeof(ttSet_t) * num_of_sets) {
+    fprintf(OUT, "info string %s is not a saved hash table\n", filename);
+    munmap(file, num_of_bytes);
+    return false;
+  }
+
+  tt_resize_sets(num_of_sets);
+  hashtable.age = header->age;
+  hashtable.clear_age = header->clear_age;
+  zob_import(header->zob);
+
+  ttSet_t *sets = (ttSet_t *) (file + TT_FILE_SETS_OFFSET);
+  const uint64_t chunk = HUGE_PAGE_SIZE / sizeof(ttSet_t);
+  uint64_t num_of_chunks = (num_of_sets + chunk - 1) / chunk;
+  cilk_for (uint64_t c = 0; c < num_of_chunks; c++) {
+    uint64_t first = c * chunk;
+    uint64_t count = (num_of_sets - first < chunk) ? num_of_sets - first : chunk;
+    memcpy(hashtable.tt_set + first, sets + first, sizeof(ttSet_t) * count);
+  }
+
+  munmap(file, num_of_bytes);
+  HASH = (sizeof(ttSet_t) * num_of_sets) >> 20;
+  if (HASH < 1) {
+    HASH = 1;
+  }
+  fprintf(OUT, "info string loaded a table of %" PRIu64 " records from %s\n",
+          num_of_sets * RECORDS_PER_SET, filename);
+  return true;
+}
+
+
+// -----------------------------------------------------------------------------
+// Shared memory
+// -----------------------------------------------------------------------------
+
+// With TT_SHARED = n the table lives in the POSIX shared memory segment
+// /leiserchess-tt-n, so that several engine processes analysing on one
+// machine search with one table.  Records are single words, so sharing them
+// between processes is no different from sharing them between workers.
+//
+// The segment has the layout of a saved table (see ttFileHeader_t).  The process that
+// creates it sizes it and puts its Zobrist keys in the header; processes that
+// attach later take the size and the keys from there, and have to recompute
+// the keys of any positions they hold.  The segment outlives the processes;
+// remove /dev/shm/leiserchess-tt-n to free it.
+#define TT_SHARED_NAME "/leiserchess-tt-%d"
+
+// how long to wait for the creator of a segment to set it up
+#define TT_SHARED_WAIT_MS 1000
+
+static bool tt_attach_shared(uint64_t num_of_sets) {
+  char name[32];
+  snprintf(name, sizeof(name), TT_SHARED_NAME, TT_SHARED);
+
+  size_t num_of_bytes = TT_FILE_SETS_OFFSET + sizeof(ttSet_t) * num_of_sets;
+  bool created = true;
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0 && errno == EEXIST) {
+    created = false;
+    fd = shm_open(name, O_RDWR, 0600);
+  }
+  if (fd < 0) {
+    return false;
+  }
+
+  if (created) {
+    // a fresh segment reads as zeros, so the table starts out empty
+    if (ftruncate(fd, num_of_bytes) != 0) {
+      close(fd);
+      shm_unlink(name);
+      return false;
+    }
+  } else {
+    struct stat st;
+    for (int ms = 0; ; ms++) {
+      if (fstat(fd, &st) != 0 || ms == TT_SHARED_WAIT_MS) {
+        close(fd);
+        return false;
+      }
+      if ((size_t) st.st_size > TT_FILE_SETS_OFFSET) {
+        break;
+      }
+      usleep(1000);
+    }
+    num_of_bytes = st.st_size;
+  }
+
+  char *mem = (char *) mmap(NULL, num_of_bytes, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    if (created) {
+      shm_unlink(name);
+    }
+    return false;
+  }
+
+  ttFileHeader_t *header = (ttFileHeader_t *) mem;
+  if (created) {
+    header->num_of_sets = num_of_sets;
+    zob_export(header->zob);
+    __atomic_store_n(&header->magic, TT_FILE_MAGIC, __ATOMIC_RELEASE);
+  } else {
+    for (int ms = 0; __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) == 0 &&
+             ms < TT_SHARED_WAIT_MS; ms++) {
+      usleep(1000);
+    }
+    num_of_sets = header->num_of_sets;
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != TT_FILE_MAGIC ||
+        num_of_sets == 0 || (num_of_sets & (num_of_sets - 1)) != 0 ||
+        num_of_bytes != TT_FILE_SETS_OFFSET + sizeof(ttSet_t) * num_of_sets) {
+      munmap(mem, num_of_bytes);
+      return false;
+    }
+    zob_import(header->zob);
+  }
+
+  hashtable.shared = header;
+  hashtable.tt_set = (ttSet_t *) (mem + TT_FILE_SETS_OFFSET);
+  hashtable.num_of_bytes = num_of_bytes;
+  hashtable.pages = PAGES_SHARED;
+  hashtable.num_of_sets = num_of_sets;
+  hashtable.mask = num_of_sets - 1;
+  // Records of the other processes are not stale to this one.
+  hashtable.age = __atomic_load_n(&header->age, __ATOMIC_RELAXED);
+  hashtable.clear_age = hashtable.age - ENTRY_AGE_MASK;
+
+  HASH = (sizeof(ttSet_t) * num_of_sets) >> 20;
+  if (HASH < 1) {
+    HASH = 1;
+  }
+  return true;
+}
+
+
+// -----------------------------------------------------------------------------
+// Stress test
+// -----------------------------------------------------------------------------
+
+// Number of sets in the table used by tt_stress_test().  Small, so that the
+// workers keep colliding on the same entries.
+#define STRESS_SETS 16
+#define STRESS_KEYS 4096
+
+// Stress key n keeps n + 1 in the bits that the entries store, so every
+// entry in the table can be traced back to the key that wrote it, and the
+// record that key stores can be recomputed.
+static inline uint64_t stress_key(uint32_t n) {
+  return ((uint64_t) (n + 1) << 48) | ((n * 2654435761U) & 0xffffffffffffULL);
+}
+
+static inline move_t stress_move(uint64_t key) {
+  return (move_t) (key >> 32) | 1;  // never 0, which put() treats as no move
+}
+
+static inline score_t stress_score(uint64_t key) {
+  return (score_t) ((key >> 40) % 2000) - 1000;
+}
+
+// Whether an entry holds exactly what its key stored.
+static inline bool is_stress_entry(ttEntry_t entry) {
+  uint32_t n = key_check_of((uint64_t) entry << 48) - 1;
+  if (n >= STRESS_KEYS) {
+    return false;
+  }
+  ttRec_t rec;
+  uint64_t key = stress_key(n);
+  unpack_record(key, entry, &rec);
+  return rec.move == stress_move(key) && rec.score == stress_score(key) &&
+      rec.bound == LOWER;
+}
+
+// Stores and probes stress keys on a tiny table from all workers and counts
+// what the probes saw.  "wrong" counts probes that returned a record other
+// than the one their key stores, "torn" counts entries in the table that
+// mix two stores; both must be 0.  The regular table is set aside while this
+// runs.
+void tt_stress_test(int rounds, FILE *OUT) {
+  struct ttHashtable saved = hashtable;
+  int saved_use_tt = USE_TT;
+
+  hashtable.num_of_sets = STRESS_SETS;
+  hashtable.mask = STRESS_SETS - 1;
+  hashtable.age = 0;
+  if (posix_memalign((void **) &hashtable.tt_set, SET_ALIGNMENT,
+                     sizeof(ttSet_t) * STRESS_SETS) != 0) {
+    fprintf(stderr, "Hash table too big\n");
+    exit(1);
+  }
+  memset(hashtable.tt_set, 0, sizeof(ttSet_t) * STRESS_SETS);
+  USE_TT = true;
+
+  const int num_tasks = 64;
+  uint64_t probes = 0, hits = 0, torn = 0, wrong = 0;
+
+  cilk_for (int task = 0; task < num_tasks; task++) {
+    uint64_t my_probes = 0, my_hits = 0, my_torn = 0, my_wrong = 0;
+    uint32_t seed = task;
+
+    for (int r = 0; r < rounds; r++) {
+      seed = seed * 1103515245 + 12345;
+      uint64_t key = stress_key((seed >> 16) % STRESS_KEYS);
+      if (r & 1) {
+        tt_hashtable_put(key, (seed >> 8) & 31, stress_score(key), LOWER,
+                         stress_move(key));
+        continue;
+      }
+
+      ttRec_t rec;
+      my_probes++;
+      if (tt_hashtable_get(key, &rec)) {
+        my_hits++;
+        if (rec.move != stress_move(key) || rec.score != stress_score(key) ||
+            rec.bound != LOWER) {
+          my_wrong++;
+        }
+      }
+
+      ttEntry_t *slot = hashtable.tt_set[key & hashtable.mask].records;
+      for (int i = 0; i < RECORDS_PER_SET; i++) {
+        ttEntry_t entry = load_entry(&slot[i]);
+        if (entry && !is_stress_entry(entry)) {
+          my_torn++;
+        }
+      }
+    }
+
+    __sync_fetch_and_add(&probes, my_probes);
+    __sync_fetch_and_add(&hits, my_hits);
+    __sync_fetch_and_add(&torn, my_torn);
+    __sync_fetch_and_add(&wrong, my_wrong);
+  }
+
+  fprintf(OUT, "info string ttstress tasks %d probes %" PRIu64 " hits %" PRIu64
+          " torn %" PRIu64 " wrong %" PRIu64 "\n",
+          num_tasks, probes, hits, torn, wrong);
+
+  free(hashtable.tt_set);
+  hashtable = saved;
+  USE_TT = saved_use_tt;
+}
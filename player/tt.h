@@ -21,9 +21,16 @@ typedef enum {
   EXACT
 } ttBound_t;
 
-// Just forward declarations
-// The real definition is in tt.c
-typedef struct ttRec ttRec_t;
+// A copy of a record taken out of the table by tt_hashtable_get().  The table
+// itself stores records in a packed form, see tt.c.
+typedef struct ttRec {
+  uint64_t  key;
+  move_t    move;
+  score_t   score;
+  int       quality;
+  ttBound_t bound;
+  int       age;
+} ttRec_t;
 
 // accessor methods for accessing move and score recorded in ttRec_t
 static inline move_t tt_move_of(ttRec_t *tt);
@@ -31,20 +38,29 @@ static inline score_t tt_score_of(ttRec_t *tt);
 
 static inline size_t tt_get_bytes_per_record();
 static inline uint32_t tt_get_num_of_records();
+static inline const char *tt_get_page_type();
+static inline bool tt_is_shared();
 
 // operations on the global hashtable
 static inline void tt_make_hashtable(int sizeMeg);
 static inline void tt_resize_hashtable(int sizeInMeg);
 static inline void tt_free_hashtable();
 static inline void tt_age_hashtable();
+static inline void tt_clear_hashtable();
 
 // putting / getting transposition data into / from hashtable
 static inline void tt_hashtable_put(uint64_t key, int depth, score_t score,
                       int type, move_t move);
-static inline ttRec_t *tt_hashtable_get(uint64_t key);
+static inline bool tt_hashtable_get(uint64_t key, ttRec_t *rec);
+static inline void tt_prefetch(uint64_t key);
 
 static inline score_t tt_adjust_score_from_hashtable(ttRec_t *rec, int ply);
 static inline score_t tt_adjust_score_for_hashtable(score_t score, int ply);
 static inline bool tt_is_usable(ttRec_t *tt, int depth, score_t beta);
 
+void tt_stress_test(int rounds, FILE *OUT);
+void tt_print_stats(FILE *OUT);
+bool tt_save_hashtable(const char *filename, int min_depth, FILE *OUT);
+bool tt_load_hashtable(const char *filename, FILE *OUT);
+
 #endif  // TT_H
@@ -13,6 +13,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 void debug_log(int log_level, const char *errstr, ...) {
   if (log_level >= DEBUG_LOG_THRESH) {
@@ -79,3 +80,51 @@ uint64_t myrand() {
 
   return x + y + z1 + ((uint64_t)z2 << 32);  // Return 64-bit result
 }
+
+#define MAX_COUNTERS 256
+
+static counters_t counters[MAX_COUNTERS];
+static __thread counters_t *my_counters = NULL;
+
+static counters_t *claim_counters() {
+  for (int i = 0; i < MAX_COUNTERS; i++) {
+    if (!counters[i].in_use &&
+        __sync_bool_compare_and_swap(&counters[i].in_use, false, true)) {
+      return &counters[i];
+    }
+  }
+  fprintf(stderr, "Out of counters: too many threads\n");
+  exit(1);
+}
+
+// The calling thread's counters.
+counters_t *thread_counters() {
+  if (my_counters == NULL) {
+    my_counters = claim_counters();
+  }
+  return my_counters;
+}
+
+// Gives up the calling thread's counters.  Must be called before a thread
+// that counted exits.
+void release_thread_counters() {
+  if (my_counters != NULL) {
+    __atomic_store_n(&my_counters->in_use, false, __ATOMIC_RELEASE);
+    my_counters = NULL;
+  }
+}
+
+// Zeroes every counter.  Meant to be called while no other thread counts.
+void reset_counters() {
+  for (int i = 0; i < MAX_COUNTERS; i++) {
+    memset(counters[i].count, 0, sizeof(counters[i].count));
+  }
+}
+
+uint64_t counter_total(counter_t counter) {
+  uint64_t total = 0;
+  for (int i = 0; i < MAX_COUNTERS; i++) {
+    total += __atomic_load_n(&counters[i].count[counter], __ATOMIC_RELAXED);
+  }
+  return total;
+}
@@ -4,6 +4,7 @@
 #define UTIL_H
 
 #include <inttypes.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -27,11 +28,52 @@
 #define WHEN_DEBUG_VERBOSE(ex)
 #endif  // EVAL_DEBUG_VERBOSE
 
+// Counters that would slow down the code they measure even when kept per
+// thread (laser path updates, at every move made) are only counted in builds
+// with STATS set (make STATS=1).
+#ifndef STATS
+#define STATS 0
+#endif
+
+#if STATS
+#define WHEN_STATS(ex) ex
+#else
+#define WHEN_STATS(ex)
+#endif
+
+// Event counters that are kept in every build.  Each thread counts into a
+// slot of its own, so COUNT() is a plain add to a cache line that no other
+// thread writes, and counter_total() sums the slots.  A thread claims its
+// slot the first time it counts, and keeps it until
+// release_thread_counters(); the counts stay in the slot for the totals.
+typedef enum {
+  COUNT_TT_PROBES,
+  COUNT_TT_HITS,
+  COUNT_TT_STORES,
+  COUNT_TT_UPDATES,
+  COUNT_TT_OVERWRITES,   // stores that evicted a live record of another position
+  COUNT_TT_COLLISIONS,   // overwrites whose victim was stored by this search
+  COUNT_EVAL_PROBES,
+  COUNT_EVAL_HITS,
+  NUM_COUNTERS
+} counter_t;
+
+#define COUNT(counter) (thread_counters()->count[counter]++)
+
+typedef struct counters {
+  uint64_t count[NUM_COUNTERS];
+  bool in_use;
+} __attribute__((aligned(64))) counters_t;
+
 #if MACPORT
 #include "./fasttime.h"
 #endif
 void debug_log(int log_level, const char *str, ...);
 static inline double  milliseconds();
 static inline uint64_t myrand();
+static inline counters_t *thread_counters();
+void release_thread_counters();
+void reset_counters();
+uint64_t counter_total(counter_t counter);
 
 #endif  // UTIL_H
@@ -0,0 +1,30 @@
+#!/bin/bash
+# Checks that unmake_move() takes every move back to the exact position it
+# was made from.  Runs perft from each position of the opening book with a
+# player built with DEBUG=1, whose perft asserts the round trip after every
+# in-place move; a failed assertion aborts the player.
+#
+# Usage: ./make_unmake.sh [player] [depth]
+
+player=${1:-../player/leiserchess}
+depth=${2:-3}
+book=$(dirname "$0")/book.dta
+
+positions=$(wc -l < "$book")
+out=$({
+  while read -r line; do
+    echo "position startpos moves $line"
+    echo "perft $depth"
+  done < "$book"
+  echo "quit"
+} | "$player" 2>&1)
+status=$?
+
+done_count=$(echo "$out" | grep -c "^perft *$depth [0-9]")
+echo "perft $depth: $done_count of $positions book positions"
+if [ $status -ne 0 ] || [ "$done_count" != "$positions" ]; then
+  echo "$out" | grep -i "assert"
+  echo "FAIL"
+  exit 1
+fi
+echo "OK"
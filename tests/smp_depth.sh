@@ -0,0 +1,35 @@
+#!/bin/bash
+# Checks that a lazy SMP search (threads > 1) reaches the depth it was asked
+# for, just like a search with one thread, and that its helper threads did
+# search.  The helper threads must never cut the main search short.
+#
+# Usage: ./smp_depth.sh [player] [depth] [threads]
+
+player=${1:-../player/leiserchess}
+depth=${2:-6}
+threads=${3:-4}
+
+# Prints the depth of the last iteration the search reported, and the number
+# of nodes the helpers searched.
+reached_depth() {
+  {
+    echo "setoption name threads value $1"
+    echo "setoption name smp_mode value 1"
+    echo "position startpos"
+    echo "go depth $depth"
+    echo "quit"
+  } | "$player" | awk '$1 == "info" && $2 == "depth" { d = $3 }
+                       /lazy smp helpers searched/ { n = $7 }
+                       END { print d, n + 0 }'
+}
+
+read -r serial _ < <(reached_depth 1)
+read -r parallel helper_nodes < <(reached_depth "$threads")
+echo "depth $depth: threads 1 reached $serial, threads $threads reached $parallel" \
+     "(helpers searched $helper_nodes nodes)"
+if [ "$serial" != "$depth" ] || [ "$parallel" != "$serial" ] ||
+   [ "$helper_nodes" -eq 0 ]; then
+  echo "FAIL"
+  exit 1
+fi
+echo "OK"